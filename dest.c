@@ -0,0 +1,125 @@
+/* Destinations of NORI traffic.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "htable.h"
+#include "dest.h"
+
+/* Destinations by hash; the ones with the same hash are chained. */
+static struct htable dests = {0};
+/* Lock protecting the destinations. */
+static pthread_mutex_t dests_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a hash of name, instance and DIF. */
+static unsigned int dest_hash(
+	const char * name, const char * instance, const char * dif) {
+
+	unsigned int h = 2166136261u;
+
+	for(; *name; name++) {
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	}
+
+	/* Separator, so that "ab","c" and "a","bc" differ. */
+	h = (h ^ 0xff) * 16777619u;
+
+	for(; *instance; instance++) {
+		h = (h ^ (unsigned char)*instance) * 16777619u;
+	}
+
+	h = (h ^ 0xff) * 16777619u;
+
+	for(; *dif; dif++) {
+		h = (h ^ (unsigned char)*dif) * 16777619u;
+	}
+
+	return h;
+}
+
+struct dest * dest_intern(
+	const char * name, const char * instance, const char * dif) {
+
+	struct dest * first = 0;
+	struct dest * d = 0;
+	unsigned int h = dest_hash(name, instance, dif);
+
+	pthread_mutex_lock(&dests_lock);
+
+	if(!dests.b && ht_init(&dests, 64)) {
+		goto out;
+	}
+
+	first = ht_get(&dests, h, ht_hash_int(h));
+
+	for(d = first; d; d = d->next) {
+		if(strncmp(d->name, name, NAME_MAX - 1) == 0 &&
+			strncmp(d->instance, instance, NAME_MAX - 1) == 0 &&
+			strncmp(d->dif, dif, NAME_MAX - 1) == 0) {
+
+			goto out;
+		}
+	}
+
+	d = malloc(sizeof(struct dest));
+
+	if(!d) {
+		goto out;
+	}
+
+	memset(d, 0, sizeof(struct dest));
+	strncpy(d->name, name, NAME_MAX - 1);
+	strncpy(d->instance, instance, NAME_MAX - 1);
+	strncpy(d->dif, dif, NAME_MAX - 1);
+	d->hash = h;
+	d->next = first;
+	d->port = -1;
+	d->gone = -1;
+	d->state = DEST_DOWN;
+
+	if(ht_add(&dests, h, ht_hash_int(h), d)) {
+		free(d);
+		d = 0;
+	}
+
+out:
+	pthread_mutex_unlock(&dests_lock);
+	return d;
+}
+
+void dest_walk(void (* fn)(struct dest * d, void * arg), void * arg) {
+	struct dest * d = 0;
+	unsigned int i = 0;
+	int j = 0;
+
+	pthread_mutex_lock(&dests_lock);
+
+	for(i = 0; dests.b && i <= dests.mask; i++) {
+		for(j = 0; j < HT_SLOTS; j++) {
+			for(d = dests.b[i].val[j]; d; d = d->next) {
+				fn(d, arg);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&dests_lock);
+}
@@ -0,0 +1,103 @@
+/* Destinations of NORI traffic.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_DEST_H
+#define __NORI_DEST_H
+
+#include "dict.h"
+
+#define DEST_DOWN	0	/* No flow to the destination. */
+#define DEST_UP		1	/* A flow is there and can be used. */
+#define DEST_PENDING	2	/* A flow is being allocated. */
+
+/* Instance standing for any of the instances of an AE. */
+#define DEST_ANY	"*"
+
+/* A remote application entity reached through a DIF, stored only once.
+ *
+ * Every rule aiming to the same name and instance in the same DIF points to
+ * the same destination, which caches the flow to use; the same AE through
+ * another DIF is another destination, with its own flows. Two destinations are equal if
+ * and only if they are the same object, so they can be compared and hashed
+ * by address.
+ */
+struct dest {
+	/* Next destination with the same hash. */
+	struct dest * next;
+	/* Hash of name, instance and DIF. */
+	unsigned int hash;
+
+	/* AE name. */
+	char name[NAME_MAX];
+	/* AE instance. */
+	char instance[NAME_MAX];
+	/* DIF where its flows are allocated. */
+	char dif[NAME_MAX];
+
+	/* Port of the flow to use; negative if none. Read without locks. */
+	int port;
+	/* State of the destination. */
+	int state;
+	/* Flows known for this destination, latest first. Owned by whoever
+	 * manages the flows.
+	 */
+	void * flows;
+	/* Allocation in progress, if any. Owned by whoever manages the flows.
+	 */
+	void * pending;
+
+	/* Seconds without traffic before releasing its flows; 0 for the
+	 * global setting. The longest one of the rules using it.
+	 */
+	int idle;
+	/* Keep a flow to it allocated, with or without traffic? */
+	int keep;
+
+	/* Destination which takes the traffic while this one has no working
+	 * flow, or 0.
+	 */
+	struct dest * standby;
+	/* Port seen failing while sending, skipped until replaced; negative
+	 * if none.
+	 */
+	int gone;
+
+	/* Instances found, if the instance is DEST_ANY; 0 otherwise. Owned by
+	 * whoever discovers them.
+	 */
+	void * members;
+	/* Last time traffic has been sent to it; coarse clock. */
+	unsigned long last;
+};
+
+/* Get the unique destination for the given name and instance in a DIF,
+ * creating it the first time. Destinations live until the end of the program. Thread
+ * safe.
+ *
+ * Returns the destination, or 0 if there is no more memory.
+ */
+struct dest * dest_intern(
+	const char * name, const char * instance, const char * dif);
+
+/* Call 'fn' on every destination known so far; no destination can be
+ * created meanwhile, so 'fn' must not call dest_intern.
+ */
+void dest_walk(void (* fn)(struct dest * d, void * arg), void * arg);
+
+#endif /* __NORI_DEST_H */
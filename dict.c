@@ -22,9 +22,74 @@
 #include <string.h>
 
 #include "dict.h"
+#include "dest.h"
+#include "htable.h"
+#include "proto.h"
 
 /* List of rules actually used. */
 LIST_HEAD(dict_rules);
+/* Number of rules in the list. */
+int dict_rules_nr = 0;
+/* Rules indexed by their position in the list. */
+struct dict_rule ** dict_rules_by_id = 0;
+
+/* IP rules, one table per direction. */
+struct lpm dict_ip[2];
+/* Port and multi-field rules. */
+struct tss dict_tuples;
+/* Rules checked one by one. */
+LIST_HEAD(dict_scan);
+
+/* Parse an address with an optional prefix length, like 10.0.0.0/8; an
+ * address alone is a host.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int dict_addr_parse(char * str, unsigned char * addr, int * prefix) {
+	int one = 0;
+	int two = 0;
+	int three = 0;
+	int four = 0;
+
+	*prefix = 32;
+
+	if(sscanf(str, "%d.%d.%d.%d/%d",
+		&one, &two, &three, &four, prefix) < 4 ||
+		*prefix < 0 || *prefix > 32) {
+
+		return -1;
+	}
+
+	addr[0] = (unsigned char)one;
+	addr[1] = (unsigned char)two;
+	addr[2] = (unsigned char)three;
+	addr[3] = (unsigned char)four;
+
+	return 0;
+}
+
+/* Parse a port, or a range of them like 1024-65535.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int dict_range_parse(char * str, unsigned short * first, unsigned short * last) {
+	int a = 0;
+	int b = 0;
+	int n = sscanf(str, "%d-%d", &a, &b);
+
+	if(n < 2) {
+		b = a;
+	}
+
+	if(n < 1 || a < 0 || b > 65535 || a > b) {
+		return -1;
+	}
+
+	*first = (unsigned short)a;
+	*last = (unsigned short)b;
+
+	return 0;
+}
 
 int dict_def_rule_parse(struct dict_rule * rule, char * str) {
 	char * strategy = 0;
@@ -68,9 +133,17 @@ int dict_def_rule_parse(struct dict_rule * rule, char * str) {
 
 			instance = strtok(0, " ");
 
+			memset(d, 0, sizeof(struct rule_dest));
 			INIT_LIST_HEAD(&d->listh);
 			strcpy(d->ae, name);
 			strcpy(d->ai, instance);
+			d->dest = dest_intern(d->ae, d->ai, rule->dif);
+
+			if(!d->dest) {
+				printf("        Not enough memory!\n");
+				free(d);
+				return -1;
+			}
 
 			/* Add to the possible destinations. */
 			list_add(&d->listh, &def->dests);
@@ -89,11 +162,6 @@ int dict_def_rule_parse(struct dict_rule * rule, char * str) {
 }
 
 int dict_ip_parse(struct dict_rule * rule, char * str) {
-	int one = 0;
-	int two = 0;
-	int three = 0;
-	int four = 0;
-
 	char * token = 0;
 	struct rule_ip * ip = malloc(sizeof(struct rule_ip));
 
@@ -127,12 +195,11 @@ int dict_ip_parse(struct dict_rule * rule, char * str) {
 		return -1;
 	}
 
-	sscanf(token, "%d.%d.%d.%d", &one, &two, &three, &four);
-
-	ip->address[0] = (unsigned char)one;
-	ip->address[1] = (unsigned char)two;
-	ip->address[2] = (unsigned char)three;
-	ip->address[3] = (unsigned char)four;
+	/* A host, or a whole subnet with its prefix length. */
+	if(dict_addr_parse(token, ip->address, &ip->prefix)) {
+		printf("        Bad address format for IP rule!\n");
+		return -1;
+	}
 
 	/* Get the next hop. */
 	memset(&ip->dest, 0, sizeof(struct rule_dest));
@@ -152,13 +219,20 @@ int dict_ip_parse(struct dict_rule * rule, char * str) {
 	}
 
 	strncpy(ip->dest.ai, token, NAME_MAX);
+	ip->dest.dest = dest_intern(ip->dest.ae, ip->dest.ai, rule->dif);
 
-	printf("        Direction %d, %d.%d.%d.%d --> %s-%s\n",
+	if(!ip->dest.dest) {
+		printf("        Not enough memory!\n");
+		return -1;
+	}
+
+	printf("        Direction %d, %d.%d.%d.%d/%d --> %s-%s\n",
 		ip->direction,
 		(unsigned char)ip->address[0],
 		(unsigned char)ip->address[1],
 		(unsigned char)ip->address[2],
 		(unsigned char)ip->address[3],
+		ip->prefix,
 		ip->dest.ae,
 		ip->dest.ai);
 
@@ -222,7 +296,10 @@ int dict_port_parse(struct dict_rule * rule, char * str) {
 		return -1;
 	}
 
-	port->port = (unsigned short)atoi(token);
+	if(dict_range_parse(token, &port->port, &port->last)) {
+		printf("        Bad port format for Port rule!\n");
+		return -1;
+	}
 
 	/*
 	 * Get the next hop.
@@ -245,20 +322,459 @@ int dict_port_parse(struct dict_rule * rule, char * str) {
 	}
 
 	strncpy(port->dest.ai, token, NAME_MAX);
+	port->dest.dest = dest_intern(
+		port->dest.ae, port->dest.ai, rule->dif);
 
-	printf("        Direction %d, protocol %d, %d --> %s-%s\n",
+	if(!port->dest.dest) {
+		printf("        Not enough memory!\n");
+		return -1;
+	}
+
+	printf("        Direction %d, protocol %d, %d-%d --> %s-%s\n",
 		port->direction,
 		port->proto,
 		(unsigned short)port->port,
+		(unsigned short)port->last,
 		port->dest.ae,
 		port->dest.ai);
 
 	return 0;
+}
+
+int dict_match_parse(struct dict_rule * rule, char * str) {
+	char * token = 0;
+	char * ai = 0;
+	struct rule_match * m = malloc(sizeof(struct rule_match));
+
+	if(!m) {
+		printf("        Not enough memory!\n");
+		return -1;
+	}
+
+	memset(m, 0, sizeof(struct rule_match));
+	rule->data = m;
+
+	m->proto = -1;
+	m->sport_last = 65535;
+	m->dport_last = 65535;
+	m->icmp = -1;
+
+	/* Fields, then the next hop. */
+	while((token = strtok(0, " ")) && strchr(token, '=')) {
+		if(strncmp(token, "src=", 4) == 0) {
+			if(dict_addr_parse(token + 4, m->src, &m->src_prefix)) {
+				printf("        Bad source for Match rule!\n");
+				return -1;
+			}
+		} else if(strncmp(token, "dst=", 4) == 0) {
+			if(dict_addr_parse(token + 4, m->dst, &m->dst_prefix)) {
+				printf("        Bad destination for Match rule!\n");
+				return -1;
+			}
+		} else if(strncmp(token, "proto=", 6) == 0) {
+			if(strcmp(token + 6, "tcp") == 0) {
+				m->proto = IPV4_PROTO_TCP;
+			} else if(strcmp(token + 6, "udp") == 0) {
+				m->proto = IPV4_PROTO_UDP;
+			} else if(strcmp(token + 6, "icmp") == 0) {
+				m->proto = IPV4_PROTO_ICMP;
+			} else if(sscanf(token + 6, "%d", &m->proto) < 1 ||
+				m->proto < 0 || m->proto > 255) {
+
+				printf("        Bad protocol for Match rule!\n");
+				return -1;
+			}
+		} else if(strncmp(token, "sport=", 6) == 0) {
+			if(dict_range_parse(
+				token + 6, &m->sport, &m->sport_last)) {
+
+				printf("        Bad ports for Match rule!\n");
+				return -1;
+			}
+		} else if(strncmp(token, "dport=", 6) == 0) {
+			if(dict_range_parse(
+				token + 6, &m->dport, &m->dport_last)) {
+
+				printf("        Bad ports for Match rule!\n");
+				return -1;
+			}
+		} else if(strncmp(token, "icmp=", 5) == 0) {
+			if(sscanf(token + 5, "%d", &m->icmp) < 1 ||
+				m->icmp < 0 || m->icmp > 255) {
+
+				printf("        Bad ICMP type for Match rule!\n");
+				return -1;
+			}
+		} else {
+			printf("        Unknown field %s for Match rule!\n",
+				token);
+			return -1;
+		}
+	}
+
+	/* Ports are only in TCP and UDP, types only in ICMP. */
+	if(m->icmp != -1) {
+		if(m->proto != -1 && m->proto != IPV4_PROTO_ICMP) {
+			printf("        ICMP type needs ICMP in Match rule!\n");
+			return -1;
+		}
+
+		m->proto = IPV4_PROTO_ICMP;
+	}
+
+	if((m->sport || m->sport_last != 65535 ||
+		m->dport || m->dport_last != 65535) &&
+		m->proto != -1 &&
+		m->proto != IPV4_PROTO_TCP && m->proto != IPV4_PROTO_UDP) {
+
+		printf("        Ports need TCP or UDP in Match rule!\n");
+		return -1;
+	}
+
+	/* Get the next hop. */
+	ai = token ? strchr(token, ',') : 0;
+
+	if(!ai || ai == token || !ai[1]) {
+		printf("        Bad next hop format for Match rule!\n");
+		return -1;
+	}
+
+	*ai++ = 0;
+
+	strncpy(m->dest.ae, token, NAME_MAX - 1);
+	strncpy(m->dest.ai, ai, NAME_MAX - 1);
+	m->dest.dest = dest_intern(m->dest.ae, m->dest.ai, rule->dif);
+
+	if(!m->dest.dest) {
+		printf("        Not enough memory!\n");
+		return -1;
+	}
+
+	printf("        %d.%d.%d.%d/%d --> %d.%d.%d.%d/%d, protocol %d, "
+		"ports %d-%d --> %d-%d, ICMP %d --> %s-%s\n",
+		m->src[0], m->src[1], m->src[2], m->src[3], m->src_prefix,
+		m->dst[0], m->dst[1], m->dst[2], m->dst[3], m->dst_prefix,
+		m->proto,
+		m->sport, m->sport_last, m->dport, m->dport_last,
+		m->icmp,
+		m->dest.ae,
+		m->dest.ai);
+
+	return 0;
+}
+
+/* Parse the standby of a rule, something like:
+ *     <name>,<instance>[@<dif>] or @<dif>
+ *
+ * Returns the standby, or 0 on error.
+ */
+struct rule_standby * dict_standby_parse(char * str) {
+	char * dif = strchr(str, '@');
+	char * ai = 0;
+	struct rule_standby * s = 0;
+
+	if(dif) {
+		*dif++ = 0;
+	}
+
+	ai = strchr(str, ',');
+
+	if(ai) {
+		*ai++ = 0;
+	}
+
+	/* Either another instance, or the same one through another DIF. */
+	if((!ai && str[0]) || (ai && (!str[0] || !ai[0])) ||
+		(!ai && (!dif || !dif[0]))) {
+
+		printf("        Bad standby format!\n");
+		return 0;
+	}
+
+	s = malloc(sizeof(struct rule_standby));
+
+	if(!s) {
+		printf("        Not enough memory!\n");
+		return 0;
+	}
+
+	memset(s, 0, sizeof(struct rule_standby));
+
+	if(ai) {
+		strncpy(s->ae, str, NAME_MAX - 1);
+		strncpy(s->ai, ai, NAME_MAX - 1);
+	}
+
+	if(dif) {
+		strncpy(s->dif, dif, NAME_MAX - 1);
+	}
+
+	return s;
+}
+
+/* Pass the rule settings to one of its destinations. */
+void dict_dest_apply(struct dict_rule * r, struct rule_dest * d) {
+	struct rule_standby * s = r->standby;
+	struct dest * sb = 0;
+
+	if(d->dest->idle < r->idle) {
+		d->dest->idle = r->idle;
+	}
+
+	if(!s) {
+		return;
+	}
+
+	sb = dest_intern(
+		s->ae[0] ? s->ae : d->ae,
+		s->ai[0] ? s->ai : d->ai,
+		s->dif[0] ? s->dif : r->dif);
+
+	if(!sb) {
+		printf("        Not enough memory!\n");
+		return;
+	}
+
+	if(sb == d->dest) {
+		printf("        %s-%s cannot be its own standby\n",
+			d->ae, d->ai);
+		return;
+	}
+
+	/* Both are kept ready, so either can take the traffic at once. */
+	d->dest->standby = sb;
+	d->dest->keep = 1;
+	sb->keep = 1;
+
+	printf("        Standby of %s-%s is %s-%s in %s\n",
+		d->ae, d->ai, sb->name, sb->instance, sb->dif);
+}
+
+/* Address of an IP rule, without the bits out of its prefix. */
+static uint32_t dict_ip_addr(struct rule_ip * ip) {
+	uint32_t a = ((uint32_t)ip->address[0] << 24) |
+		((uint32_t)ip->address[1] << 16) |
+		((uint32_t)ip->address[2] << 8) |
+		(uint32_t)ip->address[3];
+
+	return ip->prefix ? a & (0xffffffffU << (32 - ip->prefix)) : 0;
+}
+
+/* Prefixes which cover the ports from 'first' to 'last', at most 30.
+ *
+ * Returns how many prefixes there are.
+ */
+static int dict_port_prefixes(
+	uint32_t first, uint32_t last, uint32_t * port, int * len) {
+
+	int n = 0;
+	int b = 0;
+
+	/* The largest block which starts there and does not go over. */
+	while(first <= last) {
+		for(b = 0; b < 16 &&
+			!(first & (1 << b)) && first + (2 << b) - 1 <= last;
+			b++);
+
+		port[n] = first;
+		len[n++] = 16 - b;
+		first += 1 << b;
+	}
+
+	return n;
+}
+
+/* Add a rule to the 5-tuples; a protocol of -1 takes any, and ranges are
+ * split in the prefixes which cover them.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int dict_tuples_add(struct dict_rule * r,
+	unsigned char * src, int slen, unsigned char * dst, int dlen,
+	int proto,
+	uint32_t sport, uint32_t sport_last,
+	uint32_t dport, uint32_t dport_last) {
+
+	uint32_t sp[32];
+	uint32_t dp[32];
+	int spl[32];
+	int dpl[32];
+
+	uint32_t s = ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+		((uint32_t)src[2] << 8) | (uint32_t)src[3];
+	uint32_t d = ((uint32_t)dst[0] << 24) | ((uint32_t)dst[1] << 16) |
+		((uint32_t)dst[2] << 8) | (uint32_t)dst[3];
+
+	uint64_t key[2];
+	uint64_t mask[2];
+
+	int ns = dict_port_prefixes(sport, sport_last, sp, spl);
+	int nd = dict_port_prefixes(dport, dport_last, dp, dpl);
+	int i = 0;
+	int j = 0;
+
+	for(i = 0; i < ns; i++) {
+		for(j = 0; j < nd; j++) {
+			tss_key(key, s, d, proto < 0 ? 0 : proto, sp[i], dp[j]);
+			tss_key(mask,
+				slen ? 0xffffffffU << (32 - slen) : 0,
+				dlen ? 0xffffffffU << (32 - dlen) : 0,
+				proto < 0 ? 0 : 0xff,
+				(0xffff << (16 - spl[i])) & 0xffff,
+				(0xffff << (16 - dpl[j])) & 0xffff);
+
+			/* Packets without ports do not match. */
+			if(spl[i] || dpl[j]) {
+				key[1] |= TSS_L4;
+				mask[1] |= TSS_L4;
+			}
+
+			if(tss_add(&dict_tuples, key, mask, r->id + 1)) {
+				return -1;
+			}
+		}
+	}
 
 	return 0;
 }
 
-int dict_parse(char * path) {
+/* Add a port or multi-field rule to the 5-tuples.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int dict_tuples_rule(struct dict_rule * r) {
+	static unsigned char any[4] = {0};
+
+	struct rule_port * p = (struct rule_port *)r->data;
+	struct rule_match * m = (struct rule_match *)r->data;
+
+	int proto = 0;
+
+	if(r->type == RULE_PORT) {
+		proto = p->proto == RULE_PORT_TCP ?
+			IPV4_PROTO_TCP : IPV4_PROTO_UDP;
+
+		if(p->direction == RULE_DIR_SRC) {
+			return dict_tuples_add(r, any, 0, any, 0, proto,
+				p->port, p->last, 0, 65535);
+		}
+
+		return dict_tuples_add(r, any, 0, any, 0, proto,
+			0, 65535, p->port, p->last);
+	}
+
+	/* The type goes where the source port would be. */
+	if(m->icmp >= 0) {
+		return dict_tuples_add(r,
+			m->src, m->src_prefix, m->dst, m->dst_prefix,
+			IPV4_PROTO_ICMP, m->icmp, m->icmp, 0, 65535);
+	}
+
+	/* Ports without a protocol are both TCP and UDP ones. */
+	if(m->proto < 0 && (m->sport || m->sport_last != 65535 ||
+		m->dport || m->dport_last != 65535)) {
+
+		return dict_tuples_add(r,
+				m->src, m->src_prefix, m->dst, m->dst_prefix,
+				IPV4_PROTO_TCP,
+				m->sport, m->sport_last, m->dport, m->dport_last) ||
+			dict_tuples_add(r,
+				m->src, m->src_prefix, m->dst, m->dst_prefix,
+				IPV4_PROTO_UDP,
+				m->sport, m->sport_last, m->dport, m->dport_last);
+	}
+
+	return dict_tuples_add(r,
+		m->src, m->src_prefix, m->dst, m->dst_prefix, m->proto,
+		m->sport, m->sport_last, m->dport, m->dport_last);
+}
+
+/* Prepare the rules to classify the packets: IP rules are set in the
+ * table of their direction, port and multi-field ones in the 5-tuples, the
+ * others are checked one by one.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int dict_compile(void) {
+	struct dict_rule ** ips = 0;
+	struct dict_rule * r = 0;
+	struct rule_ip * ip = 0;
+	struct lpm * t = 0;
+	struct htable seen;
+
+	unsigned long key = 0;
+	int ret = -1;
+	int n = 0;
+
+	dict_rules_by_id = malloc(
+		sizeof(struct dict_rule *) * (dict_rules_nr + 1));
+	ips = malloc(sizeof(struct dict_rule *) * (dict_rules_nr + 1));
+
+	if(!dict_rules_by_id || !ips || ht_init(&seen, 64)) {
+		printf("Not enough memory for the rules!\n");
+		free(ips);
+		return -1;
+	}
+
+	list_for_each_entry(r, &dict_rules, listh) {
+		dict_rules_by_id[r->id] = r;
+
+		if(r->type == RULE_PORT || r->type == RULE_MATCH) {
+			if(dict_tuples_rule(r)) {
+				printf("Not enough memory for the rules!\n");
+				goto out;
+			}
+
+			continue;
+		}
+
+		if(r->type != RULE_IP) {
+			list_add_tail(&r->scan, &dict_scan);
+			continue;
+		}
+
+		ip = (struct rule_ip *)r->data;
+		key = ((unsigned long)dict_ip_addr(ip) << 8) |
+			(ip->prefix << 1) | ip->direction;
+
+		/* Same prefix as an earlier rule, which always wins. */
+		if(ht_get(&seen, key, ht_hash_int(key))) {
+			continue;
+		}
+
+		if(ht_add(&seen, key, ht_hash_int(key), r)) {
+			printf("Not enough memory for the rules!\n");
+			goto out;
+		}
+
+		ips[n++] = r;
+	}
+
+	/* Earlier rules are set last, so they take the addresses they share
+	 * with the ones after them: the first match wins, as it always did.
+	 */
+	while(n-- > 0) {
+		ip = (struct rule_ip *)ips[n]->data;
+		t = &dict_ip[ip->direction];
+
+		if((!t->tbl24 && lpm_init(t)) ||
+			lpm_set(t, dict_ip_addr(ip), ip->prefix, ips[n]->id + 1)) {
+
+			printf("Not enough memory for the IP rules!\n");
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	ht_free(&seen);
+	free(ips);
+
+	return ret;
+}
+
+int dict_parse(char * path, char * dif) {
 	FILE * fd = fopen(path, "r");
 
 	char * line = 0;
@@ -271,7 +787,12 @@ int dict_parse(char * path) {
 	char * ap = 0;
 	char * str = 0;
 	char * ai = 0;
+	char * opt = 0;
+	char * odif = 0;
+	char * osb = 0;
+	char * save = 0;
 
+	int idle = 0;
 	int i = 0;
 	int j = 0;
 
@@ -292,6 +813,37 @@ int dict_parse(char * path) {
 			}
 		}
 
+		/* Options of the rule, in any order, something like:
+		 *     <rule> idle=<seconds> dif=<name> standby=<standby>
+		 */
+		idle = 0;
+		opt = strstr(line, " idle=");
+		odif = strstr(line, " dif=");
+		osb = strstr(line, " standby=");
+
+		/* The rule itself ends where its options start. */
+		if(opt) {
+			idle = atoi(opt + 6);
+			*opt = 0;
+		}
+
+		if(odif) {
+			*odif = 0;
+		}
+
+		if(osb) {
+			*osb = 0;
+		}
+
+		/* Values end at the next option. */
+		if(odif) {
+			odif = strtok_r(odif + 5, " ", &save);
+		}
+
+		if(osb) {
+			osb = strtok_r(osb + 9, " ", &save);
+		}
+
 		token = strtok(line, " ");
 
 		if(token) {
@@ -304,9 +856,27 @@ int dict_parse(char * path) {
 
 			memset(r, 0, sizeof(struct dict_rule));
 			INIT_LIST_HEAD(&r->listh);
+			INIT_LIST_HEAD(&r->scan);
+			r->idle = idle;
+			strncpy(r->dif, odif ? odif : dif, NAME_MAX - 1);
+
+			if(osb) {
+				r->standby = dict_standby_parse(osb);
+
+				if(!r->standby) {
+					printf("Error!\n");
+					free(r);
+					r = 0;
+					continue;
+				}
+			}
 
 			printf("    '%s' rule detected\n", token);
 
+			if(odif) {
+				printf("        Flows allocated in DIF %s\n", r->dif);
+			}
+
 			/* Default rule, something like:
 			 *     default <strategy> (<name>,<instance>)1+
 			 *
@@ -323,6 +893,15 @@ int dict_parse(char * path) {
 				}
 
 				r->type = RULE_DEF;
+				r->id = dict_rules_nr++;
+
+				list_for_each_entry(d,
+					&((struct rule_default *)r->data)->dests,
+					listh) {
+
+					dict_dest_apply(r, d);
+				}
+
 				list_add_tail(&r->listh, &dict_rules);
 
 				continue;
@@ -340,6 +919,9 @@ int dict_parse(char * path) {
 				}
 
 				r->type = RULE_IP;
+				r->id = dict_rules_nr++;
+				dict_dest_apply(
+					r, &((struct rule_ip *)r->data)->dest);
 				list_add_tail(&r->listh, &dict_rules);
 
 				continue;
@@ -358,6 +940,31 @@ int dict_parse(char * path) {
 				}
 
 				r->type = RULE_PORT;
+				r->id = dict_rules_nr++;
+				dict_dest_apply(
+					r, &((struct rule_port *)r->data)->dest);
+				list_add_tail(&r->listh, &dict_rules);
+
+				continue;
+			}
+
+			/* Multi-field rule, something like:
+			 *     match (<field>=<value> )* <name>,<instance>
+			 *
+			 * Fields: src, dst, proto, sport, dport, icmp.
+			 */
+			if(strcmp("match", token) == 0) {
+				if(dict_match_parse(r, str)) {
+					printf("Error!\n");
+					free(r);
+					r = 0;
+					continue;
+				}
+
+				r->type = RULE_MATCH;
+				r->id = dict_rules_nr++;
+				dict_dest_apply(
+					r, &((struct rule_match *)r->data)->dest);
 				list_add_tail(&r->listh, &dict_rules);
 
 				continue;
@@ -373,5 +980,5 @@ int dict_parse(char * path) {
 
 out:
 	fclose(fd);
-	return 0;
+	return dict_compile();
 }
@@ -23,6 +23,8 @@
 #include <time.h>
 
 #include "list.h"
+#include "lpm.h"
+#include "tss.h"
 
 /* Maximum name length considered. */
 #define NAME_MAX	32
@@ -30,7 +32,8 @@
 #define RULE_INVALID	0x0
 #define RULE_DEF	0x1	/* PDU default destination. */
 #define RULE_IP		0x2	/* Rule on IP address. */
-#define RULE_PORT	0x2	/* Rule on port. */
+#define RULE_PORT	0x3	/* Rule on port. */
+#define RULE_MATCH	0x4	/* Rule on more fields of the packet. */
 
 #define RULE_PORT_UDP	0	/* PDU dest based on UDP port id. */
 #define RULE_PORT_TCP	1	/* PDU dest based on UDP port id. */
@@ -41,6 +44,8 @@
 #define RULE_STR_SI	0	/* A single destination. */
 #define RULE_STR_RR	1	/* Round-robin between destinations. */
 
+struct dest;
+
 /* Rule destination. */
 struct rule_dest {
 	/* Member of a list. */
@@ -55,6 +60,8 @@ struct rule_dest {
 	char ae[NAME_MAX];
 	/* Target AE instance. */
 	char ai[NAME_MAX];
+	/* Shared destination object for ae/ai. */
+	struct dest * dest;
 };
 
 /* Port rule descriptor. */
@@ -63,6 +70,8 @@ struct rule_port {
 	int direction;
 	/* Port number to check for. */
 	unsigned short port;
+	/* Last port of the range; the same as 'port' for a single one. */
+	unsigned short last;
 	/* Protocol for this rule. */
 	int proto;
 
@@ -74,6 +83,8 @@ struct rule_port {
 struct rule_ip {
 	/* IPv4 address to check for. */
 	unsigned char address[4];
+	/* Bits of the address which are checked; 32 for a single host. */
+	int prefix;
 	/* Source or destination filed? */
 	int direction;
 
@@ -81,6 +92,27 @@ struct rule_ip {
 	struct rule_dest dest;
 };
 
+/* Multi-field rule descriptor; fields which are not given match anything. */
+struct rule_match {
+	/* Source and destination prefixes. */
+	unsigned char src[4];
+	int src_prefix;
+	unsigned char dst[4];
+	int dst_prefix;
+	/* IP protocol, -1 for any. */
+	int proto;
+	/* Port ranges, 0-65535 for any; only for TCP and UDP. */
+	unsigned short sport;
+	unsigned short sport_last;
+	unsigned short dport;
+	unsigned short dport_last;
+	/* ICMP type, -1 for any. */
+	int icmp;
+
+	/* Destination for this rule. */
+	struct rule_dest dest;
+};
+
 /* Default rule descriptor. */
 struct rule_default {
 	/* Strategy to apply. */
@@ -92,13 +124,38 @@ struct rule_default {
 	struct list_head dests;
 };
 
+/* Standby of the destinations of a rule; empty fields are taken from each
+ * destination.
+ */
+struct rule_standby {
+	/* AE name. */
+	char ae[NAME_MAX];
+	/* AE instance. */
+	char ai[NAME_MAX];
+	/* DIF where its flows are allocated. */
+	char dif[NAME_MAX];
+};
+
 /* Definition for a single rule. */
 struct dict_rule {
 	/* Member of a list. */
 	struct list_head listh;
 
+	/* Member of dict_scan, unless looked up in dict_ip or dict_tuples. */
+	struct list_head scan;
+
 	/* Type of rule? */
 	int type;
+	/* Position of the rule in the list. */
+	int id;
+	/* Seconds without traffic before releasing its flows; 0 for the
+	 * global setting.
+	 */
+	int idle;
+	/* DIF where the flows toward its destinations are allocated. */
+	char dif[NAME_MAX];
+	/* Where its traffic goes if a destination fails, or 0. */
+	struct rule_standby * standby;
 
 	/* Rule specific fields. */
 	void * data;
@@ -106,11 +163,27 @@ struct dict_rule {
 
 /* List of rules. */
 extern struct list_head dict_rules;
+/* Number of rules in the list. */
+extern int dict_rules_nr;
+/* Rules indexed by their position in the list. */
+extern struct dict_rule ** dict_rules_by_id;
+
+/* IP rules, looked up by address, one table per direction: every address
+ * has the position + 1 of the first rule which matches it, 0 if none.
+ */
+extern struct lpm dict_ip[2];
+/* Port and multi-field rules, looked up by 5-tuple: every packet has the
+ * position + 1 of the first rule which matches it, 0 if none.
+ */
+extern struct tss dict_tuples;
+/* Rules which are not in the tables above, checked one by one in order. */
+extern struct list_head dict_scan;
 
-/* Parse a file in order to load up possible rules written in it.
+/* Parse a file in order to load up possible rules written in it; rules
+ * which do not name a DIF use 'dif'.
  *
  * Returns 0 on success, a negative error number on error.
  */
-int dict_parse(char * path);
+int dict_parse(char * path, char * dif);
 
 #endif /* __NORI_DICT_H */
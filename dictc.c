@@ -0,0 +1,560 @@
+/* Compiles the NORI dictionary to native code.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "dict.h"
+#include "dictc.h"
+#include "proto.h"
+#include "tss.h"
+
+/* Words of $CC, at most. */
+#define DICTC_CC_ARGS		16
+
+/* What a rule checks, with its constants already folded. */
+struct dictc_rule {
+	/* Position + 1 of the rule. */
+	unsigned int id;
+	/* First rule of the ones which check the same bits. */
+	unsigned int pri;
+
+	/* Bits of the addresses checked, and their value. */
+	uint64_t om;
+	uint64_t ov;
+	/* Bits of protocol and single ports checked, and their value. */
+	uint64_t im;
+	uint64_t iv;
+
+	/* The protocol has to be TCP or UDP. */
+	int tcpudp;
+	/* Port ranges left to check; the first port is -1 if none. */
+	int sp[2];
+	int dp[2];
+};
+
+static uint32_t dictc_addr(unsigned char * a, int len) {
+	uint32_t m = len ? 0xffffffffU << (32 - len) : 0;
+
+	return (((uint32_t)a[0] << 24) | ((uint32_t)a[1] << 16) |
+		((uint32_t)a[2] << 8) | (uint32_t)a[3]) & m;
+}
+
+/* Check an address of the rule. */
+static void dictc_prefix(
+	struct dictc_rule * d, int shift, unsigned char * a, int len) {
+
+	uint32_t m = len ? 0xffffffffU << (32 - len) : 0;
+
+	d->om |= (uint64_t)m << shift;
+	d->ov |= (uint64_t)dictc_addr(a, len) << shift;
+}
+
+/* Check a port range of the rule: a single port is part of the key, a
+ * range is checked apart.
+ */
+static void dictc_ports(
+	struct dictc_rule * d, int shift, int first, int last, int * range) {
+
+	if(first == 0 && last == 65535) {
+		return;
+	}
+
+	d->im |= TSS_L4;
+	d->iv |= TSS_L4;
+
+	if(first == last) {
+		d->im |= (uint64_t)0xffff << shift;
+		d->iv |= (uint64_t)first << shift;
+		return;
+	}
+
+	range[0] = first;
+	range[1] = last;
+}
+
+/* Check the protocol of the rule. */
+static void dictc_proto(struct dictc_rule * d, int proto) {
+	d->im |= (uint64_t)0xff << 32;
+	d->iv |= (uint64_t)proto << 32;
+}
+
+/* Fold what a rule checks. */
+static void dictc_fold(struct dict_rule * r, struct dictc_rule * d) {
+	struct rule_ip * ip = (struct rule_ip *)r->data;
+	struct rule_port * p = (struct rule_port *)r->data;
+	struct rule_match * m = (struct rule_match *)r->data;
+
+	memset(d, 0, sizeof(struct dictc_rule));
+
+	d->id = r->id + 1;
+	d->sp[0] = -1;
+	d->dp[0] = -1;
+
+	switch(r->type) {
+	case RULE_IP:
+		dictc_prefix(d, ip->direction == RULE_DIR_SRC ? 32 : 0,
+			ip->address, ip->prefix);
+		break;
+	case RULE_PORT:
+		dictc_proto(d, p->proto == RULE_PORT_TCP ?
+			IPV4_PROTO_TCP : IPV4_PROTO_UDP);
+		dictc_ports(d, p->direction == RULE_DIR_SRC ? 16 : 0,
+			p->port, p->last,
+			p->direction == RULE_DIR_SRC ? d->sp : d->dp);
+		break;
+	case RULE_MATCH:
+		dictc_prefix(d, 32, m->src, m->src_prefix);
+		dictc_prefix(d, 0, m->dst, m->dst_prefix);
+
+		/* The type is where the source port would be. */
+		if(m->icmp >= 0) {
+			dictc_proto(d, IPV4_PROTO_ICMP);
+			dictc_ports(d, 16, m->icmp, m->icmp, d->sp);
+			break;
+		}
+
+		if(m->proto >= 0) {
+			dictc_proto(d, m->proto);
+		}
+
+		dictc_ports(d, 16, m->sport, m->sport_last, d->sp);
+		dictc_ports(d, 0, m->dport, m->dport_last, d->dp);
+
+		/* Ports without a protocol are both TCP and UDP ones. */
+		d->tcpudp = m->proto < 0 && (d->im & TSS_L4);
+		break;
+	default:
+		/* Takes everything. */
+		break;
+	}
+}
+
+/* Order by the bits checked, then by their value and position. */
+static int dictc_by_mask(const void * a, const void * b) {
+	const struct dictc_rule * x = (const struct dictc_rule *)a;
+	const struct dictc_rule * y = (const struct dictc_rule *)b;
+
+	if(x->om != y->om) {
+		return x->om < y->om ? -1 : 1;
+	}
+
+	if(x->im != y->im) {
+		return x->im < y->im ? -1 : 1;
+	}
+
+	if(x->ov != y->ov) {
+		return x->ov < y->ov ? -1 : 1;
+	}
+
+	if(x->iv != y->iv) {
+		return x->iv < y->iv ? -1 : 1;
+	}
+
+	if(x->id != y->id) {
+		return x->id < y->id ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* Order by the first rule of the group, then as dictc_by_mask. */
+static int dictc_by_pri(const void * a, const void * b) {
+	const struct dictc_rule * x = (const struct dictc_rule *)a;
+	const struct dictc_rule * y = (const struct dictc_rule *)b;
+
+	if(x->pri != y->pri) {
+		return x->pri < y->pri ? -1 : 1;
+	}
+
+	return dictc_by_mask(a, b);
+}
+
+/* Write a range check of a port, if any. */
+static void dictc_emit_range(FILE * f, char * port, int * range, int * and) {
+	if(range[0] < 0) {
+		return;
+	}
+
+	if(range[0] > 0) {
+		fprintf(f, "%s%s >= %d", *and ? " && " : "", port, range[0]);
+		*and = 1;
+	}
+
+	if(range[1] < 65535) {
+		fprintf(f, "%s%s <= %d", *and ? " && " : "", port, range[1]);
+		*and = 1;
+	}
+}
+
+/* Write the checks of rules with the same key, by position: the first one
+ * which holds is the best of them.
+ */
+static void dictc_emit_checks(FILE * f, struct dictc_rule * d, int n) {
+	int and = 0;
+	int i = 0;
+
+	for(i = 0; i < n; i++) {
+		if(!d[i].tcpudp && d[i].sp[0] < 0 && d[i].dp[0] < 0) {
+			fprintf(f, "%sif(best > %uU) best = %uU;\n",
+				i ? "\telse " : "\t", d[i].id, d[i].id);
+
+			/* The ones after it can never be taken. */
+			return;
+		}
+
+		and = 0;
+		fprintf(f, "%sif(", i ? "\telse " : "\t");
+
+		if(d[i].tcpudp) {
+			fprintf(f, "(p == %d || p == %d)",
+				IPV4_PROTO_TCP, IPV4_PROTO_UDP);
+			and = 1;
+		}
+
+		dictc_emit_range(f, "sp", d[i].sp, &and);
+		dictc_emit_range(f, "dp", d[i].dp, &and);
+
+		fprintf(f, ") { if(best > %uU) best = %uU; }\n",
+			d[i].id, d[i].id);
+	}
+}
+
+/* Write a group of rules which check the same bits, as a function of its
+ * own: a switch on the addresses, one on protocol and single ports, then
+ * the ranges.
+ */
+static void dictc_emit_group(FILE * f, struct dictc_rule * d, int n) {
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	int l = 0;
+
+	fprintf(f,
+		"\n"
+		"static __attribute__((noinline)) unsigned int\n"
+		"g%u(uint64_t k0, uint64_t k1, unsigned int best) {\n"
+		"\tunsigned int sp = (k1 >> 16) & 0xffff;\n"
+		"\tunsigned int dp = k1 & 0xffff;\n"
+		"\tunsigned int p = (k1 >> 32) & 0xff;\n"
+		"\n"
+		"\t(void)sp; (void)dp; (void)p;\n"
+		"\n",
+		d[0].pri);
+
+	if(d[0].om) {
+		fprintf(f, "\tswitch(k0 & %#llxULL) {\n",
+			(unsigned long long)d[0].om);
+	}
+
+	for(i = 0; i < n; i = j) {
+		for(j = i; j < n && d[j].ov == d[i].ov; j++);
+
+		if(d[0].om) {
+			fprintf(f, "\tcase %#llxULL:\n",
+				(unsigned long long)d[i].ov);
+		}
+
+		if(d[0].im) {
+			fprintf(f, "\tswitch(k1 & %#llxULL) {\n",
+				(unsigned long long)d[0].im);
+		}
+
+		for(k = i; k < j; k = l) {
+			for(l = k; l < j && d[l].iv == d[k].iv; l++);
+
+			if(d[0].im) {
+				fprintf(f, "\tcase %#llxULL:\n",
+					(unsigned long long)d[k].iv);
+			}
+
+			dictc_emit_checks(f, d + k, l - k);
+
+			if(d[0].im) {
+				fprintf(f, "\tbreak;\n");
+			}
+		}
+
+		if(d[0].im) {
+			fprintf(f, "\t}\n");
+		}
+
+		if(d[0].om) {
+			fprintf(f, "\tbreak;\n");
+		}
+	}
+
+	if(d[0].om) {
+		fprintf(f, "\t}\n");
+	}
+
+	fprintf(f, "\treturn best;\n}\n");
+}
+
+/* Write the matcher of the rules loaded.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int dictc_emit(FILE * f) {
+	struct dictc_rule * d = 0;
+	struct dict_rule * r = 0;
+
+	int n = 0;
+	int i = 0;
+	int j = 0;
+
+	d = malloc(sizeof(struct dictc_rule) * (dict_rules_nr + 1));
+
+	if(!d) {
+		printf("Not enough memory to compile the rules!\n");
+		return -1;
+	}
+
+	/* IP rules are already taken in one or two reads by dict_ip. */
+	list_for_each_entry(r, &dict_rules, listh) {
+		if(r->type != RULE_IP) {
+			dictc_fold(r, &d[n++]);
+		}
+	}
+
+	/* Rules which check the same bits are grouped, and the groups are
+	 * ordered by their first rule: no group after one which starts
+	 * after the best rule found can give a better one, as in the tuple
+	 * space.
+	 */
+	qsort(d, n, sizeof(struct dictc_rule), dictc_by_mask);
+
+	for(i = 0; i < n; i = j) {
+		for(j = i; j < n &&
+			d[j].om == d[i].om && d[j].im == d[i].im; j++) {
+
+			if(d[j].id < d[i].pri || !d[i].pri) {
+				d[i].pri = d[j].id;
+			}
+		}
+
+		for(j = i; j < n &&
+			d[j].om == d[i].om && d[j].im == d[i].im; j++) {
+
+			d[j].pri = d[i].pri;
+		}
+	}
+
+	qsort(d, n, sizeof(struct dictc_rule), dictc_by_pri);
+
+	fprintf(f,
+		"/* Rules of NORI, generated at start; do not edit. */\n"
+		"\n"
+		"#include <stdint.h>\n"
+		"\n"
+		"unsigned int nori_rules_nr = %d;\n",
+		dict_rules_nr);
+
+	for(i = 0; i < n; i = j) {
+		for(j = i; j < n && d[j].pri == d[i].pri; j++);
+
+		dictc_emit_group(f, d + i, j - i);
+	}
+
+	/* Groups which start after the best rule found are skipped. */
+	fprintf(f,
+		"\n"
+		"unsigned int nori_rules_match(uint64_t * key, unsigned int found) {\n"
+		"\tunsigned int best = found ? found : ~0U;\n"
+		"\n");
+
+	for(i = 0; i < n; i = j) {
+		for(j = i; j < n && d[j].pri == d[i].pri; j++);
+
+		fprintf(f,
+			"\tif(best > %uU) best = g%u(key[0], key[1], best);\n",
+			d[i].pri, d[i].pri);
+	}
+
+	fprintf(f,
+		"\n"
+		"\treturn best != ~0U ? best : 0;\n"
+		"}\n");
+
+	free(d);
+
+	return ferror(f) ? -1 : 0;
+}
+
+/* Build 'src' into 'so' with the compiler; no shell is involved, $CC is
+ * only split at blanks.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int dictc_build(const char * src, const char * so) {
+	char * argv[DICTC_CC_ARGS + 8];
+	char * cc = getenv("CC");
+	char * save = 0;
+	char * w = 0;
+
+	int status = 0;
+	int n = 0;
+	pid_t pid;
+
+	cc = strdup(cc && cc[0] ? cc : "cc");
+
+	if(!cc) {
+		printf("No more memory to compile the rules!\n");
+		return -1;
+	}
+
+	for(w = strtok_r(cc, " \t", &save); w; w = strtok_r(0, " \t", &save)) {
+		if(n == DICTC_CC_ARGS) {
+			printf("Too many words in $CC!\n");
+			free(cc);
+			return -1;
+		}
+
+		argv[n++] = w;
+	}
+
+	if(!n) {
+		printf("No compiler in $CC!\n");
+		free(cc);
+		return -1;
+	}
+
+	argv[n++] = "-O2";
+	argv[n++] = "-shared";
+	argv[n++] = "-fPIC";
+	argv[n++] = "-o";
+	argv[n++] = (char *)so;
+	argv[n++] = (char *)src;
+	argv[n] = 0;
+
+	pid = fork();
+
+	if(pid < 0) {
+		printf("Cannot start the compiler!\n");
+		free(cc);
+		return -1;
+	}
+
+	if(pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	while(waitpid(pid, &status, 0) < 0) {
+		if(errno != EINTR) {
+			status = -1;
+			break;
+		}
+	}
+
+	if(status == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("Cannot compile the rules with %s!\n", argv[0]);
+		free(cc);
+		return -1;
+	}
+
+	free(cc);
+
+	return 0;
+}
+
+int dictc_load(dictc_match * match) {
+	char dir[] = "/tmp/nori-XXXXXX";
+	char src[64];
+	char so[64];
+
+	struct timespec a;
+	struct timespec b;
+
+	unsigned int * nr = 0;
+	void * h = 0;
+	FILE * f = 0;
+	int ret = -1;
+
+	if(!mkdtemp(dir)) {
+		printf("Cannot create a directory for the rules!\n");
+		return -1;
+	}
+
+	snprintf(src, sizeof(src), "%s/rules.c", dir);
+	snprintf(so, sizeof(so), "%s/rules.so", dir);
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+
+	f = fopen(src, "w");
+
+	if(!f) {
+		printf("Cannot write the rules in %s!\n", src);
+		goto out;
+	}
+
+	if(dictc_emit(f)) {
+		fclose(f);
+		goto out;
+	}
+
+	if(fclose(f)) {
+		printf("Cannot write the rules in %s!\n", src);
+		goto out;
+	}
+
+	if(dictc_build(src, so)) {
+		goto out;
+	}
+
+	/* Never closed: the matcher is used until the end. */
+	h = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+
+	if(!h) {
+		printf("Cannot load the rules: %s\n", dlerror());
+		goto out;
+	}
+
+	*match = (dictc_match)dlsym(h, "nori_rules_match");
+	nr = (unsigned int *)dlsym(h, "nori_rules_nr");
+
+	if(!*match || !nr || *nr != (unsigned int)dict_rules_nr) {
+		printf("Rules compiled in %s do not match the dictionary!\n",
+			so);
+		*match = 0;
+		dlclose(h);
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	printf("Rules compiled in %.2f seconds\n",
+		(b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9);
+
+	ret = 0;
+
+out:
+	unlink(src);
+	unlink(so);
+	rmdir(dir);
+
+	return ret;
+}
@@ -0,0 +1,39 @@
+/* Compiles the NORI dictionary to native code.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_DICTC_H
+#define __NORI_DICTC_H
+
+#include <stdint.h>
+
+/* Matcher built from the dictionary: takes the 5-tuple of a packet (see
+ * tss_key) and the position + 1 of the IP rule found in dict_ip, if any,
+ * and returns the one of the first rule which matches the packet, 0 if
+ * none.
+ */
+typedef unsigned int (* dictc_match)(uint64_t * key, unsigned int found);
+
+/* Translate the rules loaded, but the IP ones, into C, build them with
+ * the system compiler ($CC, or cc) and load the result.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int dictc_load(dictc_match * match);
+
+#endif /* __NORI_DICTC_H */
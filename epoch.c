@@ -0,0 +1,138 @@
+/* Epoch based reclamation of shared objects.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#include <stdlib.h>
+
+#include <pthread.h>
+
+#include "epoch.h"
+
+unsigned long ep_global = 1;
+
+/* Registered readers. */
+static struct ep_thread * ep_threads = 0;
+/* Retired objects, latest first. */
+static struct ep_node * ep_retired = 0;
+/* Objects retired and not freed yet. */
+static int ep_waiting = 0;
+
+/* Wakes the readers up, or 0. */
+static void (* ep_wake)(void) = 0;
+
+/* Lock protecting readers and retired objects. */
+static pthread_mutex_t ep_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ep_register(struct ep_thread * t) {
+	pthread_mutex_lock(&ep_lock);
+
+	ep_quiescent(t);
+	t->next = ep_threads;
+	ep_threads = t;
+
+	pthread_mutex_unlock(&ep_lock);
+}
+
+void ep_unregister(struct ep_thread * t) {
+	struct ep_thread ** p = 0;
+
+	pthread_mutex_lock(&ep_lock);
+
+	for(p = &ep_threads; *p; p = &(*p)->next) {
+		if(*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&ep_lock);
+}
+
+void ep_retire(struct ep_node * n, void (* free)(struct ep_node * n)) {
+	void (* wake)(void) = 0;
+
+	pthread_mutex_lock(&ep_lock);
+
+	n->free = free;
+
+	/* Readers which see the next epoch cannot reach it anymore. */
+	n->epoch = __atomic_fetch_add(&ep_global, 1, __ATOMIC_SEQ_CST);
+
+	n->next = ep_retired;
+	ep_retired = n;
+	ep_waiting++;
+
+	pthread_mutex_unlock(&ep_lock);
+
+	wake = __atomic_load_n(&ep_wake, __ATOMIC_ACQUIRE);
+
+	if(wake) {
+		wake();
+	}
+}
+
+void ep_waker(void (* wake)(void)) {
+	__atomic_store_n(&ep_wake, wake, __ATOMIC_RELEASE);
+}
+
+int ep_reclaim(void) {
+	struct ep_thread * t = 0;
+	struct ep_node * n   = 0;
+	struct ep_node ** p  = 0;
+	struct ep_node * dead = 0;
+
+	unsigned long min = (unsigned long)-1;
+	unsigned long s = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&ep_lock);
+
+	/* Oldest epoch still seen by an online reader. */
+	for(t = ep_threads; t; t = t->next) {
+		s = __atomic_load_n(&t->seen, __ATOMIC_SEQ_CST);
+
+		if(s && s < min) {
+			min = s;
+		}
+	}
+
+	for(p = &ep_retired; *p; ) {
+		n = *p;
+
+		if(n->epoch < min) {
+			*p = n->next;
+			n->next = dead;
+			dead = n;
+			ep_waiting--;
+		} else {
+			p = &n->next;
+		}
+	}
+
+	ret = ep_waiting;
+
+	pthread_mutex_unlock(&ep_lock);
+
+	while(dead) {
+		n = dead;
+		dead = n->next;
+		n->free(n);
+	}
+
+	return ret;
+}
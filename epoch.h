@@ -0,0 +1,99 @@
+/* Epoch based reclamation of shared objects.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_EPOCH_H
+#define __NORI_EPOCH_H
+
+/* Epoch based reclamation.
+ *
+ * Readers take no lock: they only announce, once in a while, that they do
+ * not hold any reference to shared objects (a quiescent state). Writers
+ * unlink the objects and retire them; a retired object is freed only once
+ * every reader went through a quiescent state after its retirement.
+ *
+ * A reader which does not announce anything for a long time delays the
+ * reclamation, so a sleeping one must be woken up or taken offline.
+ */
+
+/* Size of a cache line. */
+#define EP_CACHELINE		64
+
+/* A reader of the shared objects. */
+struct ep_thread {
+	/* Last epoch seen by the reader; 0 if offline. */
+	unsigned long seen;
+	/* Next registered reader. */
+	struct ep_thread * next;
+} __attribute__((aligned(EP_CACHELINE)));
+
+/* Header of an object which can be retired; embedded in the object. */
+struct ep_node {
+	/* Next retired object. */
+	struct ep_node * next;
+	/* Epoch of the retirement. */
+	unsigned long epoch;
+	/* Frees the object. */
+	void (* free)(struct ep_node * n);
+};
+
+/* Current epoch; never 0. */
+extern unsigned long ep_global;
+
+/* Nothing is referenced by the reader anymore. */
+static inline void ep_quiescent(struct ep_thread * t) {
+	__atomic_store_n(
+		&t->seen,
+		__atomic_load_n(&ep_global, __ATOMIC_SEQ_CST),
+		__ATOMIC_SEQ_CST);
+}
+
+/* The reader does not look at shared objects until it comes back online. */
+static inline void ep_offline(struct ep_thread * t) {
+	__atomic_store_n(&t->seen, 0, __ATOMIC_SEQ_CST);
+}
+
+/* The reader is going to look at shared objects again. */
+static inline void ep_online(struct ep_thread * t) {
+	ep_quiescent(t);
+}
+
+/* Add a reader, which starts online. */
+void ep_register(struct ep_thread * t);
+
+/* Remove a reader. */
+void ep_unregister(struct ep_thread * t);
+
+/* Retire an object already unlinked from any shared structure; it will be
+ * freed by ep_reclaim once no reader can reference it, and the readers are
+ * woken up by the function given to ep_waker, if any. Thread safe.
+ */
+void ep_retire(struct ep_node * n, void (* free)(struct ep_node * n));
+
+/* Function which wakes the sleeping readers up, so that they go through a
+ * quiescent state; called at every retirement.
+ */
+void ep_waker(void (* wake)(void));
+
+/* Free the retired objects which are not referenced anymore. Thread safe.
+ *
+ * Returns the number of objects still waiting.
+ */
+int ep_reclaim(void);
+
+#endif /* __NORI_EPOCH_H */
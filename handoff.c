@@ -0,0 +1,186 @@
+/* Hand the state of NORI to the process which takes its place.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+/* Address of a path; returns its length, or 0 if the path is too long. */
+static socklen_t handoff_addr(const char * path, struct sockaddr_un * sa) {
+	memset(sa, 0, sizeof(struct sockaddr_un));
+	sa->sun_family = AF_UNIX;
+
+	if(strlen(path) >= sizeof(sa->sun_path)) {
+		return 0;
+	}
+
+	strcpy(sa->sun_path, path);
+
+	return offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+}
+
+/* Do not wait for the peer more than 'timeout' milliseconds. */
+static int handoff_timeout(int fd, int timeout) {
+	struct timeval tv;
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+int handoff_listen(const char * path) {
+	struct sockaddr_un sa;
+	socklen_t sl = handoff_addr(path, &sa);
+	int fd = -1;
+
+	if(!sl) {
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	if(fd < 0) {
+		return -1;
+	}
+
+	/* Left by the process we took the place of. */
+	unlink(path);
+
+	if(bind(fd, (struct sockaddr *)&sa, sl) || listen(fd, 1)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int handoff_accept(int fd, int timeout) {
+	int c = accept4(fd, 0, 0, SOCK_CLOEXEC);
+
+	if(c < 0) {
+		return -1;
+	}
+
+	if(handoff_timeout(c, timeout)) {
+		close(c);
+		return -1;
+	}
+
+	return c;
+}
+
+int handoff_connect(const char * path, int timeout) {
+	struct sockaddr_un sa;
+	socklen_t sl = handoff_addr(path, &sa);
+	int fd = -1;
+
+	if(!sl) {
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	if(fd < 0) {
+		return -1;
+	}
+
+	if(connect(fd, (struct sockaddr *)&sa, sl) ||
+		handoff_timeout(fd, timeout)) {
+
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int handoff_send(int fd, void * msg, int size, int * fds, int nfds) {
+	char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	struct iovec iov = {msg, size};
+	struct msghdr mh = {0};
+	struct cmsghdr * cm = 0;
+
+	if(nfds < 0 || nfds > HANDOFF_FDS) {
+		return -1;
+	}
+
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if(nfds > 0) {
+		memset(cbuf, 0, sizeof(cbuf));
+
+		mh.msg_control = cbuf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+
+	return sendmsg(fd, &mh, MSG_NOSIGNAL) == size ? 0 : -1;
+}
+
+int handoff_recv(int fd, void * msg, int size, int * fds, int * nfds) {
+	char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	struct iovec iov = {msg, size};
+	struct msghdr mh = {0};
+	struct cmsghdr * cm = 0;
+	int ret = 0;
+
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	*nfds = 0;
+
+	do {
+		ret = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	} while(ret < 0 && errno == EINTR);
+
+	if(ret <= 0) {
+		return ret;
+	}
+
+	for(cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		*nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cm), sizeof(int) * *nfds);
+	}
+
+	return ret;
+}
@@ -0,0 +1,62 @@
+/* Hand the state of NORI to the process which takes its place.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_HANDOFF_H
+#define __NORI_HANDOFF_H
+
+/* Descriptors carried by a single message at most. */
+#define HANDOFF_FDS		16
+
+/* Listen at 'path' for the process which will take over; whatever was left
+ * there is removed.
+ *
+ * Returns the listening socket, a negative error number on error.
+ */
+int handoff_listen(const char * path);
+
+/* Take the connection of a process which wants to take over; waits at most
+ * 'timeout' milliseconds for its messages afterwards.
+ *
+ * Returns the connected socket, a negative error number on error.
+ */
+int handoff_accept(int fd, int timeout);
+
+/* Connect to the process listening at 'path', waiting at most 'timeout'
+ * milliseconds for its messages afterwards.
+ *
+ * Returns the connected socket, a negative error number if nobody listens.
+ */
+int handoff_connect(const char * path, int timeout);
+
+/* Send a message along with 'nfds' descriptors, which stay open here too.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int handoff_send(int fd, void * msg, int size, int * fds, int nfds);
+
+/* Receive a message of at most 'size' bytes; the descriptors which come with
+ * it are stored in 'fds', which has room for HANDOFF_FDS of them, and their
+ * number in 'nfds'.
+ *
+ * Returns the size of the message, 0 if the peer has gone, a negative error
+ * number on error or timeout.
+ */
+int handoff_recv(int fd, void * msg, int size, int * fds, int * nfds);
+
+#endif /* __NORI_HANDOFF_H */
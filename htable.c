@@ -0,0 +1,241 @@
+/* Hash tables for NORI lookups.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "htable.h"
+
+/* Allocate zeroed and aligned buckets. */
+static struct ht_bucket * ht_buckets(unsigned int n) {
+	struct ht_bucket * b = 0;
+
+	if(posix_memalign((void **)&b, HT_CACHELINE, sizeof(*b) * n)) {
+		return 0;
+	}
+
+	memset(b, 0, sizeof(*b) * n);
+
+	return b;
+}
+
+/* Place an entry which is known not to be in the table. */
+static void ht_place(
+	struct htable * t, unsigned long key, unsigned int hash, void * val) {
+
+	struct ht_bucket * b = 0;
+	unsigned int i = hash & t->mask;
+	int j = 0;
+
+	for(;;) {
+		b = &t->b[i];
+
+		for(j = 0; j < HT_SLOTS; j++) {
+			if(!b->val[j]) {
+				b->key[j] = key;
+				b->hash[j] = hash;
+				b->val[j] = val;
+
+				t->count++;
+				return;
+			}
+		}
+
+		/* Full; remember that we went over it. */
+		b->over++;
+		i = (i + 1) & t->mask;
+	}
+}
+
+/* Double the buckets and place the entries again. */
+static int ht_grow(struct htable * t) {
+	struct ht_bucket * old = t->b;
+	unsigned int n = t->mask + 1;
+	unsigned int i = 0;
+	int j = 0;
+
+	t->b = ht_buckets(n * 2);
+
+	if(!t->b) {
+		t->b = old;
+		return -1;
+	}
+
+	t->mask = n * 2 - 1;
+	t->count = 0;
+
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < HT_SLOTS; j++) {
+			if(old[i].val[j]) {
+				ht_place(t,
+					old[i].key[j],
+					old[i].hash[j],
+					old[i].val[j]);
+			}
+		}
+	}
+
+	free(old);
+
+	return 0;
+}
+
+/* Fill the empty slot 'j' of bucket 'i' with an entry placed after it
+ * which went over it, and so on with the slot left empty by that entry:
+ * entries get back as close as possible to their bucket, and lookups do not
+ * get longer as keys come and go.
+ */
+static void ht_shift(struct htable * t, unsigned int i, int j) {
+	struct ht_bucket * b = 0;
+	unsigned int k = 0;
+	unsigned int h = 0;
+	int l = 0;
+
+	while(t->b[i].over) {
+		for(k = (i + 1) & t->mask; ; k = (k + 1) & t->mask) {
+			b = &t->b[k];
+
+			for(l = 0; l < HT_SLOTS; l++) {
+				h = b->hash[l] & t->mask;
+
+				/* Its way goes through bucket 'i'. */
+				if(b->val[l] &&
+					((i - h) & t->mask) < ((k - h) & t->mask)) {
+
+					goto move;
+				}
+			}
+		}
+
+move:
+		t->b[i].key[j] = b->key[l];
+		t->b[i].hash[j] = b->hash[l];
+		t->b[i].val[j] = b->val[l];
+
+		b->val[l] = 0;
+		b->key[l] = 0;
+
+		/* It stops earlier now. */
+		for(h = i; h != k; h = (h + 1) & t->mask) {
+			t->b[h].over--;
+		}
+
+		i = k;
+		j = l;
+	}
+}
+
+int ht_init(struct htable * t, unsigned int size) {
+	unsigned int n = 1;
+
+	/* Keep the load under 3/4 of the slots. */
+	while(n * HT_SLOTS * 3 / 4 < size) {
+		n <<= 1;
+	}
+
+	t->b = ht_buckets(n);
+
+	if(!t->b) {
+		return -1;
+	}
+
+	t->mask = n - 1;
+	t->count = 0;
+
+	return 0;
+}
+
+void ht_free(struct htable * t) {
+	free(t->b);
+	t->b = 0;
+	t->count = 0;
+}
+
+int ht_add(struct htable * t, unsigned long key, unsigned int hash, void * val) {
+	struct ht_bucket * b = 0;
+	unsigned int i = hash & t->mask;
+	int j = 0;
+
+	/* Already there? Just replace the value. */
+	for(;;) {
+		b = &t->b[i];
+
+		for(j = 0; j < HT_SLOTS; j++) {
+			if(b->val[j] && b->key[j] == key) {
+				b->val[j] = val;
+				return 0;
+			}
+		}
+
+		if(!b->over) {
+			break;
+		}
+
+		i = (i + 1) & t->mask;
+	}
+
+	if((t->count + 1) * 4 > (t->mask + 1) * HT_SLOTS * 3) {
+		if(ht_grow(t)) {
+			return -1;
+		}
+	}
+
+	ht_place(t, key, hash, val);
+
+	return 0;
+}
+
+void * ht_del(struct htable * t, unsigned long key, unsigned int hash) {
+	struct ht_bucket * b = 0;
+	unsigned int h = hash & t->mask;
+	unsigned int i = h;
+	void * val = 0;
+	int j = 0;
+
+	for(;;) {
+		b = &t->b[i];
+
+		for(j = 0; j < HT_SLOTS; j++) {
+			if(b->val[j] && b->key[j] == key) {
+				goto found;
+			}
+		}
+
+		if(!b->over) {
+			return 0;
+		}
+
+		i = (i + 1) & t->mask;
+	}
+
+found:
+	val = b->val[j];
+	b->val[j] = 0;
+	b->key[j] = 0;
+	t->count--;
+
+	/* The buckets passed to reach this one have one overflow less. */
+	for(; h != i; h = (h + 1) & t->mask) {
+		t->b[h].over--;
+	}
+
+	ht_shift(t, i, j);
+
+	return val;
+}
@@ -0,0 +1,119 @@
+/* Hash tables for NORI lookups.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_HTABLE_H
+#define __NORI_HTABLE_H
+
+/* Slots of a bucket; sized so that a bucket fills a cache line. */
+#define HT_SLOTS		3
+/* Size of a cache line. */
+#define HT_CACHELINE		64
+
+/* A bucket of the table.
+ *
+ * A slot is empty if it has no value. 'over' counts the entries which did
+ * not find space in this bucket and have been placed after it; a lookup can
+ * stop at the first bucket with no such entries.
+ */
+struct ht_bucket {
+	/* Keys of the slots. */
+	unsigned long key[HT_SLOTS];
+	/* Values of the slots. */
+	void * val[HT_SLOTS];
+	/* Hashes of the keys, kept to grow the table. */
+	unsigned int hash[HT_SLOTS];
+	/* Entries which overflowed from this bucket. */
+	unsigned int over;
+} __attribute__((aligned(HT_CACHELINE)));
+
+/* Open-addressing table with bucketized linear probing.
+ *
+ * Keys are unsigned longs (a pointer to an interned object, or a number)
+ * and their hash is given by the caller. The table is not thread safe.
+ */
+struct htable {
+	/* Buckets - 1; the number of buckets is a power of 2. */
+	unsigned int mask;
+	/* Entries in the table. */
+	unsigned int count;
+	/* The buckets. */
+	struct ht_bucket * b;
+};
+
+/* Hash of a number. */
+static inline unsigned int ht_hash_int(unsigned long k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdUL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53UL;
+	k ^= k >> 33;
+
+	return (unsigned int)k;
+}
+
+/* Look for the value of a key.
+ *
+ * Returns the value, or 0 if the key is not in the table.
+ */
+static inline void * ht_get(struct htable * t, unsigned long key, unsigned int hash) {
+	struct ht_bucket * b = 0;
+	unsigned int i = hash & t->mask;
+	int j = 0;
+
+	for(;;) {
+		b = &t->b[i];
+
+		for(j = 0; j < HT_SLOTS; j++) {
+			if(b->val[j] && b->key[j] == key) {
+				return b->val[j];
+			}
+		}
+
+		/* Nobody went further than this. */
+		if(!b->over) {
+			return 0;
+		}
+
+		i = (i + 1) & t->mask;
+	}
+}
+
+/* Prepare a table for at least 'size' entries.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int ht_init(struct htable * t, unsigned int size);
+
+/* Release the table; values are not touched. */
+void ht_free(struct htable * t);
+
+/* Add a key, or replace its value if already there. The table grows if
+ * necessary. Values cannot be 0.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int ht_add(struct htable * t, unsigned long key, unsigned int hash, void * val);
+
+/* Remove a key from the table.
+ *
+ * Returns the value which was associated with the key, 0 if not found.
+ */
+void * ht_del(struct htable * t, unsigned long key, unsigned int hash);
+
+#endif /* __NORI_HTABLE_H */
@@ -0,0 +1,145 @@
+/* Longest prefix match of IPv4 addresses.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lpm.h"
+
+/* Groups allocated at first. */
+#define LPM_GROUPS		16
+
+/* Take a group of the second level, with all its entries set to 'val'.
+ *
+ * Returns the group, a negative error number on error.
+ */
+static int lpm_group_get(struct lpm * t, uint32_t val) {
+	uint32_t * tbl = 0;
+	unsigned int g = 0;
+	unsigned int n = 0;
+	int i = 0;
+
+	if(t->free) {
+		g = t->free - 1;
+		t->free = t->tbl8[g << 8];
+	} else {
+		if(t->used == t->groups) {
+			n = t->groups ? t->groups * 2 : LPM_GROUPS;
+
+			if(n > (LPM_VAL_MAX >> 8)) {
+				return -1;
+			}
+
+			tbl = realloc(t->tbl8, sizeof(uint32_t) * 256 * n);
+
+			if(!tbl) {
+				return -1;
+			}
+
+			t->tbl8 = tbl;
+			t->groups = n;
+		}
+
+		g = t->used++;
+	}
+
+	for(i = 0; i < 256; i++) {
+		t->tbl8[(g << 8) | i] = val;
+	}
+
+	return (int)g;
+}
+
+/* Give back a group nobody points to anymore. */
+static void lpm_group_put(struct lpm * t, unsigned int g) {
+	t->tbl8[g << 8] = t->free;
+	t->free = g + 1;
+}
+
+int lpm_init(struct lpm * t) {
+	memset(t, 0, sizeof(struct lpm));
+
+	/* Zeroed pages are not there until written. */
+	t->tbl24 = calloc(1 << 24, sizeof(uint32_t));
+
+	if(!t->tbl24) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void lpm_free(struct lpm * t) {
+	free(t->tbl24);
+	free(t->tbl8);
+
+	memset(t, 0, sizeof(struct lpm));
+}
+
+int lpm_set(struct lpm * t, uint32_t addr, int len, uint32_t val) {
+	uint32_t first = 0;
+	uint32_t n = 0;
+	uint32_t i = 0;
+	int g = 0;
+
+	if(len < 0 || len > 32 || val > LPM_VAL_MAX) {
+		return -1;
+	}
+
+	addr = len ? addr & (0xffffffffU << (32 - len)) : 0;
+
+	/* Whole /24s; longer prefixes in them are covered too. */
+	if(len <= 24) {
+		first = addr >> 8;
+		n = 1U << (24 - len);
+
+		for(i = first; i < first + n; i++) {
+			if(t->tbl24[i] & LPM_EXT) {
+				lpm_group_put(t, t->tbl24[i] & ~LPM_EXT);
+			}
+
+			t->tbl24[i] = val;
+		}
+
+		return 0;
+	}
+
+	/* Part of a /24, which gets its own group if it has none. */
+	i = addr >> 8;
+
+	if(!(t->tbl24[i] & LPM_EXT)) {
+		g = lpm_group_get(t, t->tbl24[i]);
+
+		if(g < 0) {
+			return -1;
+		}
+
+		t->tbl24[i] = LPM_EXT | (uint32_t)g;
+	}
+
+	g = (int)(t->tbl24[i] & ~LPM_EXT);
+	first = addr & 0xff;
+	n = 1U << (32 - len);
+
+	for(i = first; i < first + n; i++) {
+		t->tbl8[((uint32_t)g << 8) | i] = val;
+	}
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/* Longest prefix match of IPv4 addresses.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_LPM_H
+#define __NORI_LPM_H
+
+#include <stdint.h>
+
+/* Entry which points to a group of the second level. */
+#define LPM_EXT			0x80000000U
+/* Largest value an address can take. */
+#define LPM_VAL_MAX		0x7fffffffU
+
+/* DIR-24-8 table of IPv4 addresses.
+ *
+ * The first level has an entry for each /24; the addresses of a /24 with
+ * longer prefixes in it are taken from a group of 256 entries in the second
+ * level. A lookup costs one memory access, or two for such addresses.
+ *
+ * Every address has a value, 0 if none; setting a prefix gives the value to
+ * all of its addresses, whatever they had before. The first level is
+ * allocated at once (64MB), but only the pages which are written take
+ * memory. The table is not thread safe while it is changed.
+ */
+struct lpm {
+	/* First level, indexed by the upper 24 bits. */
+	uint32_t * tbl24;
+	/* Groups of the second level, one after the other. */
+	uint32_t * tbl8;
+	/* Groups allocated, and used. */
+	unsigned int groups;
+	unsigned int used;
+	/* First group released + 1, linked through their first entry; 0
+	 * if none.
+	 */
+	unsigned int free;
+};
+
+/* Value of an address, in host byte order. */
+static inline uint32_t lpm_get(struct lpm * t, uint32_t addr) {
+	uint32_t e = 0;
+
+	if(!t->tbl24) {
+		return 0;
+	}
+
+	e = t->tbl24[addr >> 8];
+
+	if(e & LPM_EXT) {
+		e = t->tbl8[((e & ~LPM_EXT) << 8) | (addr & 0xff)];
+	}
+
+	return e;
+}
+
+/* Prepare an empty table.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int lpm_init(struct lpm * t);
+
+/* Release the table. */
+void lpm_free(struct lpm * t);
+
+/* Give 'val' to every address of the prefix 'addr'/'len', in host byte
+ * order; values cannot be greater than LPM_VAL_MAX.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int lpm_set(struct lpm * t, uint32_t addr, int len, uint32_t val);
+
+#endif /* __NORI_LPM_H */
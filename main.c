@@ -21,13 +21,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #include <pthread.h>
 
 #include "dict.h"
+#include "dictc.h"
+#include "htable.h"
 #include "list.h"
+#include "dest.h"
+#include "epoch.h"
+#include "handoff.h"
+#include "slab.h"
 #include "proto.h"
+#include "ring.h"
 #include "rinaw.h"
 #include "tunw.h"
 
@@ -38,6 +50,8 @@
 #define ts_diff_to_s(a, b)				\
 	(((b.tv_sec - a.tv_sec) * 1) + ((b.tv_nsec - a.tv_nsec) / 1000000000))
 
+struct nori_worker;
+
 /* Information about a known flow. */
 struct known_flow {
 	/* This is member of a list. */
@@ -45,11 +59,31 @@ struct known_flow {
 
 	/* RINA port to use. */
 	rina_flow id;
+	/* Descriptor polled for incoming SDUs, or negative if not exposed. */
+	int fd;
+	/* Worker which polls this flow. */
+	struct nori_worker * owner;
+
+	/* Remote AE. */
+	struct dest * ae;
+	/* Next known flow with the same remote AE. */
+	struct known_flow * same;
+	/* Next flow to sweep, if it does not expose a descriptor. */
+	struct known_flow * unext;
 
-	/* Name. */
-	char name[NAME_MAX];
-	/* Instance. */
-	char instance[NAME_MAX];
+	/* Member of the timer wheel, if it can be idle for too long. */
+	struct list_head timer;
+	/* When the timer fires; coarse clock. */
+	unsigned long expire;
+	/* Last time traffic has been received from it; coarse clock. */
+	unsigned long last;
+	/* Last time it has been moved to the front of the known ones. */
+	unsigned long placed;
+	/* Given to the NORI which took over; it must not be released. */
+	int handed;
+
+	/* Reclamation once released. */
+	struct ep_node ep;
 };
 
 /*
@@ -64,12 +98,345 @@ volatile sig_atomic_t nori_ctrlc = 0;
 /* Counts how many 'ctrl-c' have been invoked on this program. */
 unsigned int nori_ctrl_i = 0;
 
+/*
+ * Event loop.
+ */
+
+/* Maximum number of events served per wake-up. */
+#define NORI_MAX_EVENTS		64
+/* Maximum number of packets moved per ready descriptor per wake-up. */
+#define NORI_BURST		32
+/* Poll timeout (ms) used when some descriptor cannot be waited on. */
+#define NORI_POLL_FALLBACK	1
+
+/* Tags for descriptors which are not flows in the epoll set. */
+#define NORI_POLL_TUN		((void *) 0x1)
+#define NORI_POLL_STOP		((void *) 0x2)
+#define NORI_POLL_KICK		((void *) 0x3)
+
+/* Readable once NORI has to stop; wakes up every sleeping thread. */
+static int nori_stopfd = -1;
+/* Readable once the counters have to be printed. */
+static int nori_statsfd = -1;
+
+/* Flows which do not expose a descriptor and must be swept. */
+static int nori_unpolled = 0;
+/* Such flows, swept without locks; see nori_flows_lock. */
+static struct known_flow * nori_unpolled_flows = 0;
+
+/*
+ * Classification cache.
+ */
+
+/* Connections kept in a bucket of the cache. */
+#define NORI_FC_WAYS		4
+/* Seconds a connection stays in the cache without traffic. */
+#define NORI_FC_AGE		30
+/* One lookup out of these is timed for the counters; a power of 2. */
+#define NORI_FC_SAMPLE		64
+
+/* Packets, made up from the rules, on which the compiled matcher is
+ * compared with the interpreter at start; and times each one is timed.
+ */
+#define NORI_PICK_KEYS		4096
+#define NORI_PICK_ROUNDS	5
+
+/* Compile the dictionary to native code? */
+static int nori_compile = 0;
+/* Matcher built from the dictionary, or 0 to interpret it. */
+static dictc_match nori_compiled = 0;
+
+/* Connections kept by the cache of each classification state; 0 for no
+ * cache.
+ */
+static unsigned int nori_fc_size = 8192;
+
+/* Destination kept for the connections which no rule takes. */
+static struct rule_dest nori_fc_drop;
+
+/* Decision taken for a connection. */
+struct nori_fc_entry {
+	/* 5-tuple of the connection; see nori_tuple. */
+	uint64_t key[2];
+	/* Destination selected, nori_fc_drop to discard the packets; 0 if
+	 * the entry is empty.
+	 */
+	struct rule_dest * de;
+	/* Rule which selected it. */
+	struct dict_rule * rule;
+	/* Last second it has been used; coarse clock. */
+	unsigned long seen;
+};
+
+/* Connections with the same hash; every connection has two buckets. */
+struct nori_fc_bucket {
+	struct nori_fc_entry e[NORI_FC_WAYS];
+};
+
+/* Classification state which cannot be shared between threads. */
+struct nori_cls {
+	/* Round-robin cursor of each rule, indexed by rule id. */
+	struct rule_dest ** next;
+
+	/* Decisions already taken, by 5-tuple; 0 if not used. */
+	struct nori_fc_bucket * fc;
+	/* Buckets - 1; the number of buckets is a power of 2. */
+	unsigned int fc_mask;
+
+	/* Lookups which found the connection, and which did not. */
+	unsigned long fc_hits;
+	unsigned long fc_misses;
+	/* Time (ns) taken by the timed ones, and how many they are. */
+	unsigned long fc_hit_ns;
+	unsigned long fc_hit_timed;
+	unsigned long fc_miss_ns;
+	unsigned long fc_miss_timed;
+};
+
+/* A thread serving traffic with its own epoll set. */
+struct nori_worker {
+	/* Epoll set where the worker sleeps. */
+	int epfd;
+	/* Interface (queue) where traffic from the flows is written. */
+	int tun;
+	/* Read traffic from the interface too? */
+	int poll_tun;
+	/* Wakes the worker up to let released flows go. */
+	int kick;
+
+	/* Reader of the flows. */
+	struct ep_thread ep;
+
+	/* Own classification state. */
+	struct nori_cls cls;
+	/* Own buffer. */
+	char buf[4096];
+	/* Own buffers for a burst of SDUs, read from a flow or the interface. */
+	char sdus[NORI_BURST][4096];
+	/* Buffers handed to RINA for the burst. */
+	struct iovec iov[NORI_BURST];
+
+	/* Thread running the worker. */
+	pthread_t t;
+};
+
+/* Worker of the main thread, which also serves the RINA events. */
+static struct nori_worker nori_main;
+/* Worker running in the current thread, if any. */
+static __thread struct nori_worker * nori_self = 0;
+
+/*
+ * Multi-queue dataplane.
+ */
+
+/* Number of queues of the TUN device, each with its own worker. */
+static int nori_queues = 1;
+/* Workers serving the queues. */
+static struct nori_worker * nori_workers = 0;
+/* Next worker to give an incoming flow to. */
+static unsigned int nori_next_worker = 0;
+
+/*
+ * Control plane.
+ */
+
+/* Poll timeout (ms) used when RINA events cannot be waited on. */
+#define NORI_CTRL_FALLBACK	100
+/* Poll timeout (ms) used while released flows wait to be freed. */
+#define NORI_CTRL_TICK		10
+
+/* Thread serving the RINA events. */
+static pthread_t nori_ctrl = 0;
+/* Flows accepted from remote peers per second; 0 for no limit. */
+static unsigned int nori_accept_rate = 0;
+
+/*
+ * Idle flows.
+ */
+
+/* Slots of the timer wheel, one per second. */
+#define NORI_WHEEL_SLOTS	256
+/* Poll timeout (ms) used while the wheel is turning. */
+#define NORI_WHEEL_TICK		1000
+
+/* Seconds without traffic before releasing a flow; 0 for never. */
+static unsigned int nori_idle = 0;
+/* Some flow can be released because idle? */
+static int nori_reaping = 0;
+/* Coarse clock (s) used to mark the traffic; moved by the control thread. */
+static unsigned long nori_clock = 0;
+
+/* Flows by the second their timer fires; needs nori_flows_lock. */
+static struct list_head nori_wheel[NORI_WHEEL_SLOTS];
+/* Last second served by the wheel. */
+static unsigned long nori_wheel_now = 0;
+/* Flows released because idle. */
+static unsigned long nori_reaped = 0;
+
+/*
+ * Standby flows.
+ */
+
+/* Destinations whose flows are kept allocated: the ones with a standby and
+ * the standbys themselves.
+ */
+static struct dest ** nori_kept = 0;
+/* Number of destinations above. */
+static int nori_kept_nr = 0;
+/* Last second they have been checked; coarse clock. */
+static unsigned long nori_kept_at = 0;
+/* Times the traffic of a destination moved to its standby. */
+static unsigned long nori_failovers = 0;
+
+/*
+ * Wildcard destinations.
+ */
+
+/* Instances known at most for a wildcard destination. */
+#define NORI_WILD_MAX		64
+
+/* Instances found for a destination with a wildcard instance. Updated in
+ * place by the control thread and read without locks; the instances are
+ * destinations too, which are never freed.
+ */
+struct nori_wild {
+	/* Number of instances. */
+	int n;
+	/* The instances, in no order. */
+	struct dest * d[NORI_WILD_MAX];
+};
+
+/* Instances seen by a lookup. */
+struct nori_found {
+	/* Wildcard destination looked up. */
+	struct dest * ae;
+	/* Number of instances. */
+	int n;
+	/* The instances. */
+	struct dest * d[NORI_WILD_MAX];
+};
+
+/* Destinations with a wildcard instance. */
+static struct dest ** nori_wilds = 0;
+/* Number of destinations above. */
+static int nori_wilds_nr = 0;
+/* Last second the instances have been looked up; coarse clock. */
+static unsigned long nori_wilds_at = 0;
+/* Packets dropped because no instance was known. */
+static unsigned long nori_wild_drops = 0;
+
+/*
+ * Handoff to a new NORI.
+ */
+
+/* Time (ms) given to the other NORI to answer during a handoff. */
+#define NORI_HANDOFF_WAIT	10000
+
+/* What a handoff message carries. */
+#define NORI_HO_DEV		0	/* Name and queues of the device. */
+#define NORI_HO_QUEUE		1	/* A queue, with its descriptor. */
+#define NORI_HO_FLOW		2	/* A flow, with its descriptor if any. */
+#define NORI_HO_END		3	/* Nothing more to hand. */
+#define NORI_HO_DONE		4	/* The new NORI serves the traffic. */
+
+/* Message exchanged during a handoff. */
+struct nori_ho_msg {
+	/* One of NORI_HO_DEV... */
+	int type;
+	/* Queues of the device. */
+	int n;
+	/* Device name, or remote AE of a flow. */
+	char name[256];
+	char instance[256];
+	char dif[256];
+};
+
+/* Flow received from the NORI being replaced. */
+struct nori_ho_flow {
+	struct dest * ae;
+	/* Descriptor of the flow, or negative if it has to be allocated. */
+	int fd;
+};
+
+/* Where NORIs meet to hand the traffic over, or 0. */
+static char * nori_handoff_path = 0;
+/* Waiting there for the NORI which will take over, or negative. */
+static int nori_handoff_fd = -1;
+/* Connection with the NORI taking over, kept until we leave. */
+static int nori_heir_fd = -1;
+/* Thread serving a NORI which takes over, away from the control thread. */
+static pthread_t nori_handoff_thread;
+/* Has it been started, and is it still serving? */
+static int nori_handoff_started = 0;
+static int nori_handing = 0;
+/* Connection with the NORI being replaced, until it leaves. */
+static int nori_takeover_fd = -1;
+/* Flows received from it. */
+static struct nori_ho_flow * nori_ho_flows = 0;
+/* Number of flows above. */
+static int nori_ho_flows_nr = 0;
+
+/*
+ * Pipelined dataplane.
+ */
+
+/* Size of the buffers moving through the pipeline. */
+#define NORI_PKT_SIZE		4096
+
+/* Packet moving between the pipeline stages. */
+struct nori_pkt {
+	/* Where this goes. */
+	struct rule_dest * dest;
+	/* Bytes of data. */
+	int size;
+	/* The packet itself. */
+	char data[NORI_PKT_SIZE];
+};
+
+/* Stage which sends the classified packets over RINA. */
+struct nori_sender {
+	/* Classified packets; classifier --> sender. */
+	struct ring tx;
+	/* Empty packets given back; sender --> classifier. */
+	struct ring free;
+
+	/* Wakes the sender up when new packets are there. */
+	int wfd;
+	/* The sender is going to sleep on wfd. */
+	int sleeping;
+
+	/* Reader of the flows, for their reclamation. */
+	struct ep_thread ep;
+
+	/* Thread running the stage. */
+	pthread_t t;
+} __attribute__((aligned(RING_CACHELINE)));
+
+/* Run the dataplane as a pipeline of threads? */
+static int nori_pipeline = 0;
+/* Number of sender stages. */
+static int nori_senders_nr = 1;
+/* Depth of the rings between the stages. */
+static int nori_ring_depth = 256;
+
+/* Classifier stage. */
+static struct nori_worker nori_classifier;
+/* Sender stages. */
+static struct nori_sender * nori_senders = 0;
+/* Packets shared by the stages. */
+static struct nori_pkt * nori_pkts = 0;
+/* Packets dropped because a sender was lagging behind. */
+static unsigned long nori_pipe_drops = 0;
+
 /*
  * Multi-thread alignment.
  */
 
-/* Lock to align multi-threaded operations. */
-static pthread_spinlock_t nori_mt_lock;
+/* Serializes who changes the flows and destinations. The dataplane reads
+ * them without locks: flows are published with atomic stores and released
+ * ones are freed only after every worker went through a quiescent state.
+ */
+static pthread_mutex_t nori_flows_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Default values for tun/tap creation.
@@ -77,6 +444,8 @@ static pthread_spinlock_t nori_mt_lock;
 
 /* Tun/tap fd to use for operations. */
 int nori_dev_fd = 0;
+/* Fds of the device queues, if more than one. */
+static int nori_dev_fds[TUNW_MAX_QUEUES];
 /* Let the kernel choose the name of the device. */
 static char nori_dev_name[16] = {0};
 /* Type of tun/tap device to create. */
@@ -88,25 +457,115 @@ static int nori_dev_pers = 0;
  * Known end-points and RINA stuff.
  */
 
-/* List of know AE which connected with this application. */
+/* Known flows, more recently used first; see nori_flow_lru. */
 static LIST_HEAD(nori_known_ae);
+/* Number of known flows. */
+static unsigned int nori_flows_nr = 0;
+/* Maximum number of known flows; 0 for no limit. */
+static unsigned int nori_max_flows = 0;
+/* Flows evicted to respect the limit, waiting to be released. */
+static LIST_HEAD(nori_evicted);
+/* Flows evicted so far. */
+static unsigned long nori_evictions = 0;
+/* Where flows are allocated from. */
+static struct slab nori_flow_slab;
+
+/* Allocate flows to every destination at start? */
+static int nori_prewarm_flows = 0;
+/* Reach the AEs of this host through shared memory? */
+static int nori_shm = 0;
+
+/* Only destination of the traffic, if the dictionary is just a 'default si'
+ * rule; packets go there without being looked at.
+ */
+static struct rule_dest * nori_direct = 0;
+
+/* Objects allocated at once by the flow cache. */
+#define NORI_FLOW_CHUNK		64
+/* Known flows indexed by port; by remote AE they hang on the destination. */
+static struct htable nori_flows_by_port;
+
+/*
+ * Flow allocation.
+ */
+
+/* Packets kept per destination while its flow is being allocated. */
+#define NORI_PENDING_MAX	64
+
+/* Packet waiting for the flow of its destination. */
+struct nori_qpkt {
+	/* This is member of a list. */
+	struct list_head listh;
+
+	/* Bytes of data. */
+	int size;
+	/* The packet itself. */
+	char data[0];
+};
+
+/* Allocation in progress toward a destination. */
+struct nori_req {
+	/* Handle given by RINA to the request. */
+	int handle;
+	/* Destination being resolved. */
+	struct dest * ae;
+	/* Worker which will poll the flow. */
+	struct nori_worker * owner;
+
+	/* Packets waiting for the flow, oldest first; needs nori_flows_lock. */
+	struct list_head pkts;
+	/* Number of waiting packets. */
+	int npkts;
+};
+
+/* Allocations in progress, indexed by handle. */
+static struct htable nori_reqs;
+/* Lock of the allocations table; held while the request is issued. */
+static pthread_mutex_t nori_req_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Packets dropped while waiting for a flow; needs nori_flows_lock. */
+static unsigned long nori_pending_drops = 0;
 
 /* IRATI instance to use. */
 static char * nori_instance = 0;
 /* IRATI name to use. */
 static char * nori_name = 0;
-/* IRATI DIF name to use. */
-static char * nori_dif = 0;
+/* DIFs the AE can be registered in at most. */
+#define NORI_DIFS		8
+
+/* IRATI DIF names to use; the first one for the rules which name none. */
+static char * nori_difs[NORI_DIFS] = {0};
+/* Number of DIFs above. */
+static int nori_difs_nr = 0;
+/* The AE is registered in the DIFs above. */
+static int nori_registered = 0;
 
 /******************************************************************************
  * Early fail.                                                                *
  ******************************************************************************/
 
+/* Ask every thread to stop. */
+void nori_stop(void) {
+	nori_ctrlc = 1;
+
+	/* Whatever thread got the signal, wake them all. */
+	if(nori_stopfd >= 0) {
+		eventfd_write(nori_stopfd, 1);
+	}
+}
+
+/* Handle a request of the user to print the counters. */
+void handle_stats(int signal) {
+	/* The control thread does it; only async-safe calls here. */
+	if(nori_statsfd >= 0) {
+		eventfd_write(nori_statsfd, 1);
+	}
+}
+
 /* Handle a break-execution signal from the user. */
 void handle_ctrlc(int signal) {
 	printf("! CTRL-C detected; breaking the execution !\n");
 
-	nori_ctrlc = 1;
+	nori_stop();
 	nori_ctrl_i++;
 
 	/* Force stop on triple ctrl-c. */
@@ -127,311 +586,3130 @@ void handle_ctrlc(int signal) {
 }
 
 /******************************************************************************
- * Handle new flow allocation/deallocation.                                   *
+ * Known flows.                                                               *
  ******************************************************************************/
 
-/* This happens in a multi-threaded context! */
-void * flow_allocated(void * args) {
-	char * name = 0;
-	char * inst = 0;
-
-	struct known_flow * kf = 0;
-	struct rina_AP_info * ap = (struct rina_AP_info *)args;
+/* Flow used for a destination; updates the cached state too. */
+static inline void nori_dest_set(struct dest * d, struct known_flow * kf) {
+	d->flows = kf;
+	d->gone = -1;
+	d->state = kf ? DEST_UP : d->pending ? DEST_PENDING : DEST_DOWN;
 
-	kf = malloc(sizeof(struct known_flow));
+	__atomic_store_n(&d->port, kf ? kf->id : -1, __ATOMIC_RELEASE);
+}
 
-	if(!kf) {
-		printf("No more memory while serving a flow.");
-		goto out;
-	}
+/* Seconds of the coarse clock. */
+unsigned long nori_time(void) {
+	struct timespec now;
 
-	memset(kf, 0, sizeof(struct known_flow));
-	INIT_LIST_HEAD(&kf->listh);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	name = strtok(ap->name, ":");
-	inst = strtok(0, ":");
+	return (unsigned long)now.tv_sec;
+}
 
-	kf->id = ap->port;
-	strncpy(kf->name, name, NAME_MAX);
-	strncpy(kf->instance, inst, NAME_MAX);
+/* Seconds the flow can stay without traffic; 0 for forever. */
+static inline unsigned int nori_flow_idle(struct known_flow * kf) {
+	/* Ready to take the traffic, which could never come. */
+	if(kf->ae->keep) {
+		return 0;
+	}
 
-	/* Use the list in an atomic context. */
-	pthread_spin_lock(&nori_mt_lock);
-	list_add(&kf->listh, &nori_known_ae);
-	pthread_spin_unlock(&nori_mt_lock);
+	return kf->ae->idle ? kf->ae->idle : nori_idle;
+}
 
-	printf("%s-%s connected...\n", kf->name, kf->instance);
+/* Arm the timer of a flow; needs nori_flows_lock. */
+void nori_timer_add(struct known_flow * kf, unsigned long at) {
+	kf->expire = at;
+	list_add_tail(&kf->timer, &nori_wheel[at % NORI_WHEEL_SLOTS]);
+}
 
-out:
-	/* Free the given ap info. */
-	free(ap);
+/* Time of the last traffic seen on the flow, either way. */
+static inline unsigned long nori_flow_last(struct known_flow * kf) {
+	return kf->last > kf->ae->last ? kf->last : kf->ae->last;
 }
 
-/* Remove this from the known flows. */
-void flow_deallocated(rina_flow port) {
-	int found = 0;
+/* Least recently used flow; needs nori_flows_lock.
+ *
+ * Flows are not moved at every packet, since the dataplane takes no lock:
+ * the oldest one gets a second chance, and goes back in front, if it had
+ * traffic since the last time it was placed there.
+ *
+ * Returns the flow, or 0 if there are none but the kept ones.
+ */
+struct known_flow * nori_flow_lru(void) {
 	struct known_flow * kf = 0;
+	unsigned int n = nori_flows_nr;
 
-	/* Use the list in an atomic context. */
-	pthread_spin_lock(&nori_mt_lock);
-	list_for_each_entry(kf, &nori_known_ae, listh) {
-		if(kf->id == port) {
-			found = 1;
-			break;
+	for(; n > 0; n--) {
+		kf = list_entry(nori_known_ae.prev, struct known_flow, listh);
+
+		if(nori_flow_last(kf) <= kf->placed && !kf->ae->keep) {
+			return kf;
 		}
-	}
 
-	if(found) {
-		list_del(&kf->listh);
+		kf->placed = nori_flow_last(kf);
+		list_move(&kf->listh, &nori_known_ae);
 	}
-	pthread_spin_unlock(&nori_mt_lock);
 
-	if(found) {
-		printf("%s-%s disconnected...\n", kf->name, kf->instance);
-		free(kf);
+	/* All of them are in use; the last one not kept goes. */
+	list_for_each_entry_reverse(kf, &nori_known_ae, listh) {
+		if(!kf->ae->keep) {
+			return kf;
+		}
 	}
-}
-
-/******************************************************************************
- * Core routines of NORI.                                                     *
- ******************************************************************************/
 
-int nori_send_to(char * name, char * instance, char * buf, int size) {
-	rina_flow id = -1;
-	struct rina_qos q;
-	struct known_flow * kf  = 0;
+	return 0;
+}
 
-	/* NOTE:
-	 * This can be slow, so maybe is better to pre-allocate the flow when
-	 * the rule is added to the dictionary?
-	 */
-	pthread_spin_lock(&nori_mt_lock);
-	list_for_each_entry(kf, &nori_known_ae, listh) {
-		if(strcmp(name, kf->name) == 0 &&
-			strcmp(instance, kf->instance) == 0) {
+void nori_flow_del(struct known_flow * kf);
+void nori_unpoll_flow(struct known_flow * kf);
+void nori_prewarm_dest(struct dest * ae, void * arg);
 
-			id = kf->id;
-			break;
-		}
-	}
-	pthread_spin_unlock(&nori_mt_lock);
+/* Add a flow to the known ones; needs nori_flows_lock.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_flow_add(struct known_flow * kf) {
+	struct known_flow * old = 0;
 
-	/* Not existing, so create it anew. */
-	if(id < 0) {
-		kf = malloc(sizeof(struct known_flow));
+	/* Make room; nori_flows_trim releases it once out of the lock. */
+	if(nori_max_flows && nori_flows_nr >= nori_max_flows) {
+		old = nori_flow_lru();
 
-		if(!kf) {
+		/* Flows kept for failover are never given away. */
+		if(!old) {
+			printf("Only kept flows in use, refusing flow %d\n",
+				kf->id);
 			return -1;
 		}
+	}
 
-		/* NOTE: Use unreliable by default. User should choose this. */
-		qos_unreliable_default(q);
+	if(ht_add(&nori_flows_by_port, kf->id, ht_hash_int(kf->id), kf)) {
+		return -1;
+	}
 
-		kf->id = rina_request_flow(
-			nori_name, nori_instance, name, instance, &q);
+	if(old) {
+		nori_flow_del(old);
+		nori_unpoll_flow(old);
 
-		if(kf->id < 0) {
-			/*
-			printf("Failed to allocate the flow to %s-%s...\n",
-				name, instance);
-			 */
-			free(kf);
-			return -1;
-		}
+		list_add_tail(&old->timer, &nori_evicted);
+		nori_evictions++;
+	}
 
-		INIT_LIST_HEAD(&kf->listh);
-		strcpy(kf->name, name);
-		strcpy(kf->instance, instance);
+	/* Latest one is used first. */
+	kf->same = kf->ae->flows;
+	nori_dest_set(kf->ae, kf);
 
-		/* Add to the list, so can be reused. */
-		pthread_spin_lock(&nori_mt_lock);
-		list_add(&kf->listh, &nori_known_ae);
-		pthread_spin_unlock(&nori_mt_lock);
+	list_add(&kf->listh, &nori_known_ae);
+	nori_flows_nr++;
 
-		id = kf->id;
+	kf->last = nori_clock;
+	kf->placed = nori_clock;
+	INIT_LIST_HEAD(&kf->timer);
 
-		printf("New flow allocated to %s-%s, id %d\n",
-			name, instance, id);
+	if(nori_flow_idle(kf)) {
+		nori_timer_add(kf, nori_clock + nori_flow_idle(kf));
 	}
 
-	/*printf("Sending to %d\n", id);*/
+	/* Sweepers see it complete. */
+	if(kf->fd < 0) {
+		kf->unext = nori_unpolled_flows;
+		__atomic_store_n(&nori_unpolled_flows, kf, __ATOMIC_RELEASE);
+	}
 
-	return rina_write_sdu(id, buf, size);
+	return 0;
 }
 
-/* Returns 1 if action has not been taken, 0 on success, -1 on failure. */
-int nori_take_ip_action(struct dict_rule * rule, char * buf, int size) {
-	struct rule_ip * r = (struct rule_ip *)rule->data;
-	int off = TUN_INITIAL_OFFSET;
+/* Remove a flow from the known ones; needs nori_flows_lock. */
+void nori_flow_del(struct known_flow * kf) {
+	struct known_flow * p = kf->ae->flows;
+	struct known_flow ** u = 0;
+
+	ht_del(&nori_flows_by_port, kf->id, ht_hash_int(kf->id));
 
-	if(r->direction == RULE_DIR_SRC) {
-		off += IPV4_SOURCE_OFFSET;
+	if(p == kf) {
+		/* Next one with the same AE takes its place, if any. */
+		nori_dest_set(kf->ae, kf->same);
 	} else {
-		off += IPV4_DEST_OFFSET;
-	}
+		for(; p && p->same != kf; p = p->same);
 
-	/* Are the addresses equals? */
-	if(memcmp(buf + off, r->address, 4) == 0) {
-		/*
-		printf("Taking IP action, src=%d.%d.%d.%d\n",
-			(unsigned char)buf[off],
-			(unsigned char)buf[off + 1],
-			(unsigned char)buf[off + 2],
-			(unsigned char)buf[off + 3]);
-		 */
-		if(nori_send_to(r->dest.ae, r->dest.ai, buf, size) < 0) {
-			return -1;
+		if(p) {
+			p->same = kf->same;
 		}
-
-		return 0;
 	}
 
-	return 1;
+	list_del(&kf->listh);
+	list_del_init(&kf->timer);
+	nori_flows_nr--;
+
+	/* Sweepers already on it can still move to the next one. */
+	if(kf->fd < 0) {
+		for(u = &nori_unpolled_flows; *u && *u != kf; u = &(*u)->unext);
+
+		if(*u) {
+			__atomic_store_n(u, kf->unext, __ATOMIC_RELEASE);
+		}
+	}
 }
 
-/* Returns 0 on success, -1 on failure. */
-int nori_take_default_action(struct dict_rule * rule, char * buf, int size) {
-	struct rule_default * rd = (struct rule_default *)rule->data;
-	struct rule_dest * de = 0;
+/* Free a released flow; nobody can reach it anymore. */
+void nori_flow_free(struct ep_node * n) {
+	slab_free(&nori_flow_slab, container_of(n, struct known_flow, ep));
+}
 
-	struct timespec now;
+/* Wake the workers up, so they let the released flows go. */
+void nori_kick_workers(void) {
+	eventfd_t one = 1;
+	int i = 0;
 
-	/* Go though the first destination only! */
-	if(rd->strategy == RULE_STR_SI) {
-		de = list_first_entry_or_null(
-			&rd->dests, struct rule_dest, listh);
+	eventfd_write(nori_main.kick, one);
 
-		if(!de) {
-			printf("No destination for default rule!\n");
-			return -1;
-		}
+	for(i = 0; i < nori_queues && nori_workers; i++) {
+		eventfd_write(nori_workers[i].kick, one);
+	}
+}
 
-		/*printf("Taking default SI action...\n");*/
+/* Release a flow once the workers are done with it; it must not be
+ * reachable anymore.
+ */
+void nori_flow_retire(struct known_flow * kf) {
+	ep_retire(&kf->ep, nori_flow_free);
+}
 
-		return nori_send_to(de->ae, de->ai, buf, size);
-	} else if (rd->strategy == RULE_STR_RR) {
-/* Repeat the selection getting the next possible destination. */
-repeat:
-		de = rd->next;
+/* Release the flows evicted to respect the limit. */
+void nori_flows_trim(void) {
+	struct known_flow * kf = 0;
 
-		/*
-		printf("Taking default RR action fro %s-%s...\n",
-			de->ae, de->ai);
-		 */
+	for(;;) {
+		pthread_mutex_lock(&nori_flows_lock);
 
-		/* Next is end of the list? */
-		if(de->listh.next == &rd->dests) {
-			/* Take again the first one. */
-			rd->next = list_first_entry(
-				&rd->dests, struct rule_dest, listh);
-		}
-		/* There's someone after us? */
-		else {
-			rd->next = list_next_entry(de, listh);
+		if(list_empty(&nori_evicted)) {
+			pthread_mutex_unlock(&nori_flows_lock);
+			break;
 		}
 
-		/*
-		 * Ok, 'de' has been selected and next set properly.
-		 */
+		kf = list_first_entry(&nori_evicted, struct known_flow, timer);
+		list_del(&kf->timer);
 
-		if(!de->open) {
-			clock_gettime(CLOCK_REALTIME, &now);
+		pthread_mutex_unlock(&nori_flows_lock);
 
-			/* More than 1 seconds elapsed from the last time we
-			 * tried to use this.
-			 */
-			if(ts_diff_to_s(de->lrt, now) > 1) {
-				de->open = 1;
-			} else {
-				goto repeat;
-			}
-		}
+		printf("%s-%s evicted, releasing flow %d\n",
+			kf->ae->name, kf->ae->instance, kf->id);
 
-		if(nori_send_to(de->ae, de->ai, buf, size) > 0) {
-			de->open = 1;
-		}
-		/* Error while sending... not possible to send this to him. */
-		else {
-			clock_gettime(CLOCK_REALTIME, &de->lrt);
-			de->open = 0;
+		rina_release_flow(kf->id);
 
-			goto repeat;
-		}
+		/* Workers could be still reading it. */
+		nori_flow_retire(kf);
 	}
-
-	return 0;
 }
 
-/* Analyze the data and take action depending on the rules. */
-int nori_take_action(char * buf, int size) {
-	struct dict_rule * r = 0;
+/******************************************************************************
+ * Flow polling.                                                              *
+ ******************************************************************************/
 
-	list_for_each_entry(r, &dict_rules, listh) {
-		switch(r->type) {
-		case RULE_IP:
-			/* If the action has not been taken, list for all. */
-			if(nori_take_ip_action(r, buf, size) > 0) {
-				continue;
-			}
-			return 0; /* Complete stop. */
-		case RULE_DEF:
-			nori_take_default_action(r, buf, size);
-			return 0; /* Complete stop. */
-		default:
-			printf("Unknown action %d!\n", r->type);
-			break;
-		}
-	}
+/* Add the flow to the set watched by a worker. */
+int nori_poll_flow(struct known_flow * kf, struct nori_worker * w) {
+	struct epoll_event ev = {0};
 
-	return 0;
-}
+	/* Never wait on it; set once for its whole life. */
+	rina_async_flow(kf->id);
 
-/* Main loop for NORI. */
-int nori_loop(void) {
+	kf->fd = rina_flow_fd(kf->id);
+	kf->owner = w;
+
+	/* Stack does not expose it; it will be swept on timeout. */
+	if(kf->fd < 0) {
+		__sync_fetch_and_add(&nori_unpolled, 1);
+		return 0;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = kf;
+
+	return epoll_ctl(w->epfd, EPOLL_CTL_ADD, kf->fd, &ev);
+}
+
+/* Remove the flow from the set watched by its worker. */
+void nori_unpoll_flow(struct known_flow * kf) {
+	if(kf->fd < 0) {
+		__sync_fetch_and_sub(&nori_unpolled, 1);
+		return;
+	}
+
+	/* Could be already gone if the stack closed the descriptor. */
+	epoll_ctl(kf->owner->epfd, EPOLL_CTL_DEL, kf->fd, 0);
+}
+
+/* Worker which will poll a flow accepted from a remote peer. */
+struct nori_worker * nori_flow_owner(void) {
+	unsigned int i = 0;
+
+	if(!nori_workers) {
+		return &nori_main;
+	}
+
+	/* Spread them between the queues. */
+	i = __sync_fetch_and_add(&nori_next_worker, 1);
+
+	return &nori_workers[i % nori_queues];
+}
+
+/******************************************************************************
+ * Handle new flow allocation/deallocation.                                   *
+ ******************************************************************************/
+
+/* This happens in a multi-threaded context! */
+void * flow_allocated(void * args) {
+	char * name = 0;
+	char * inst = 0;
+	char * save = 0;
+
+	struct known_flow * kf = 0;
+	struct rina_AP_info * ap = (struct rina_AP_info *)args;
+
+	kf = slab_alloc(&nori_flow_slab);
+
+	if(!kf) {
+		printf("No more memory while serving a flow.");
+		goto out;
+	}
+
+	memset(kf, 0, sizeof(struct known_flow));
+	INIT_LIST_HEAD(&kf->listh);
+
+	name = strtok_r(ap->name, ":", &save);
+	inst = strtok_r(0, ":", &save);
+
+	kf->id = ap->port;
+	/* Same AE through another DIF is another destination. */
+	kf->ae = dest_intern(name ? name : "", inst ? inst : "",
+		ap->dif[0] ? ap->dif : nori_difs[0]);
+
+	if(!kf->ae) {
+		printf("No more memory while serving a flow.");
+		slab_free(&nori_flow_slab, kf);
+		goto out;
+	}
+
+	/* Never published if its traffic cannot be read. */
+	if(nori_poll_flow(kf, nori_flow_owner())) {
+		printf("Cannot poll flow %d\n", kf->id);
+		rina_release_flow(kf->id);
+		slab_free(&nori_flow_slab, kf);
+		goto out;
+	}
+
+	/* Use the list in an atomic context. */
+	pthread_mutex_lock(&nori_flows_lock);
+
+	if(nori_flow_add(kf)) {
+		pthread_mutex_unlock(&nori_flows_lock);
+
+		printf("Cannot serve flow %d\n", kf->id);
+		nori_unpoll_flow(kf);
+		rina_release_flow(kf->id);
+		nori_flow_retire(kf);
+		goto out;
+	}
+
+	pthread_mutex_unlock(&nori_flows_lock);
+
+	printf("%s-%s connected in %s...\n",
+		kf->ae->name, kf->ae->instance, kf->ae->dif);
+
+	/* Someone could have been evicted to make room. */
+	nori_flows_trim();
+
+out:
+	/* Free the given ap info. */
+	free(ap);
+
+	return 0;
+}
+
+/* Remove this from the known flows. */
+void flow_deallocated(rina_flow port) {
+	int found = 0;
+	int started = 0;
+	struct known_flow * kf = 0;
+
+	/* Use the list in an atomic context. */
+	pthread_mutex_lock(&nori_flows_lock);
+	kf = ht_get(&nori_flows_by_port, port, ht_hash_int(port));
+
+	if(kf) {
+		found = 1;
+		nori_flow_del(kf);
+		nori_unpoll_flow(kf);
+
+		/* Not already seen failing by the dataplane. */
+		if(kf->ae->standby && kf->ae->port < 0 && kf->ae->gone != port) {
+			__sync_fetch_and_add(&nori_failovers, 1);
+		}
+	}
+	pthread_mutex_unlock(&nori_flows_lock);
+
+	if(found) {
+		printf("%s-%s disconnected from %s...\n",
+			kf->ae->name, kf->ae->instance, kf->ae->dif);
+
+		/* Allocated again at once; its standby, if any, takes the
+		 * traffic meanwhile.
+		 */
+		if(kf->ae->keep) {
+			nori_prewarm_dest(kf->ae, &started);
+		}
+
+		/* Workers could be still reading it. */
+		nori_flow_retire(kf);
+	}
+}
+
+/******************************************************************************
+ * Flow allocation.                                                           *
+ ******************************************************************************/
+
+/* Give up an allocation and whatever was waiting for it. */
+void nori_req_fail(struct nori_req * req) {
+	struct nori_qpkt * p   = 0;
+	struct nori_qpkt * tmp = 0;
+
+	LIST_HEAD(pkts);
+
+	pthread_mutex_lock(&nori_flows_lock);
+
+	list_splice_init(&req->pkts, &pkts);
+	nori_pending_drops += req->npkts;
+
+	req->ae->pending = 0;
+
+	/* A peer could have connected meanwhile. */
+	if(req->ae->state == DEST_PENDING) {
+		req->ae->state = DEST_DOWN;
+	}
+
+	pthread_mutex_unlock(&nori_flows_lock);
+
+	list_for_each_entry_safe(p, tmp, &pkts, listh) {
+		list_del(&p->listh);
+		free(p);
+	}
+
+	free(req);
+}
+
+/* Prepare the allocation of a flow toward a destination which has none;
+ * needs nori_flows_lock.
+ *
+ * Returns the request, or 0 if there is no more memory.
+ */
+struct nori_req * nori_req_new(struct dest * ae, struct nori_worker * owner) {
+	struct nori_req * req = malloc(sizeof(struct nori_req));
+
+	if(!req) {
+		return 0;
+	}
+
+	memset(req, 0, sizeof(struct nori_req));
+	INIT_LIST_HEAD(&req->pkts);
+
+	req->handle = -1;
+	req->ae = ae;
+	req->owner = owner;
+
+	ae->pending = req;
+	ae->state = DEST_PENDING;
+
+	return req;
+}
+
+/* Ask RINA for a flow toward the destination of the request.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_req_start(struct nori_req * req) {
+	struct rina_qos q;
+
+	/* NOTE: Use unreliable by default. User should choose this. */
+	qos_unreliable_default(q);
+
+	/* The result cannot be reported before the request is in the table. */
+	pthread_mutex_lock(&nori_req_lock);
+
+	req->handle = rina_request_flow_async(nori_name, nori_instance,
+		req->ae->name, req->ae->instance, req->ae->dif, &q);
+
+	if(req->handle < 0 || ht_add(
+		&nori_reqs, req->handle, ht_hash_int(req->handle), req)) {
+
+		pthread_mutex_unlock(&nori_req_lock);
+		return -1;
+	}
+
+	pthread_mutex_unlock(&nori_req_lock);
+
+	return 0;
+}
+
+/* Send the packets held while the flow was allocated, in bursts. */
+void nori_flush_pending(struct known_flow * kf, struct list_head * pkts) {
+	struct nori_qpkt * p = 0;
+	struct nori_qpkt * tmp = 0;
+	struct iovec iov[NORI_BURST];
+	int n = 0;
+
+	list_for_each_entry_safe(p, tmp, pkts, listh) {
+		iov[n].iov_base = p->data;
+		iov[n].iov_len = p->size;
+		n++;
+
+		if(n == NORI_BURST || &tmp->listh == pkts) {
+			rina_write_sdus(kf->id, kf->fd, iov, n);
+			n = 0;
+		}
+	}
+
+	list_for_each_entry_safe(p, tmp, pkts, listh) {
+		list_del(&p->listh);
+		free(p);
+	}
+}
+
+/* Result of an allocation; this happens in the main thread. */
+void flow_ready(int handle, rina_flow port) {
+	struct nori_req * req  = 0;
+	struct known_flow * kf = 0;
+
+	int err = 0;
+
+	pthread_mutex_lock(&nori_req_lock);
+	req = ht_del(&nori_reqs, handle, ht_hash_int(handle));
+	pthread_mutex_unlock(&nori_req_lock);
+
+	if(!req) {
+		if(port >= 0) {
+			rina_release_flow(port);
+		}
+
+		return;
+	}
+
+	if(port < 0) {
+		/*
+		printf("Failed to allocate the flow to %s-%s...\n",
+			req->ae->name, req->ae->instance);
+		 */
+		nori_req_fail(req);
+		return;
+	}
+
+	kf = slab_alloc(&nori_flow_slab);
+
+	if(!kf) {
+		rina_release_flow(port);
+		nori_req_fail(req);
+		return;
+	}
+
+	memset(kf, 0, sizeof(struct known_flow));
+	INIT_LIST_HEAD(&kf->listh);
+
+	kf->id = port;
+	kf->ae = req->ae;
+
+	/* Polled by who asked for it, or by the main loop. */
+	if(nori_poll_flow(kf, req->owner)) {
+		printf("Cannot poll flow %d\n", port);
+		rina_release_flow(port);
+		slab_free(&nori_flow_slab, kf);
+		nori_req_fail(req);
+		return;
+	}
+
+	/* Send what is waiting, in order; packets keep being queued until the
+	 * flow is published, so none of them can overtake the older ones.
+	 */
+	for(;;) {
+		LIST_HEAD(pkts);
+
+		pthread_mutex_lock(&nori_flows_lock);
+
+		if(list_empty(&req->pkts)) {
+			req->ae->pending = 0;
+			err = nori_flow_add(kf);
+
+			if(err && req->ae->state == DEST_PENDING) {
+				req->ae->state = DEST_DOWN;
+			}
+
+			pthread_mutex_unlock(&nori_flows_lock);
+			break;
+		}
+
+		list_splice_init(&req->pkts, &pkts);
+		req->npkts = 0;
+
+		pthread_mutex_unlock(&nori_flows_lock);
+
+		nori_flush_pending(kf, &pkts);
+	}
+
+	if(err) {
+		nori_unpoll_flow(kf);
+		rina_release_flow(port);
+		nori_flow_retire(kf);
+	} else {
+		printf("New flow allocated to %s-%s in %s, id %d\n",
+			req->ae->name, req->ae->instance, req->ae->dif, port);
+
+		/* Someone could have been evicted to make room. */
+		nori_flows_trim();
+	}
+
+	free(req);
+}
+
+/* Hold a packet for a destination which has no flow yet, starting the
+ * allocation if nobody did it already.
+ *
+ * Returns the size of the packet if it has been taken, a negative error
+ * number on error.
+ */
+int nori_send_pending(struct dest * ae, char * buf, int size) {
+	struct nori_req * req = 0;
+	struct nori_qpkt * p  = malloc(sizeof(struct nori_qpkt) + size);
+
+	rina_flow id = -1;
+	int start = 0;
+
+	if(!p) {
+		return -1;
+	}
+
+	p->size = size;
+	memcpy(p->data, buf, size);
+
+	pthread_mutex_lock(&nori_flows_lock);
+
+	/* Went up in the meantime. */
+	if(ae->state == DEST_UP) {
+		id = ae->port;
+		pthread_mutex_unlock(&nori_flows_lock);
+
+		free(p);
+		return rina_write_sdu(id, buf, size);
+	}
+
+	/* First one here starts the allocation. */
+	if(ae->state == DEST_DOWN) {
+		if(!nori_req_new(ae, nori_self ? nori_self : &nori_main)) {
+			pthread_mutex_unlock(&nori_flows_lock);
+
+			free(p);
+			return -1;
+		}
+
+		start = 1;
+	}
+
+	req = ae->pending;
+
+	if(req->npkts < NORI_PENDING_MAX) {
+		list_add_tail(&p->listh, &req->pkts);
+		req->npkts++;
+		p = 0;
+	} else {
+		nori_pending_drops++;
+	}
+
+	pthread_mutex_unlock(&nori_flows_lock);
+
+	if(p) {
+		free(p);
+		return -1;
+	}
+
+	if(start && nori_req_start(req)) {
+		nori_req_fail(req);
+		return -1;
+	}
+
+	return size;
+}
+
+/* Start the allocation of a flow to a destination, if it has none. */
+void nori_prewarm_dest(struct dest * ae, void * arg) {
+	struct nori_req * req = 0;
+	int * started = (int *)arg;
+
+	/* Only its instances have flows. */
+	if(ae->members) {
+		return;
+	}
+
+	pthread_mutex_lock(&nori_flows_lock);
+
+	if(ae->state == DEST_DOWN) {
+		/* Spread them between the workers, as accepted flows are. */
+		req = nori_req_new(ae, nori_flow_owner());
+	}
+
+	pthread_mutex_unlock(&nori_flows_lock);
+
+	if(!req) {
+		return;
+	}
+
+	if(nori_req_start(req)) {
+		nori_req_fail(req);
+		return;
+	}
+
+	(*started)++;
+}
+
+/* Ask for a flow to every destination of the dictionary at once; results
+ * are served by the control thread as they come.
+ */
+void nori_prewarm(void) {
+	int started = 0;
+
+	/* Only the dictionary ones are known before accepting flows. */
+	dest_walk(nori_prewarm_dest, &started);
+
+	printf("Allocating %d flows in advance...\n", started);
+}
+
+/* Add a destination to the kept ones, if it needs it. */
+void nori_keep_add(struct dest * ae, void * arg) {
+	struct dest ** k = 0;
+
+	if(!ae->keep) {
+		return;
+	}
+
+	k = realloc(nori_kept, sizeof(struct dest *) * (nori_kept_nr + 1));
+
+	if(!k) {
+		printf("Not enough memory; flow to %s-%s not kept.\n",
+			ae->name, ae->instance);
+		return;
+	}
+
+	nori_kept = k;
+	nori_kept[nori_kept_nr++] = ae;
+}
+
+/* Collect the destinations whose flows are kept; the dictionary ones are the
+ * only known at start.
+ */
+void nori_keep_init(void) {
+	dest_walk(nori_keep_add, 0);
+
+	if(nori_kept_nr) {
+		printf("Keeping %d flows ready for failover\n", nori_kept_nr);
+	}
+}
+
+/* Allocate again the kept flows which went down; runs in the control
+ * thread, once per second at most.
+ */
+void nori_keep(void) {
+	unsigned long now = __atomic_load_n(&nori_clock, __ATOMIC_RELAXED);
+	int started = 0;
+	int i = 0;
+
+	if(!nori_kept_nr || nori_kept_at == now) {
+		return;
+	}
+
+	nori_kept_at = now;
+
+	for(i = 0; i < nori_kept_nr; i++) {
+		nori_prewarm_dest(nori_kept[i], &started);
+	}
+}
+
+/* An instance of a wildcard destination has been found. */
+void nori_wild_found(const char * instance, void * arg) {
+	struct nori_found * f = (struct nori_found *)arg;
+	struct dest * d = 0;
+	int i = 0;
+
+	/* Not to ourselves. */
+	if(f->n == NORI_WILD_MAX || (
+		strcmp(f->ae->name, nori_name) == 0 &&
+		strcmp(instance, nori_instance) == 0)) {
+
+		return;
+	}
+
+	d = dest_intern(f->ae->name, instance, f->ae->dif);
+
+	if(!d) {
+		return;
+	}
+
+	for(i = 0; i < f->n; i++) {
+		if(f->d[i] == d) {
+			return;
+		}
+	}
+
+	/* Same settings of the rules using the wildcard. */
+	if(d->idle < f->ae->idle) {
+		d->idle = f->ae->idle;
+	}
+
+	f->d[f->n++] = d;
+}
+
+/* Bring the instances of a wildcard destination up to date; the dataplane
+ * can see a mix of the old and the new ones meanwhile.
+ */
+void nori_wild_update(struct dest * ae, struct nori_found * f) {
+	struct nori_wild * w = (struct nori_wild *)ae->members;
+	struct dest * d = 0;
+	int i = 0;
+	int j = 0;
+
+	/* Gone ones are replaced by the last. */
+	for(i = 0; i < w->n; ) {
+		d = w->d[i];
+
+		for(j = 0; j < f->n && f->d[j] != d; j++);
+
+		if(j < f->n) {
+			i++;
+			continue;
+		}
+
+		printf("%s-%s left %s-%s\n",
+			d->name, d->instance, ae->name, ae->instance);
+
+		__atomic_store_n(&w->d[i], w->d[w->n - 1], __ATOMIC_RELEASE);
+		__atomic_store_n(&w->n, w->n - 1, __ATOMIC_RELEASE);
+	}
+
+	/* New ones are added at the end. */
+	for(j = 0; j < f->n; j++) {
+		for(i = 0; i < w->n && w->d[i] != f->d[j]; i++);
+
+		if(i < w->n) {
+			continue;
+		}
+
+		printf("%s-%s joined %s-%s\n", f->d[j]->name,
+			f->d[j]->instance, ae->name, ae->instance);
+
+		__atomic_store_n(&w->d[w->n], f->d[j], __ATOMIC_RELAXED);
+		__atomic_store_n(&w->n, w->n + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* Look for the instances of a wildcard destination.
+ *
+ * Returns 0 on success, a negative error number if they cannot be found.
+ */
+int nori_wild_lookup(struct dest * ae) {
+	struct nori_found f;
+
+	f.ae = ae;
+	f.n = 0;
+
+	if(rina_lookup(ae->name, ae->dif, nori_wild_found, &f)) {
+		return -1;
+	}
+
+	nori_wild_update(ae, &f);
+
+	return 0;
+}
+
+/* Add a destination to the wildcard ones, if it is. */
+void nori_wild_add(struct dest * ae, void * arg) {
+	struct dest ** w = 0;
+
+	if(strcmp(ae->instance, DEST_ANY)) {
+		return;
+	}
+
+	w = realloc(nori_wilds, sizeof(struct dest *) * (nori_wilds_nr + 1));
+	ae->members = malloc(sizeof(struct nori_wild));
+
+	if(w) {
+		nori_wilds = w;
+	}
+
+	if(!w || !ae->members) {
+		printf("Not enough memory; %s-%s not usable.\n",
+			ae->name, ae->instance);
+
+		free(ae->members);
+		ae->members = 0;
+		return;
+	}
+
+	memset(ae->members, 0, sizeof(struct nori_wild));
+	nori_wilds[nori_wilds_nr++] = ae;
+}
+
+/* Collect the wildcard destinations of the dictionary, and look for their
+ * instances a first time.
+ */
+void nori_wild_init(void) {
+	int i = 0;
+
+	dest_walk(nori_wild_add, 0);
+
+	for(i = 0; i < nori_wilds_nr; i++) {
+		if(nori_wild_lookup(nori_wilds[i])) {
+			printf("Instances of %s cannot be found; its traffic "
+				"will be dropped\n", nori_wilds[i]->name);
+
+			/* No use in trying again. */
+			nori_wilds_nr = 0;
+			break;
+		}
+	}
+
+	nori_wilds_at = nori_clock;
+}
+
+/* Look for instances joining or leaving the wildcard destinations; runs in
+ * the control thread, once per second at most.
+ */
+void nori_discover(void) {
+	unsigned long now = __atomic_load_n(&nori_clock, __ATOMIC_RELAXED);
+	int i = 0;
+
+	if(!nori_wilds_nr || nori_wilds_at == now) {
+		return;
+	}
+
+	nori_wilds_at = now;
+
+	for(i = 0; i < nori_wilds_nr; i++) {
+		nori_wild_lookup(nori_wilds[i]);
+	}
+}
+
+/* Release every known flow at once; nobody must be using them anymore. */
+void nori_teardown(void) {
+	struct known_flow * kf = 0;
+	rina_flow * ports = 0;
+	int n = 0;
+
+	pthread_mutex_lock(&nori_flows_lock);
+
+	ports = malloc(sizeof(rina_flow) * (nori_flows_nr + 1));
+
+	if(ports) {
+		list_for_each_entry(kf, &nori_known_ae, listh) {
+			/* The NORI which took over is using it. */
+			if(!kf->handed) {
+				ports[n++] = kf->id;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&nori_flows_lock);
+
+	if(!ports) {
+		return;
+	}
+
+	if(n > 0) {
+		printf("Releasing %d flows...\n", n);
+
+		if(rina_release_flows(ports, n)) {
+			printf("Some flows were not released properly.\n");
+		}
+	}
+
+	free(ports);
+}
+
+/******************************************************************************
+ * Core routines of NORI.                                                     *
+ ******************************************************************************/
+
+/* Mark traffic toward a destination. */
+static inline void nori_dest_touch(struct dest * ae) {
+	unsigned long now = __atomic_load_n(&nori_clock, __ATOMIC_RELAXED);
+
+	/* Written once per second at most, to keep the line shared. */
+	if(ae->last != now) {
+		ae->last = now;
+	}
+}
+
+/* Flow to use toward a destination: its own while it works, the one of its
+ * standby otherwise, if there.
+ *
+ * Returns the port, or a negative number if there is none.
+ */
+static inline rina_flow nori_dest_flow(struct dest * ae) {
+	rina_flow id = __atomic_load_n(&ae->port, __ATOMIC_ACQUIRE);
+	rina_flow sid = -1;
+
+	if(!ae->standby ||
+		(id >= 0 && id != __atomic_load_n(&ae->gone, __ATOMIC_RELAXED))) {
+
+		return id;
+	}
+
+	sid = __atomic_load_n(&ae->standby->port, __ATOMIC_ACQUIRE);
+
+	return sid >= 0 ? sid : id;
+}
+
+/* Sending on the flow of a destination failed; move its traffic to the
+ * standby at once, without waiting for the release to be reported.
+ *
+ * Returns 1 if the standby takes it, 0 otherwise.
+ */
+static inline int nori_dest_fail(struct dest * ae, rina_flow id) {
+	if(!ae->standby ||
+		id != __atomic_load_n(&ae->port, __ATOMIC_ACQUIRE) ||
+		__atomic_load_n(&ae->standby->port, __ATOMIC_ACQUIRE) < 0) {
+
+		return 0;
+	}
+
+	if(__atomic_exchange_n(&ae->gone, id, __ATOMIC_RELEASE) != id) {
+		__sync_fetch_and_add(&nori_failovers, 1);
+	}
+
+	return 1;
+}
+
+/* Hash of the connection a packet belongs to: addresses, protocol and, for
+ * TCP and UDP, ports.
+ */
+static inline unsigned int nori_conn_hash(char * buf, int size) {
+	unsigned char * ip = (unsigned char *)buf + TUN_INITIAL_OFFSET;
+	unsigned int h = 2166136261u;
+	int hl = 0;
+	int i = 0;
+
+	size -= TUN_INITIAL_OFFSET;
+
+	if(size < 20) {
+		return h;
+	}
+
+	for(i = IPV4_SOURCE_OFFSET; i < IPV4_DEST_OFFSET + 4; i++) {
+		h = (h ^ ip[i]) * 16777619u;
+	}
+
+	h = (h ^ ip[IPV4_PROTO_OFFSET]) * 16777619u;
+	hl = IPV4_HEADER_SIZE(ip[0]);
+
+	/* Ports are only in the first fragment. */
+	if((ip[IPV4_PROTO_OFFSET] == IPV4_PROTO_TCP ||
+		ip[IPV4_PROTO_OFFSET] == IPV4_PROTO_UDP) &&
+		!(ip[IPV4_FRAG_OFFSET] & 0x1f) && !ip[IPV4_FRAG_OFFSET + 1] &&
+		size >= hl + 4) {
+
+		for(i = hl; i < hl + 4; i++) {
+			h = (h ^ ip[i]) * 16777619u;
+		}
+	}
+
+	return h;
+}
+
+/* Instance of a wildcard destination which takes a packet. Rendezvous
+ * hashing keeps every connection on the same instance, and only moves the
+ * ones of an instance which leaves.
+ *
+ * Returns the instance, or 0 if none is known.
+ */
+struct dest * nori_wild_pick(struct dest * ae, char * buf, int size) {
+	struct nori_wild * w = (struct nori_wild *)ae->members;
+	struct dest * best = 0;
+	struct dest * d = 0;
+
+	unsigned int h = nori_conn_hash(buf, size);
+	unsigned int top = 0;
+	unsigned int s = 0;
+	int n = __atomic_load_n(&w->n, __ATOMIC_ACQUIRE);
+	int i = 0;
+
+	for(i = 0; i < n; i++) {
+		d = __atomic_load_n(&w->d[i], __ATOMIC_RELAXED);
+
+		/* Mixed, so close hashes do not pick the same one. */
+		s = h ^ d->hash;
+		s = (s ^ (s >> 16)) * 0x85ebca6bu;
+		s = (s ^ (s >> 13)) * 0xc2b2ae35u;
+		s = s ^ (s >> 16);
+
+		if(!best || s > top) {
+			best = d;
+			top = s;
+		}
+	}
+
+	return best;
+}
+
+int nori_send_to(struct dest * ae, char * buf, int size) {
+	rina_flow id = -1;
+	int ret = 0;
+
+	/* One of its instances takes it. */
+	if(ae->members) {
+		ae = nori_wild_pick(ae, buf, size);
+
+		if(!ae) {
+			__sync_fetch_and_add(&nori_wild_drops, 1);
+			return -1;
+		}
+	}
+
+	id = nori_dest_flow(ae);
+
+	nori_dest_touch(ae);
+
+	/* Not existing, so wait for it without stopping the traffic. */
+	if(id < 0) {
+		return nori_send_pending(ae, buf, size);
+	}
+
+	/*printf("Sending to %d\n", id);*/
+
+	ret = rina_write_sdu(id, buf, size);
+
+	/* This one goes through the standby too. */
+	if(ret < 0 && nori_dest_fail(ae, id)) {
+		return nori_send_to(ae, buf, size);
+	}
+
+	return ret;
+}
+
+/* IPv4 address at 'off' of the packet, in host byte order. */
+static inline uint32_t nori_ip_at(char * buf, int off) {
+	unsigned char * a = (unsigned char *)buf + TUN_INITIAL_OFFSET + off;
+
+	return ((uint32_t)a[0] << 24) | ((uint32_t)a[1] << 16) |
+		((uint32_t)a[2] << 8) | (uint32_t)a[3];
+}
+
+/* First IP rule which matches the packet, either way.
+ *
+ * Returns its position + 1, 0 if none.
+ */
+static inline uint32_t nori_match_ip(char * buf) {
+	uint32_t src = lpm_get(
+		&dict_ip[RULE_DIR_SRC], nori_ip_at(buf, IPV4_SOURCE_OFFSET));
+	uint32_t dst = lpm_get(
+		&dict_ip[RULE_DIR_DST], nori_ip_at(buf, IPV4_DEST_OFFSET));
+
+	if(!src || (dst && dst < src)) {
+		return dst;
+	}
+
+	return src;
+}
+
+/* 5-tuple of the packet: ports for TCP and UDP, type and code for ICMP. */
+static inline void nori_tuple(char * buf, int size, uint64_t key[2]) {
+	unsigned char * ip = (unsigned char *)buf + TUN_INITIAL_OFFSET;
+	int proto = ip[IPV4_PROTO_OFFSET];
+	int hl = IPV4_HEADER_SIZE(ip[0]);
+	int sp = 0;
+	int dp = 0;
+	int l4 = 0;
+
+	size -= TUN_INITIAL_OFFSET;
+
+	/* Ports are only in the first fragment. */
+	if(!(ip[IPV4_FRAG_OFFSET] & 0x1f) && !ip[IPV4_FRAG_OFFSET + 1]) {
+		if((proto == IPV4_PROTO_TCP || proto == IPV4_PROTO_UDP) &&
+			size >= hl + 4) {
+
+			sp = (ip[hl + IPV4_TDP_SOURCEP_OFFSET] << 8) |
+				ip[hl + IPV4_TDP_SOURCEP_OFFSET + 1];
+			dp = (ip[hl + IPV4_TDP_DESTP_OFFSET] << 8) |
+				ip[hl + IPV4_TDP_DESTP_OFFSET + 1];
+			l4 = 1;
+		} else if(proto == IPV4_PROTO_ICMP && size >= hl + 2) {
+			sp = ip[hl + IPV4_ICMP_TYPE];
+			dp = ip[hl + IPV4_ICMP_CODE];
+			l4 = 1;
+		}
+	}
+
+	tss_key(key,
+		nori_ip_at(buf, IPV4_SOURCE_OFFSET),
+		nori_ip_at(buf, IPV4_DEST_OFFSET),
+		proto, sp, dp);
+
+	if(l4) {
+		key[1] |= TSS_L4;
+	}
+}
+
+/* Destination of a rule which is not a default one. */
+static inline struct rule_dest * nori_rule_dest(struct dict_rule * r) {
+	switch(r->type) {
+	case RULE_IP:
+		return &((struct rule_ip *)r->data)->dest;
+	case RULE_PORT:
+		return &((struct rule_port *)r->data)->dest;
+	case RULE_MATCH:
+		return &((struct rule_match *)r->data)->dest;
+	}
+
+	return 0;
+}
+
+/* Returns the destination selected by the rule strategy, 0 if none usable. */
+struct rule_dest * nori_select_default(
+	struct nori_cls * cls, struct dict_rule * rule) {
+
+	struct rule_default * rd = (struct rule_default *)rule->data;
+	struct rule_dest * de = 0;
+	struct rule_dest * first = 0;
+
+	struct timespec now;
+
+	/* Go though the first destination only! */
+	if(rd->strategy == RULE_STR_SI) {
+		de = list_first_entry_or_null(
+			&rd->dests, struct rule_dest, listh);
+
+		if(!de) {
+			printf("No destination for default rule!\n");
+		}
+
+		/*printf("Taking default SI action...\n");*/
+
+		return de;
+	}
+
+	if(rd->strategy != RULE_STR_RR || !cls->next[rule->id]) {
+		return 0;
+	}
+
+	first = cls->next[rule->id];
+
+	/* Repeat the selection getting the next possible destination, but
+	 * give up once all of them have been checked.
+	 */
+	do {
+		de = cls->next[rule->id];
+
+		/*
+		printf("Taking default RR action fro %s-%s...\n",
+			de->ae, de->ai);
+		 */
+
+		/* Next is end of the list? */
+		if(de->listh.next == &rd->dests) {
+			/* Take again the first one. */
+			cls->next[rule->id] = list_first_entry(
+				&rd->dests, struct rule_dest, listh);
+		}
+		/* There's someone after us? */
+		else {
+			cls->next[rule->id] = list_next_entry(de, listh);
+		}
+
+		/*
+		 * Ok, 'de' has been selected and next set properly.
+		 */
+
+		if(de->open) {
+			return de;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		/* More than 1 seconds elapsed from the last time we tried to
+		 * use this.
+		 */
+		if(ts_diff_to_s(de->lrt, now) > 1) {
+			de->open = 1;
+			return de;
+		}
+	} while(cls->next[rule->id] != first);
+
+	return 0;
+}
+
+/* Error while sending... not possible to send this to him for a while. */
+void nori_dest_failed(struct rule_dest * de) {
+	clock_gettime(CLOCK_REALTIME, &de->lrt);
+	de->open = 0;
+}
+
+/* Destination given by the rule at position 'best' - 1, if any.
+ *
+ * Returns the destination and the rule, 0 to discard the packet.
+ */
+static inline struct rule_dest * nori_rule_taken(
+	struct nori_cls * cls, uint32_t best, struct dict_rule ** rule) {
+
+	/* No rule, no party. */
+	if(!best) {
+		return 0;
+	}
+
+	*rule = dict_rules_by_id[best - 1];
+
+	if((*rule)->type == RULE_DEF) {
+		return nori_select_default(cls, *rule);
+	}
+
+	return nori_rule_dest(*rule);
+}
+
+/* Position + 1 of the first rule, but the IP ones, which matches the
+ * 5-tuple of a packet, if it comes before the one 'found'; interprets the
+ * rules as nori_compiled does.
+ */
+static unsigned int nori_match_rules(uint64_t * key, unsigned int found) {
+	struct dict_rule * r = 0;
+	uint32_t best = found;
+
+	/* Only tuples which can beat the IP rule are looked at. */
+	if(dict_tuples.nr) {
+		best = tss_get(&dict_tuples, key, best);
+	}
+
+	/* Other rules win only if they come before the one found. */
+	list_for_each_entry(r, &dict_scan, scan) {
+		if(best && r->id >= best - 1) {
+			break;
+		}
+
+		switch(r->type) {
+		case RULE_DEF:
+			return r->id + 1; /* Complete stop. */
+		default:
+			printf("Unknown action %d!\n", r->type);
+			break;
+		}
+	}
+
+	return best;
+}
+
+/* Select the destination for the data depending on the rules; 'key' is
+ * the 5-tuple of the packet, if already known.
+ *
+ * Returns the destination and the rule which selected it, 0 to discard it.
+ */
+struct rule_dest * nori_match(struct nori_cls * cls,
+	char * buf, int size, uint64_t * key, struct dict_rule ** rule) {
+
+	uint32_t best = 0;
+	uint64_t k[2];
+
+	if(!key && (nori_compiled || dict_tuples.nr)) {
+		nori_tuple(buf, size, k);
+		key = k;
+	}
+
+	best = nori_match_ip(buf);
+
+	/* Compiled rules look at all the others at once. */
+	if(nori_compiled) {
+		best = nori_compiled(key, best);
+	} else {
+		best = nori_match_rules(key, best);
+	}
+
+	return nori_rule_taken(cls, best, rule);
+}
+
+/* Next of a sequence of random numbers, good enough to make up packets. */
+static inline unsigned int nori_pick_rand(unsigned int * x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+
+	return *x;
+}
+
+/* Nanoseconds taken by a matcher for all the keys, at best. */
+static unsigned long nori_pick_time(
+	dictc_match match, uint64_t (* keys)[2], unsigned int * sink) {
+
+	struct timespec a;
+	struct timespec b;
+
+	unsigned long ns = 0;
+	unsigned long min = ~0UL;
+	int i = 0;
+	int j = 0;
+
+	for(j = 0; j < NORI_PICK_ROUNDS; j++) {
+		clock_gettime(CLOCK_MONOTONIC, &a);
+
+		for(i = 0; i < NORI_PICK_KEYS; i++) {
+			*sink += match(keys[i], 0);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &b);
+
+		ns = (b.tv_sec - a.tv_sec) * 1000000000UL +
+			b.tv_nsec - a.tv_nsec;
+
+		if(ns < min) {
+			min = ns;
+		}
+	}
+
+	return min;
+}
+
+/* Keep the compiled matcher only if it gives the same rules as the
+ * interpreter, in less time. Half of the keys hit a rule of the tuple
+ * space, with random bits where it does not look; the others are random.
+ * IP rules are out, since both take them from the same tables.
+ */
+void nori_compile_pick(void) {
+	struct tss_tuple * t = 0;
+	uint64_t (* keys)[2] = 0;
+
+	unsigned long tc = 0;
+	unsigned long ti = 0;
+	unsigned int sink = 0;
+	unsigned int x = 2463534242U;
+	unsigned int e = 0;
+	int proto = 0;
+	int i = 0;
+
+	keys = malloc(sizeof(*keys) * NORI_PICK_KEYS);
+
+	if(!keys) {
+		printf("No more memory; interpreting the rules.\n");
+		nori_compiled = 0;
+		return;
+	}
+
+	for(i = 0; i < NORI_PICK_KEYS; i++) {
+		keys[i][0] = (uint64_t)nori_pick_rand(&x) << 32;
+		keys[i][0] |= nori_pick_rand(&x);
+
+		switch(nori_pick_rand(&x) % 3) {
+		case 0:
+			proto = IPV4_PROTO_ICMP;
+			break;
+		case 1:
+			proto = IPV4_PROTO_TCP;
+			break;
+		default:
+			proto = IPV4_PROTO_UDP;
+			break;
+		}
+
+		keys[i][1] = TSS_L4 | ((uint64_t)proto << 32) |
+			nori_pick_rand(&x);
+
+		if(i & 1 || !dict_tuples.nr) {
+			continue;
+		}
+
+		/* Some entry of the tuple; none is empty. */
+		t = &dict_tuples.t[(i >> 1) % dict_tuples.nr];
+		e = nori_pick_rand(&x) & t->size;
+
+		while(!t->e[e].val) {
+			e = (e + 1) & t->size;
+		}
+
+		keys[i][0] = (keys[i][0] & ~t->mask[0]) | t->e[e].key[0];
+		keys[i][1] = (keys[i][1] & ~t->mask[1]) | t->e[e].key[1];
+	}
+
+	for(i = 0; i < NORI_PICK_KEYS; i++) {
+		if(nori_compiled(keys[i], 0) != nori_match_rules(keys[i], 0)) {
+			printf("Compiled rules do not match; "
+				"interpreting them.\n");
+			nori_compiled = 0;
+			goto out;
+		}
+	}
+
+	tc = nori_pick_time(nori_compiled, keys, &sink);
+	ti = nori_pick_time(nori_match_rules, keys, &sink);
+
+	printf("Rules take %lu ns per packet compiled, %lu interpreted%s\n",
+		tc / NORI_PICK_KEYS, ti / NORI_PICK_KEYS,
+		tc < ti ? "" : "; interpreting them");
+
+	if(tc >= ti) {
+		nori_compiled = 0;
+	}
+
+out:
+	free(keys);
+}
+
+/* The two buckets where a connection can be kept. */
+static inline void nori_fc_buckets(struct nori_cls * cls, uint64_t key[2],
+	struct nori_fc_bucket ** b) {
+
+	unsigned int h = tss_hash(key);
+
+	b[0] = &cls->fc[h & cls->fc_mask];
+	b[1] = &cls->fc[((h >> 16) | (h << 16)) & cls->fc_mask];
+}
+
+/* Entry of a connection in the cache, if there and not too old. */
+static inline struct nori_fc_entry * nori_fc_get(
+	struct nori_cls * cls, uint64_t key[2], unsigned long now) {
+
+	struct nori_fc_bucket * b[2];
+	struct nori_fc_entry * e = 0;
+	int i = 0;
+	int j = 0;
+
+	nori_fc_buckets(cls, key, b);
+
+	for(j = 0; j < 2; j++) {
+		for(i = 0; i < NORI_FC_WAYS; i++) {
+			e = &b[j]->e[i];
+
+			if(e->de && e->key[0] == key[0] && e->key[1] == key[1]) {
+				if(now - e->seen > NORI_FC_AGE) {
+					return 0;
+				}
+
+				e->seen = now;
+				return e;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Keep the decision taken for a connection, in place of the same
+ * connection, an empty entry or the least recently used one of its two
+ * buckets.
+ */
+static inline void nori_fc_put(struct nori_cls * cls, uint64_t key[2],
+	struct rule_dest * de, struct dict_rule * rule, unsigned long now) {
+
+	struct nori_fc_bucket * b[2];
+	struct nori_fc_entry * e = 0;
+	struct nori_fc_entry * lru = 0;
+	int i = 0;
+	int j = 0;
+
+	nori_fc_buckets(cls, key, b);
+
+	/* The connection can already be in either bucket, even if too old:
+	 * it is never kept twice.
+	 */
+	for(j = 0; j < 2; j++) {
+		for(i = 0; i < NORI_FC_WAYS; i++) {
+			e = &b[j]->e[i];
+
+			if(e->de && e->key[0] == key[0] && e->key[1] == key[1]) {
+				goto set;
+			}
+		}
+	}
+
+	for(j = 0; j < 2; j++) {
+		for(i = 0; i < NORI_FC_WAYS; i++) {
+			e = &b[j]->e[i];
+
+			if(!e->de) {
+				goto set;
+			}
+
+			if(!lru || e->seen < lru->seen) {
+				lru = e;
+			}
+		}
+	}
+
+	e = lru;
+
+set:
+	e->key[0] = key[0];
+	e->key[1] = key[1];
+	e->de = de;
+	e->rule = rule;
+	e->seen = now;
+}
+
+/* Select the destination for the data, as nori_match does. A connection
+ * always gets the same one, unless its rule spreads the traffic: after
+ * its first packet the decision is taken from the cache.
+ */
+struct rule_dest * nori_classify(
+	struct nori_cls * cls, char * buf, int size, struct dict_rule ** rule) {
+
+	struct nori_fc_entry * e = 0;
+	struct rule_dest * de = 0;
+	struct timespec a;
+	struct timespec b;
+
+	unsigned long now = 0;
+	unsigned long ns = 0;
+	uint64_t key[2];
+	int timed = 0;
+
+	if(!cls->fc) {
+		return nori_match(cls, buf, size, 0, rule);
+	}
+
+	timed = !((cls->fc_hits + cls->fc_misses) & (NORI_FC_SAMPLE - 1));
+
+	if(timed) {
+		clock_gettime(CLOCK_MONOTONIC, &a);
+	}
+
+	now = __atomic_load_n(&nori_clock, __ATOMIC_RELAXED);
+
+	nori_tuple(buf, size, key);
+	e = nori_fc_get(cls, key, now);
+
+	if(e) {
+		*rule = e->rule;
+		de = e->de != &nori_fc_drop ? e->de : 0;
+		cls->fc_hits++;
+	} else {
+		*rule = 0;
+		de = nori_match(cls, buf, size, key, rule);
+		cls->fc_misses++;
+
+		/* No rule, and no party for the next packets either. */
+		if(!*rule) {
+			nori_fc_put(cls, key, &nori_fc_drop, 0, now);
+		}
+		/* Round-robin picks another one for every packet. */
+		else if(de && ((*rule)->type != RULE_DEF ||
+			((struct rule_default *)(*rule)->data)->strategy ==
+				RULE_STR_SI)) {
+
+			nori_fc_put(cls, key, de, *rule, now);
+		}
+	}
+
+	if(timed) {
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		ns = (b.tv_sec - a.tv_sec) * 1000000000UL +
+			b.tv_nsec - a.tv_nsec;
+
+		if(e) {
+			cls->fc_hit_ns += ns;
+			cls->fc_hit_timed++;
+		} else {
+			cls->fc_miss_ns += ns;
+			cls->fc_miss_timed++;
+		}
+	}
+
+	return de;
+}
+
+/* Analyze the data and take action depending on the rules. */
+int nori_take_action(struct nori_cls * cls, char * buf, int size) {
+	struct dict_rule * r = 0;
+	struct rule_dest * de = nori_classify(cls, buf, size, &r);
+	int ret = 0;
+
+	while(de) {
+		ret = nori_send_to(de->dest, buf, size);
+
+		if(ret > 0) {
+			de->open = 1;
+			return 0;
+		}
+
+		/* Flow is full; only this packet is lost. */
+		if(ret == 0) {
+			return 0;
+		}
+
+		nori_dest_failed(de);
+
+		/* Only round-robin has someone else to try with. */
+		if(r->type != RULE_DEF ||
+			((struct rule_default *)r->data)->strategy !=
+				RULE_STR_RR) {
+
+			return -1;
+		}
+
+		de = nori_select_default(cls, r);
+	}
+
+	return 0;
+}
+
+/* Send packets toward the same destination, in one go if it has a flow. */
+void nori_send_iov(struct rule_dest * de, struct iovec * iov, int n) {
+	rina_flow id = nori_dest_flow(de->dest);
+
+	int i = 0;
+	int ret = 0;
+
+	for(i = 0; i < n && (id < 0 || n == 1); i++) {
+		ret = nori_send_to(de->dest, iov[i].iov_base, iov[i].iov_len);
+
+		/* A full flow only loses this packet. */
+		if(ret > 0) {
+			de->open = 1;
+		} else if(ret < 0) {
+			nori_dest_failed(de);
+		}
+	}
+
+	/* Sent one by one, or held until the flow is there. */
+	if(i > 0) {
+		return;
+	}
+
+	nori_dest_touch(de->dest);
+
+	ret = rina_write_sdus(id, -1, iov, n);
+
+	/* The burst goes through the standby too. */
+	if(ret < 0 && nori_dest_fail(de->dest, id)) {
+		nori_send_iov(de, iov, n);
+		return;
+	}
+
+	/* A full flow only loses what did not fit. */
+	if(ret > 0) {
+		de->open = 1;
+	} else if(ret < 0) {
+		nori_dest_failed(de);
+	}
+}
+
+/* Check if the traffic can skip the classification. */
+void nori_direct_init(void) {
+	struct dict_rule * r = 0;
+	struct rule_default * rd = 0;
+
+	if(dict_rules_nr != 1) {
+		return;
+	}
+
+	r = list_first_entry(&dict_rules, struct dict_rule, listh);
+
+	if(r->type != RULE_DEF) {
+		return;
+	}
+
+	rd = (struct rule_default *)r->data;
+
+	if(rd->strategy == RULE_STR_SI) {
+		nori_direct = list_first_entry_or_null(
+			&rd->dests, struct rule_dest, listh);
+	}
+}
+
+/* Prepare a classification state starting from the dictionary one.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_cls_init(struct nori_cls * cls) {
+	struct dict_rule * r = 0;
+
+	unsigned int n = 1;
+
+	memset(cls, 0, sizeof(struct nori_cls));
+
+	cls->next = malloc(sizeof(struct rule_dest *) * (dict_rules_nr + 1));
+
+	if(!cls->next) {
+		return -1;
+	}
+
+	/* Worth it only if there is something to look up. */
+	if(nori_fc_size &&
+		(dict_ip[0].tbl24 || dict_ip[1].tbl24 || dict_tuples.nr)) {
+
+		while(n * NORI_FC_WAYS < nori_fc_size) {
+			n *= 2;
+		}
+
+		cls->fc = calloc(n, sizeof(struct nori_fc_bucket));
+
+		if(!cls->fc) {
+			free(cls->next);
+			cls->next = 0;
+			return -1;
+		}
+
+		cls->fc_mask = n - 1;
+	}
+
+	list_for_each_entry(r, &dict_rules, listh) {
+		cls->next[r->id] = 0;
+
+		if(r->type == RULE_DEF) {
+			cls->next[r->id] = ((struct rule_default *)r->data)->next;
+		}
+	}
+
+	return 0;
+}
+
+/* Move what is waiting on a flow to the interface. */
+void nori_drain_flow(struct nori_worker * w, struct known_flow * kf) {
+	int i = 0;
+	int n = 0;
+	unsigned long now = __atomic_load_n(&nori_clock, __ATOMIC_RELAXED);
+
+	if(kf->id <= 0) {
+		return;
+	}
+
+	for(i = 0; i < NORI_BURST; i++) {
+		w->iov[i].iov_base = w->sdus[i];
+		w->iov[i].iov_len = sizeof(w->sdus[i]);
+	}
+
+	/* Flows are non-blocking: a whole burst in one go, if there. */
+	n = rina_read_sdus(kf->id, kf->fd, w->iov, NORI_BURST);
+
+	/* Move them on the interface. */
+	for(i = 0; i < n; i++) {
+		tun_write(w->tun, w->iov[i].iov_base, w->iov[i].iov_len);
+	}
+
+	if(n > 0 && kf->last != now) {
+		kf->last = now;
+	}
+}
+
+/* Move a burst from the interface to the only destination, as it is. */
+void nori_forward_tun(struct nori_worker * w) {
+	int n = 0;
+	int bytes = 0;
+
+	for(n = 0; n < NORI_BURST; n++) {
+		bytes = tun_read(w->tun, w->sdus[n], sizeof(w->sdus[n]));
+
+		if(bytes <= 0) {
+			break;
+		}
+
+		w->iov[n].iov_base = w->sdus[n];
+		w->iov[n].iov_len = bytes;
+	}
+
+	if(n > 0) {
+		nori_send_iov(nori_direct, w->iov, n);
+	}
+}
+
+/* Move what is waiting on the interface to the flows. */
+void nori_drain_tun(struct nori_worker * w, char * buf, int size) {
+	int i = 0;
+	int bytes = 0;
+
+	/* Nothing to choose: the whole burst goes at once. */
+	if(nori_direct) {
+		nori_forward_tun(w);
+		return;
+	}
+
+	for(i = 0; i < NORI_BURST; i++) {
+		bytes = tun_read(w->tun, buf, size);
+
+		if(bytes <= 0) {
+			break;
+		}
+
+		/* Everything which comes from the interface will be dumped to
+		 * the flow, if it already exists.
+		 */
+		nori_take_action(&w->cls, buf, bytes);
+	}
+}
+
+/* Sweep the flows which cannot be waited on. */
+void nori_sweep_unpolled(struct nori_worker * w) {
+	struct known_flow * kf = 0;
+
+	kf = __atomic_load_n(&nori_unpolled_flows, __ATOMIC_ACQUIRE);
+
+	for(; kf; kf = __atomic_load_n(&kf->unext, __ATOMIC_ACQUIRE)) {
+		nori_drain_flow(w, kf);
+	}
+}
+
+/* Prepare a worker which writes on 'tun' and possibly reads from it.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_worker_init(struct nori_worker * w, int tun, int poll_tun) {
+	struct epoll_event ev = {0};
+
+	w->epfd = -1;
+	w->tun = tun;
+	w->poll_tun = poll_tun;
+	w->kick = -1;
+
+	if(nori_cls_init(&w->cls)) {
+		printf("Not enough memory for the worker.\n");
+		return -1;
+	}
+
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if(w->epfd < 0) {
+		printf("Cannot create the epoll set.\n");
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NORI_POLL_STOP;
+
+	if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, nori_stopfd, &ev)) {
+		printf("Cannot poll the stop descriptor.\n");
+		return -1;
+	}
+
+	w->kick = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NORI_POLL_KICK;
+
+	if(w->kick < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->kick, &ev)) {
+		printf("Cannot poll the kick descriptor.\n");
+		return -1;
+	}
+
+	if(poll_tun) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = NORI_POLL_TUN;
+
+		if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, tun, &ev)) {
+			printf("Cannot poll the TUN/TAP device.\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Release the resources of a worker. */
+void nori_worker_release(struct nori_worker * w) {
+	/* Never initialized. */
+	if(!w->cls.next) {
+		return;
+	}
+
+	if(w->kick >= 0) {
+		close(w->kick);
+		w->kick = -1;
+	}
+
+	if(w->epfd >= 0) {
+		close(w->epfd);
+		w->epfd = -1;
+	}
+
+	free(w->cls.next);
+	w->cls.next = 0;
+	free(w->cls.fc);
+	w->cls.fc = 0;
+}
+
+/* Serve the worker descriptors until the end. */
+int nori_serve(struct nori_worker * w) {
+	struct epoll_event evs[NORI_MAX_EVENTS];
+	eventfd_t cnt = 0;
+
+	int timeout = -1;
+	int nev = 0;
+	int i = 0;
+
+	nori_self = w;
+	ep_register(&w->ep);
+
+	/* While TRUE! */
+	while(!nori_ctrlc) {
+		/* Sleep until something happens, unless we have to sweep. */
+		if(w == &nori_main && nori_unpolled > 0) {
+			timeout = NORI_POLL_FALLBACK;
+		} else {
+			timeout = -1;
+		}
+
+		nev = epoll_wait(w->epfd, evs, NORI_MAX_EVENTS, timeout);
+
+		for(i = 0; i < nev; i++) {
+			if(evs[i].data.ptr == NORI_POLL_STOP) {
+				continue;
+			} else if(evs[i].data.ptr == NORI_POLL_KICK) {
+				eventfd_read(w->kick, &cnt);
+			} else if(evs[i].data.ptr == NORI_POLL_TUN) {
+				nori_drain_tun(w, w->buf, 4096);
+			} else {
+				nori_drain_flow(
+					w, (struct known_flow *)evs[i].data.ptr);
+			}
+		}
+
+		/* Only the main thread sweeps what cannot be polled. */
+		if(w == &nori_main && nori_unpolled > 0) {
+			nori_sweep_unpolled(w);
+		}
+
+		/* No flow is referenced here until the next batch. */
+		ep_quiescent(&w->ep);
+	}
+
+	ep_unregister(&w->ep);
+
+	return 0;
+}
+
+/* Main loop for NORI. */
+int nori_loop(void) {
+	return nori_serve(&nori_main);
+}
+
+/******************************************************************************
+ * Handoff to a new NORI.                                                     *
+ ******************************************************************************/
+
+/*
+ * A NORI started with the handoff path of a running one takes its place
+ * without tearing anything down. The running one sends the descriptors of
+ * the device queues and of the flows which can leave the process, and names
+ * the remote AEs of the ones which cannot; since the descriptors are shared,
+ * both move the traffic until the new one is ready. Then the old NORI
+ * leaves, releasing only the flows it kept and its registrations, and the
+ * new one registers the AE in its place.
+ */
+
+int nori_register(void);
+
+/* Wait for a NORI which will take over, if a handoff path is given. */
+void nori_handoff_start(void) {
+	if(!nori_handoff_path) {
+		return;
+	}
+
+	nori_handoff_fd = handoff_listen(nori_handoff_path);
+
+	if(nori_handoff_fd < 0) {
+		printf("Cannot wait for handoffs at %s\n", nori_handoff_path);
+	}
+}
+
+/* Send the device and the flows to the NORI taking over.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_handoff_send(int c) {
+	struct nori_ho_msg m;
+	struct nori_ho_flow * fl = 0;
+	struct known_flow * kf = 0;
+
+	int ret = 0;
+	int moved = 0;
+	int n = 0;
+	int i = 0;
+
+	memset(&m, 0, sizeof(struct nori_ho_msg));
+
+	m.type = NORI_HO_DEV;
+	m.n = nori_queues;
+	snprintf(m.name, sizeof(m.name), "%s", nori_dev_name);
+
+	if(handoff_send(c, &m, sizeof(m), 0, 0)) {
+		return -1;
+	}
+
+	m.type = NORI_HO_QUEUE;
+
+	for(i = 0; i < nori_queues; i++) {
+		if(handoff_send(c, &m, sizeof(m), &nori_dev_fds[i], 1)) {
+			return -1;
+		}
+	}
+
+	/* Exported descriptors are copies: they stay valid once out of the
+	 * lock, even if the flow is evicted meanwhile.
+	 */
+	pthread_mutex_lock(&nori_flows_lock);
+
+	fl = malloc(sizeof(struct nori_ho_flow) * (nori_flows_nr + 1));
+
+	if(fl) {
+		list_for_each_entry(kf, &nori_known_ae, listh) {
+			fl[n].ae = kf->ae;
+			fl[n].fd = rina_export_flow(kf->id);
+			kf->handed = fl[n].fd >= 0;
+			n++;
+		}
+	}
+
+	pthread_mutex_unlock(&nori_flows_lock);
+
+	if(!fl) {
+		return -1;
+	}
+
+	m.type = NORI_HO_FLOW;
+
+	for(i = 0; i < n && !ret; i++) {
+		snprintf(m.name, sizeof(m.name), "%s", fl[i].ae->name);
+		snprintf(m.instance, sizeof(m.instance), "%s",
+			fl[i].ae->instance);
+		snprintf(m.dif, sizeof(m.dif), "%s", fl[i].ae->dif);
+
+		if(fl[i].fd >= 0) {
+			ret = handoff_send(c, &m, sizeof(m), &fl[i].fd, 1);
+			moved++;
+		} else {
+			ret = handoff_send(c, &m, sizeof(m), 0, 0);
+		}
+	}
+
+	for(i = 0; i < n; i++) {
+		if(fl[i].fd >= 0) {
+			close(fl[i].fd);
+		}
+	}
+
+	free(fl);
+
+	if(ret) {
+		return -1;
+	}
+
+	memset(&m, 0, sizeof(struct nori_ho_msg));
+	m.type = NORI_HO_END;
+
+	if(handoff_send(c, &m, sizeof(m), 0, 0)) {
+		return -1;
+	}
+
+	printf("%d flows handed, %d of them to be allocated again\n",
+		n, n - moved);
+
+	return 0;
+}
+
+/* Serve a NORI which wants to take over, in its own thread: a slow peer
+ * does not hold back the flow events. Once it is ready, this NORI stops and
+ * leaves.
+ */
+void * nori_handoff_serve(void * args) {
+	struct known_flow * kf = 0;
+	struct nori_ho_msg m;
+
+	int fds[HANDOFF_FDS];
+	int nfds = 0;
+	int c = (int)(long)args;
+	int i = 0;
+
+	printf("A new NORI is taking over...\n");
+
+	if(nori_handoff_send(c) ||
+		handoff_recv(c, &m, sizeof(m), fds, &nfds) != sizeof(m) ||
+		m.type != NORI_HO_DONE) {
+
+		printf("Handoff failed, still serving the traffic\n");
+
+		/* Nothing has been handed then. */
+		pthread_mutex_lock(&nori_flows_lock);
+
+		list_for_each_entry(kf, &nori_known_ae, listh) {
+			kf->handed = 0;
+		}
+
+		pthread_mutex_unlock(&nori_flows_lock);
+
+		for(i = 0; i < nfds; i++) {
+			close(fds[i]);
+		}
+
+		close(c);
+		__atomic_store_n(&nori_handing, 0, __ATOMIC_RELEASE);
+
+		return 0;
+	}
+
+	printf("Traffic handed over, leaving...\n");
+
+	/* It registers once we are gone, and sees it when this closes. */
+	nori_heir_fd = c;
+	nori_stop();
+
+	return 0;
+}
+
+/* Accept a NORI which wants to take over, and serve it; runs in the
+ * control thread. One at a time: the others are refused.
+ */
+void nori_handoff_accept(void) {
+	int c = handoff_accept(nori_handoff_fd, NORI_HANDOFF_WAIT);
+
+	if(c < 0) {
+		return;
+	}
+
+	if(__atomic_load_n(&nori_handing, __ATOMIC_ACQUIRE)) {
+		printf("Another NORI is already taking over\n");
+		close(c);
+		return;
+	}
+
+	/* The previous one is over. */
+	if(nori_handoff_started) {
+		pthread_join(nori_handoff_thread, 0);
+		nori_handoff_started = 0;
+	}
+
+	nori_handing = 1;
+
+	if(pthread_create(&nori_handoff_thread, NULL,
+		nori_handoff_serve, (void *)(long)c)) {
+
+		printf("Cannot serve the NORI taking over\n");
+		nori_handing = 0;
+		close(c);
+		return;
+	}
+
+	nori_handoff_started = 1;
+}
+
+/* Take the place of the NORI waiting at the handoff path, if any: its
+ * device and flows are received, and used once everything is ready.
+ *
+ * Returns 1 if taking over, 0 if nobody is there, a negative error number
+ * on error.
+ */
+int nori_takeover(void) {
+	struct nori_ho_flow * fl = 0;
+	struct nori_ho_msg m;
+
+	char name[sizeof(nori_dev_name)];
+	int queues = nori_queues;
+
+	int fds[HANDOFF_FDS];
+	int nfds = 0;
+	int q = 0;
+	int i = 0;
+	int c = handoff_connect(nori_handoff_path, NORI_HANDOFF_WAIT);
+
+	if(c < 0) {
+		return 0;
+	}
+
+	/* Given back if the handoff fails. */
+	memcpy(name, nori_dev_name, sizeof(name));
+
+	for(;;) {
+		if(handoff_recv(c, &m, sizeof(m), fds, &nfds) != sizeof(m)) {
+			goto err;
+		}
+
+		m.name[sizeof(m.name) - 1] = 0;
+		m.instance[sizeof(m.instance) - 1] = 0;
+		m.dif[sizeof(m.dif) - 1] = 0;
+
+		if(m.type == NORI_HO_END) {
+			break;
+		}
+
+		if(m.type == NORI_HO_DEV) {
+			/* Not a name the kernel gives to a device. */
+			if(m.n < 1 || m.n > TUNW_MAX_QUEUES ||
+				strlen(m.name) >= sizeof(nori_dev_name)) {
+				goto err;
+			}
+
+			nori_queues = m.n;
+			memcpy(nori_dev_name, m.name, strlen(m.name) + 1);
+		}
+
+		if(m.type == NORI_HO_QUEUE && nfds > 0 && q < nori_queues) {
+			nori_dev_fds[q++] = fds[0];
+			fds[0] = -1;
+		}
+
+		if(m.type == NORI_HO_FLOW) {
+			fl = realloc(nori_ho_flows, sizeof(struct nori_ho_flow)
+				* (nori_ho_flows_nr + 1));
+
+			if(!fl) {
+				goto err;
+			}
+
+			nori_ho_flows = fl;
+			fl = &nori_ho_flows[nori_ho_flows_nr];
+
+			fl->ae = dest_intern(m.name, m.instance, m.dif);
+			fl->fd = nfds > 0 ? fds[0] : -1;
+			fds[0] = -1;
+
+			if(!fl->ae) {
+				close(fl->fd);
+				goto err;
+			}
+
+			nori_ho_flows_nr++;
+		}
+
+		/* Whatever came unexpected. */
+		for(i = 0; i < nfds; i++) {
+			if(fds[i] >= 0) {
+				close(fds[i]);
+			}
+		}
+
+		nfds = 0;
+	}
+
+	if(q != nori_queues) {
+		goto err;
+	}
+
+	nori_takeover_fd = c;
+
+	printf("Taking over %s, with %d queues and %d flows\n",
+		nori_dev_name, nori_queues, nori_ho_flows_nr);
+
+	return 1;
+
+err:
+	printf("Cannot take over the NORI at %s\n", nori_handoff_path);
+
+	for(i = 0; i < nfds; i++) {
+		if(fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+
+	for(i = 0; i < q; i++) {
+		close(nori_dev_fds[i]);
+		nori_dev_fds[i] = -1;
+	}
+
+	for(i = 0; i < nori_ho_flows_nr; i++) {
+		if(nori_ho_flows[i].fd >= 0) {
+			close(nori_ho_flows[i].fd);
+		}
+	}
+
+	free(nori_ho_flows);
+	nori_ho_flows = 0;
+	nori_ho_flows_nr = 0;
+
+	nori_queues = queues;
+	memcpy(nori_dev_name, name, sizeof(name));
+
+	close(c);
+
+	return -1;
+}
+
+/* Use the flows received from the NORI being replaced: the ones which
+ * moved as they are, while the others are allocated again.
+ */
+void nori_takeover_flows(void) {
+	struct known_flow * kf = 0;
+	struct nori_ho_flow * fl = 0;
+
+	rina_flow port = -1;
+	int started = 0;
+	int err = 0;
+	int i = 0;
+
+	for(i = 0; i < nori_ho_flows_nr; i++) {
+		fl = &nori_ho_flows[i];
+		port = fl->fd >= 0 ? rina_import_flow(fl->fd) : -1;
+
+		if(port < 0) {
+			if(fl->fd >= 0) {
+				close(fl->fd);
+			}
+
+			nori_prewarm_dest(fl->ae, &started);
+			continue;
+		}
+
+		kf = slab_alloc(&nori_flow_slab);
+
+		if(!kf) {
+			rina_release_flow(port);
+			continue;
+		}
+
+		memset(kf, 0, sizeof(struct known_flow));
+		INIT_LIST_HEAD(&kf->listh);
+
+		kf->id = port;
+		kf->ae = fl->ae;
+
+		/* Allocated again if its traffic cannot be read. */
+		if(nori_poll_flow(kf, nori_flow_owner())) {
+			rina_release_flow(port);
+			slab_free(&nori_flow_slab, kf);
+			nori_prewarm_dest(fl->ae, &started);
+			continue;
+		}
+
+		pthread_mutex_lock(&nori_flows_lock);
+		err = nori_flow_add(kf);
+		pthread_mutex_unlock(&nori_flows_lock);
+
+		if(err) {
+			nori_unpoll_flow(kf);
+			rina_release_flow(port);
+			nori_flow_retire(kf);
+		}
+	}
+
+	if(nori_ho_flows_nr) {
+		printf("%d flows taken over, %d of them being allocated\n",
+			nori_ho_flows_nr, started);
+	}
+
+	/* Someone could have been evicted to make room. */
+	nori_flows_trim();
+
+	free(nori_ho_flows);
+	nori_ho_flows = 0;
+	nori_ho_flows_nr = 0;
+}
+
+/* Let the NORI being replaced know that the traffic is served here. */
+void nori_takeover_done(void) {
+	struct nori_ho_msg m;
+
+	memset(&m, 0, sizeof(struct nori_ho_msg));
+	m.type = NORI_HO_DONE;
+
+	if(handoff_send(nori_takeover_fd, &m, sizeof(m), 0, 0)) {
+		printf("Cannot tell the old NORI to leave\n");
+	}
+}
+
+/* The NORI we replaced has gone, or is about to; its registrations are
+ * released, so ours can take place. Runs in the control thread.
+ */
+void nori_takeover_end(void) {
+	struct nori_ho_msg m;
+
+	int fds[HANDOFF_FDS];
+	int nfds = 0;
+	int i = 0;
+
+	/* Nothing more is expected; just wait for it to close. */
+	if(handoff_recv(nori_takeover_fd, &m, sizeof(m), fds, &nfds) > 0) {
+		for(i = 0; i < nfds; i++) {
+			close(fds[i]);
+		}
+
+		return;
+	}
+
+	close(nori_takeover_fd);
+	nori_takeover_fd = -1;
+
+	printf("Old NORI has left\n");
+
+	if(nori_register()) {
+		nori_stop();
+		return;
+	}
+
+	/* Next one can take our place now. */
+	nori_handoff_start();
+}
+
+/******************************************************************************
+ * Control plane.                                                             *
+ ******************************************************************************/
+
+/*
+ * RINA events are served by a thread of their own, so the dataplane never
+ * waits for them. Flows accepted from remote peers are handed to a worker,
+ * which picks them up from its epoll set; released ones are retired and
+ * freed here once every worker finished the batch it was serving.
+ */
+
+/* Add the cache counters of a classification state to the ones of 'sum'. */
+void nori_fc_sum(struct nori_cls * sum, struct nori_cls * cls) {
+	sum->fc_hits += __atomic_load_n(&cls->fc_hits, __ATOMIC_RELAXED);
+	sum->fc_misses += __atomic_load_n(&cls->fc_misses, __ATOMIC_RELAXED);
+	sum->fc_hit_ns += __atomic_load_n(&cls->fc_hit_ns, __ATOMIC_RELAXED);
+	sum->fc_hit_timed +=
+		__atomic_load_n(&cls->fc_hit_timed, __ATOMIC_RELAXED);
+	sum->fc_miss_ns += __atomic_load_n(&cls->fc_miss_ns, __ATOMIC_RELAXED);
+	sum->fc_miss_timed +=
+		__atomic_load_n(&cls->fc_miss_timed, __ATOMIC_RELAXED);
+}
+
+/* Print the counters of the classification cache, if used. */
+void nori_fc_stats(void) {
+	struct nori_cls sum = {0};
+	int i = 0;
+
+	nori_fc_sum(&sum, &nori_main.cls);
+	nori_fc_sum(&sum, &nori_classifier.cls);
+
+	for(i = 0; nori_workers && i < nori_queues; i++) {
+		nori_fc_sum(&sum, &nori_workers[i].cls);
+	}
+
+	if(!sum.fc_hits && !sum.fc_misses) {
+		return;
+	}
+
+	printf("Classification cache: %lu hits, %lu misses (%.1f%% hits)\n",
+		sum.fc_hits, sum.fc_misses,
+		100.0 * sum.fc_hits / (sum.fc_hits + sum.fc_misses));
+	printf("Classification time: %lu ns on a hit, %lu ns on a miss\n",
+		sum.fc_hit_timed ? sum.fc_hit_ns / sum.fc_hit_timed : 0,
+		sum.fc_miss_timed ? sum.fc_miss_ns / sum.fc_miss_timed : 0);
+}
+
+/* Print the counters of NORI. */
+void nori_stats(void) {
+	pthread_mutex_lock(&nori_flows_lock);
+
+	printf("Flows: %u known", nori_flows_nr);
+
+	if(nori_max_flows) {
+		printf(" out of %u", nori_max_flows);
+	}
+
+	printf(", %lu evicted, %lu released idle\n",
+		nori_evictions, nori_reaped);
+	printf("Packets dropped waiting for a flow: %lu\n",
+		nori_pending_drops);
+
+	if(nori_kept_nr) {
+		printf("Failovers to a standby: %lu\n", nori_failovers);
+	}
+
+	if(nori_wilds) {
+		printf("Packets dropped without instances: %lu\n",
+			nori_wild_drops);
+	}
+
+	nori_fc_stats();
+
+	pthread_mutex_unlock(&nori_flows_lock);
+}
+
+/* Release the flows which stayed idle for too long; runs in the control
+ * thread. Only the flows whose timer fires are looked at.
+ */
+void nori_reap(void) {
 	struct known_flow * kf  = 0;
 	struct known_flow * tmp = 0;
+	struct list_head * slot = 0;
+
+	unsigned long now = nori_time();
+	unsigned long last = 0;
+	unsigned int idle = 0;
+
+	LIST_HEAD(dead);
+
+	__atomic_store_n(&nori_clock, now, __ATOMIC_RELAXED);
+
+	if(!nori_reaping || nori_wheel_now >= now) {
+		return;
+	}
+
+	pthread_mutex_lock(&nori_flows_lock);
+
+	/* A full turn already visits every slot. */
+	if(now - nori_wheel_now > NORI_WHEEL_SLOTS) {
+		nori_wheel_now = now - NORI_WHEEL_SLOTS;
+	}
+
+	while(nori_wheel_now < now) {
+		nori_wheel_now++;
+		slot = &nori_wheel[nori_wheel_now % NORI_WHEEL_SLOTS];
+
+		list_for_each_entry_safe(kf, tmp, slot, timer) {
+			/* Fires in a later turn. */
+			if(kf->expire > nori_wheel_now) {
+				continue;
+			}
+
+			list_del_init(&kf->timer);
+
+			idle = nori_flow_idle(kf);
+			last = kf->last > kf->ae->last ? kf->last : kf->ae->last;
+
+			/* Had traffic meanwhile; check again later. */
+			if(last + idle > nori_wheel_now) {
+				nori_timer_add(kf, last + idle);
+				continue;
+			}
+
+			nori_flow_del(kf);
+			nori_unpoll_flow(kf);
+
+			list_add(&kf->timer, &dead);
+		}
+	}
+
+	pthread_mutex_unlock(&nori_flows_lock);
+
+	list_for_each_entry_safe(kf, tmp, &dead, timer) {
+		list_del(&kf->timer);
+
+		printf("%s-%s idle, releasing flow %d\n",
+			kf->ae->name, kf->ae->instance, kf->id);
+
+		rina_release_flow(kf->id);
+		nori_reaped++;
+
+		/* Workers could be still reading it. */
+		nori_flow_retire(kf);
+	}
+}
+
+/* Prepare the timer wheel. */
+void nori_wheel_init(void) {
+	struct dict_rule * r = 0;
+	int i = 0;
+
+	for(i = 0; i < NORI_WHEEL_SLOTS; i++) {
+		INIT_LIST_HEAD(&nori_wheel[i]);
+	}
+
+	nori_clock = nori_time();
+	nori_wheel_now = nori_clock;
+
+	/* Turn it only if some flow can expire. */
+	nori_reaping = nori_idle > 0;
+
+	list_for_each_entry(r, &dict_rules, listh) {
+		if(r->idle > 0) {
+			nori_reaping = 1;
+		}
+	}
+}
+
+void * nori_ctrl_loop(void * args) {
+	struct pollfd fds[4];
+	eventfd_t cnt = 0;
+
+	int nev = 0;
+	int waiting = 0;
+	int timeout = -1;
+
+	fds[0].fd = nori_stopfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = nori_statsfd;
+	fds[1].events = POLLIN;
+	fds[2].fd = rina_event_fd();
+	fds[2].events = POLLIN;
+	fds[3].events = POLLIN;
+
+	/* Flows kept for failover are there from the start. */
+	nori_keep();
+
+	while(!nori_ctrlc) {
+		/* The NORI we replace leaving, or one replacing us. */
+		fds[3].fd = nori_takeover_fd >= 0 ?
+			nori_takeover_fd : nori_handoff_fd;
+
+		/* Come back soon if released flows are waiting. Without a
+		 * descriptor, check for events once in a while. The clock
+		 * has to move for whoever reads it.
+		 */
+		if(waiting) {
+			timeout = NORI_CTRL_TICK;
+		} else if(fds[2].fd < 0) {
+			timeout = NORI_CTRL_FALLBACK;
+		} else if(nori_reaping || nori_kept_nr || nori_wilds_nr ||
+			nori_fc_size || nori_max_flows) {
+			timeout = NORI_WHEEL_TICK;
+		} else {
+			timeout = -1;
+		}
+
+		fds[1].revents = 0;
+		fds[2].revents = 0;
+		fds[3].revents = 0;
+
+		/* Negative descriptors are skipped. */
+		nev = poll(fds, 4, timeout);
+
+		/* Process what is pending, but do not wait for it! */
+		if(fds[2].fd < 0 || (nev > 0 && fds[2].revents)) {
+			rina_listen_for_events(
+				flow_allocated, flow_deallocated, flow_ready, 1);
+		}
+
+		if(nev > 0 && fds[1].revents) {
+			eventfd_read(nori_statsfd, &cnt);
+			nori_stats();
+		}
+
+		if(nev > 0 && fds[3].revents) {
+			if(fds[3].fd == nori_takeover_fd) {
+				nori_takeover_end();
+			} else {
+				nori_handoff_accept();
+			}
+		}
+
+		/* Let the flows idle for too long go. */
+		nori_reap();
+		/* And bring back the kept ones which went down. */
+		nori_keep();
+		/* Follow the instances coming and going. */
+		nori_discover();
+
+		/* Free the flows every worker let go. */
+		waiting = ep_reclaim();
+	}
+
+	/* A handoff in progress ends within its timeouts. */
+	if(nori_handoff_started) {
+		pthread_join(nori_handoff_thread, 0);
+	}
+
+	return 0;
+}
+
+/* Start serving the RINA events.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_ctrl_start(void) {
+	rina_flow_admission(nori_accept_rate, nori_accept_rate);
+
+	if(pthread_create(&nori_ctrl, NULL, nori_ctrl_loop, 0)) {
+		printf("Cannot start the control thread.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Wait for the control thread to finish. */
+void nori_ctrl_stop(void) {
+	/* Main loop could also have been left on error. */
+	nori_stop();
+
+	if(nori_ctrl) {
+		pthread_join(nori_ctrl, 0);
+		nori_ctrl = 0;
+	}
+}
+
+/******************************************************************************
+ * Multi-queue dataplane.                                                     *
+ ******************************************************************************/
+
+/*
+ * With more queues every one of them is served by its own worker, which owns
+ * its epoll set, buffers and classification state. The kernel keeps each
+ * connection on the same queue, and the flows allocated by a worker are
+ * polled by that worker only. The main thread is left with the flows which
+ * cannot be polled.
+ */
+
+void * nori_worker_loop(void * args) {
+	nori_serve((struct nori_worker *)args);
+	return 0;
+}
+
+/* Prepare one worker per queue and start them.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_workers_start(int * fds) {
+	int i = 0;
+
+	nori_workers = malloc(sizeof(struct nori_worker) * nori_queues);
+
+	if(!nori_workers) {
+		printf("Not enough memory for the workers.\n");
+		return -1;
+	}
+
+	memset(nori_workers, 0, sizeof(struct nori_worker) * nori_queues);
+
+	for(i = 0; i < nori_queues; i++) {
+		if(nori_worker_init(&nori_workers[i], fds[i], 1)) {
+			return -1;
+		}
+	}
+
+	for(i = 0; i < nori_queues; i++) {
+		if(pthread_create(&nori_workers[i].t, NULL,
+			nori_worker_loop, &nori_workers[i])) {
+
+			printf("Cannot start worker %d.\n", i);
+			return -1;
+		}
+	}
+
+	printf("%d workers started, one per queue\n", nori_queues);
+
+	return 0;
+}
+
+/* Wait for the workers to finish and release their resources. */
+void nori_workers_stop(void) {
+	int i = 0;
+
+	/* Main loop could also have been left on error. */
+	nori_stop();
+
+	for(i = 0; i < nori_queues && nori_workers; i++) {
+		if(nori_workers[i].t) {
+			pthread_join(nori_workers[i].t, 0);
+		}
+
+		nori_worker_release(&nori_workers[i]);
+	}
+
+	free(nori_workers);
+	nori_workers = 0;
+}
+
+/******************************************************************************
+ * Pipelined dataplane.                                                       *
+ ******************************************************************************/
+
+/*
+ * In pipelined mode the main loop only moves traffic from the flows to the
+ * interface. A classifier thread reads the interface and hands the packets
+ * to one of the sender threads through single-producer/single-consumer
+ * rings, so one direction cannot stall the other one.
+ *
+ * Each sender has a ring of classified packets and a ring where it gives
+ * back the empty ones; the classifier is the only consumer of the latter, so
+ * it can take a buffer from any of them.
+ */
+
+/* Wake up a sender, if it is sleeping. */
+void nori_sender_kick(struct nori_sender * s) {
+	eventfd_t one = 1;
+
+	/* Pairs with the check done by the sender before sleeping. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&s->sleeping, __ATOMIC_RELAXED)) {
+		eventfd_write(s->wfd, one);
+	}
+}
+
+/* Sleep until something is pushed in the sender ring. */
+void nori_sender_wait(struct nori_sender * s) {
+	struct pollfd p[2] = {{0}};
+	eventfd_t cnt = 0;
+
+	p[0].fd = s->wfd;
+	p[0].events = POLLIN;
+	p[1].fd = nori_stopfd;
+	p[1].events = POLLIN;
+
+	__atomic_store_n(&s->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* Something arrived meanwhile? Flows can go while sleeping. */
+	if(ring_empty(&s->tx)) {
+		ep_offline(&s->ep);
+
+		if(poll(p, 2, -1) > 0 && p[0].revents) {
+			eventfd_read(s->wfd, &cnt);
+		}
+
+		ep_online(&s->ep);
+	}
+
+	__atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/* Sender stage: ring --> RINA. */
+/* Send packets toward the same destination, in one go if it has a flow. */
+void nori_send_burst(struct nori_pkt ** pkts, int n) {
+	struct iovec iov[NORI_BURST];
+	int i = 0;
+
+	for(i = 0; i < n; i++) {
+		iov[i].iov_base = pkts[i]->data;
+		iov[i].iov_len = pkts[i]->size;
+	}
+
+	nori_send_iov(pkts[0]->dest, iov, n);
+}
+
+void * nori_sender_loop(void * args) {
+	struct nori_sender * s = (struct nori_sender *)args;
+	struct nori_pkt * pkts[NORI_BURST];
+
+	int n = 0;
+	int i = 0;
+	int j = 0;
+
+	ep_register(&s->ep);
+
+	while(!nori_ctrlc) {
+		for(n = 0; n < NORI_BURST; n++) {
+			pkts[n] = ring_pop(&s->tx);
+
+			if(!pkts[n]) {
+				break;
+			}
+		}
+
+		if(!n) {
+			nori_sender_wait(s);
+			continue;
+		}
+
+		/* Packets in a row toward the same destination go together. */
+		for(i = 0; i < n; i = j) {
+			for(j = i + 1; j < n && pkts[j]->dest == pkts[i]->dest; j++);
+
+			nori_send_burst(pkts + i, j - i);
+		}
+
+		/* Free ring can hold all the packets; this cannot fail. */
+		for(i = 0; i < n; i++) {
+			ring_push(&s->free, pkts[i]);
+		}
+
+		/* No flow is used here until the next burst. */
+		ep_quiescent(&s->ep);
+	}
+
+	ep_unregister(&s->ep);
+
+	return 0;
+}
+
+/* Take an empty packet from whatever sender has one. */
+struct nori_pkt * nori_pkt_get(void) {
+	struct nori_pkt * p = 0;
+	int i = 0;
+
+	for(i = 0; i < nori_senders_nr; i++) {
+		p = ring_pop(&nori_senders[i].free);
+
+		if(p) {
+			return p;
+		}
+	}
+
+	return 0;
+}
+
+/* Choose the sender for a destination; same destination, same sender. */
+struct nori_sender * nori_sender_of(struct rule_dest * de) {
+	return &nori_senders[de->dest->hash % nori_senders_nr];
+}
+
+/* Classifier stage: interface --> senders. */
+void * nori_classifier_loop(void * args) {
+	struct nori_worker * w = (struct nori_worker *)args;
+	struct epoll_event ev = {0};
+	struct dict_rule * r = 0;
+	struct nori_sender * s = 0;
+	struct nori_pkt * p = 0;
+
+	char scratch[NORI_PKT_SIZE];
+	int i = 0;
+
+	while(!nori_ctrlc) {
+		if(epoll_wait(w->epfd, &ev, 1, -1) <= 0 ||
+			ev.data.ptr != NORI_POLL_TUN) {
+
+			continue;
+		}
+
+		for(i = 0; i < NORI_BURST; i++) {
+			if(!p) {
+				p = nori_pkt_get();
+			}
+
+			/* Everything is in flight; read to drop it. */
+			if(!p) {
+				if(tun_read(nori_dev_fd, scratch, NORI_PKT_SIZE) <= 0) {
+					break;
+				}
+
+				nori_pipe_drops++;
+				continue;
+			}
+
+			p->size = tun_read(nori_dev_fd, p->data, NORI_PKT_SIZE);
+
+			if(p->size <= 0) {
+				break;
+			}
+
+			p->dest = nori_classify(&w->cls, p->data, p->size, &r);
+
+			/* No rule, no party. */
+			if(!p->dest) {
+				continue;
+			}
+
+			s = nori_sender_of(p->dest);
+
+			/* Sender is lagging; drop instead of stalling others. */
+			if(ring_push(&s->tx, p)) {
+				nori_pipe_drops++;
+				continue;
+			}
+
+			nori_sender_kick(s);
+			p = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* Allocate the stages and start their threads.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_pipeline_start(void) {
+	int i = 0;
+	int np = nori_senders_nr * nori_ring_depth + 1;
+
+	nori_pkts = malloc(sizeof(struct nori_pkt) * np);
+
+	if(posix_memalign((void **)&nori_senders, RING_CACHELINE,
+		sizeof(struct nori_sender) * nori_senders_nr) || !nori_pkts) {
 
-	char buf[4096] = {0};
-	int bytes = 0;
+		printf("Not enough memory for the pipeline.\n");
+		return -1;
+	}
 
-	/* While TRUE! */
-	while(!nori_ctrlc) {
-		/* Save it against removal/insertion... */
-		pthread_spin_lock(&nori_mt_lock);
-		list_for_each_entry_safe(kf, tmp, &nori_known_ae, listh) {
-			if(kf->id > 0) {
-				/* Read without waiting! */
-				rina_async_flow(kf->id);
-				bytes = rina_read_sdu(kf->id, buf, 4096);
-				rina_sync_flow(kf->id);
-
-				/* Move it on the interface. */
-				if(bytes > 0) {
-					tun_write(nori_dev_fd, buf, bytes);
-				}
-			}
+	memset(nori_senders, 0, sizeof(struct nori_sender) * nori_senders_nr);
+
+	for(i = 0; i < nori_senders_nr; i++) {
+		nori_senders[i].wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if(nori_senders[i].wfd < 0 ||
+			ring_init(&nori_senders[i].tx, nori_ring_depth) ||
+			ring_init(&nori_senders[i].free, np)) {
+
+			printf("Cannot prepare sender %d.\n", i);
+			return -1;
 		}
-		pthread_spin_unlock(&nori_mt_lock);
+	}
+
+	/* Spread the empty packets between the senders. */
+	for(i = 0; i < np; i++) {
+		ring_push(&nori_senders[i % nori_senders_nr].free, &nori_pkts[i]);
+	}
 
-		/* Now read for traffic on the interface. */
-		bytes = tun_read(nori_dev_fd, buf, 4096);
+	for(i = 0; i < nori_senders_nr; i++) {
+		if(pthread_create(&nori_senders[i].t, NULL,
+			nori_sender_loop, &nori_senders[i])) {
 
-		/* Everything which comes from the interface will be dumped to
-		 * the flow, if it already exists.
-		 */
-		if(bytes > 0) {
-			nori_take_action(buf, bytes);
+			printf("Cannot start sender %d.\n", i);
+			return -1;
+		}
+	}
+
+	if(nori_worker_init(&nori_classifier, nori_dev_fd, 1)) {
+		return -1;
+	}
+
+	if(pthread_create(&nori_classifier.t, NULL,
+		nori_classifier_loop, &nori_classifier)) {
+
+		printf("Cannot start the classifier.\n");
+		return -1;
+	}
+
+	printf("Pipeline started with %d senders, rings of %d packets\n",
+		nori_senders_nr, nori_ring_depth);
+
+	return 0;
+}
+
+/* Wait for the stages to finish and release their resources. */
+void nori_pipeline_stop(void) {
+	int i = 0;
+
+	/* Main loop could also have been left on error. */
+	nori_stop();
+
+	if(nori_classifier.t) {
+		pthread_join(nori_classifier.t, 0);
+	}
+
+	nori_worker_release(&nori_classifier);
+
+	for(i = 0; i < nori_senders_nr && nori_senders; i++) {
+		if(nori_senders[i].t) {
+			pthread_join(nori_senders[i].t, 0);
 		}
 
-		/* Listen for events, but do not wait them! */
-		rina_listen_for_events(flow_allocated, flow_deallocated, 1);
+		close(nori_senders[i].wfd);
+		ring_free(&nori_senders[i].tx);
+		ring_free(&nori_senders[i].free);
+	}
+
+	if(nori_pipe_drops) {
+		printf("%lu packets dropped by the pipeline\n", nori_pipe_drops);
 	}
+
+	free(nori_senders);
+	free(nori_pkts);
 }
 
 /******************************************************************************
  * Misc. procedures.                                                          *
  ******************************************************************************/
 
+/* Release the AE from the first 'n' DIFs. */
+void nori_unregister(int n) {
+	int i = 0;
+
+	for(i = 0; i < n; i++) {
+		rina_release_AE(nori_name, nori_instance, nori_difs[i]);
+	}
+}
+
+/* Register the AE in every DIF given.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int nori_register(void) {
+	int i = 0;
+
+	for(i = 0; i < nori_difs_nr; i++) {
+		if(rina_create_AE(nori_name, nori_instance, nori_difs[i])) {
+			printf("Cannot register %s-%s in DIF %s\n",
+				nori_name, nori_instance, nori_difs[i]);
+
+			nori_unregister(i);
+			return -1;
+		}
+
+		printf("Registered in DIF %s\n", nori_difs[i]);
+	}
+
+	nori_registered = 1;
+
+	return 0;
+}
+
 /* Show the help text. */
 void help(void) {
 	printf(
@@ -440,10 +3718,26 @@ void help(void) {
 "\n"
 "This software allows to move IP traffic from legacy interfaces over recursive "
 "internetworking architectures.\n"
-"Usage: nori <ap_name> <ap_inst> <dif_name> [options] <rules dictionary>\n"
+"Usage: nori <ap_name> <ap_inst> <dif_name>[,<dif_name>]* [options] "
+"<rules dictionary>\n"
 "\n"
 "Options:\n"
 "    --help, Show this text.\n"
+"    --devname <name>, Name of the TUN device to create.\n"
+"    --persistent, The device survives NORI exit.\n"
+"    --pipeline, Use different threads for the two directions.\n"
+"    --threads <n>, Number of sender threads in pipelined mode.\n"
+"    --ring <depth>, Depth of the rings between pipeline threads.\n"
+"    --cache <n>, Connections whose decision is kept (0 = none).\n"
+"    --queues <n>, Queues of the TUN device, each with its own thread.\n"
+"    --accept-rate <n>, Flows accepted from peers per second (0 = all).\n"
+"    --idle <s>, Release flows without traffic for s seconds (0 = never).\n"
+"    --max-flows <n>, Known flows at most, least used evicted (0 = any).\n"
+"    --prewarm, Allocate flows to every destination at start.\n"
+"    --compile, Build the rules into native code, if it is faster.\n"
+"    --backend <name>, Transport to use: irati, udp or loop.\n"
+"    --shm, Reach the AEs of this host through shared memory.\n"
+"    --handoff <path>, Take over the NORI waiting there, then wait there.\n"
 "\n");
 }
 
@@ -466,7 +3760,20 @@ int parse_args(int argc, char ** argv) {
 
 	nori_name = argv[1];
 	nori_instance = argv[2];
-	nori_dif = argv[3];
+	/* Registered in all of them; the first is the default one. */
+	for(option = strtok(argv[3], ","); option; option = strtok(0, ",")) {
+		if(nori_difs_nr == NORI_DIFS) {
+			printf("Too many DIFs, %d at most!\n", NORI_DIFS);
+			return 1;
+		}
+
+		nori_difs[nori_difs_nr++] = option;
+	}
+
+	if(!nori_difs_nr) {
+		printf("No DIF given!\n");
+		return 1;
+	}
 
 	for(i = 4; i < argc; i++) {
 		current = argv[i];
@@ -479,13 +3786,18 @@ int parse_args(int argc, char ** argv) {
 		option = current + 2;
 
 		if(strcmp(option, "devname") == 0) {
-			if(argc + 1 >= argc) {
+			if(i + 1 >= argc) {
 				printf("Not enough arguments!");
 				return 1;
 			}
 
+			if(strlen(argv[i+1]) >= sizeof(nori_dev_name)) {
+				printf("Device name too long!");
+				return 1;
+			}
+
 			/* Consume one argument. */
-			strncpy(nori_dev_name, argv[i+1], 16);
+			memcpy(nori_dev_name, argv[i+1], strlen(argv[i+1]) + 1);
 			i += 1;
 
 			continue;
@@ -496,6 +3808,172 @@ int parse_args(int argc, char ** argv) {
 			nori_dev_pers = 1;
 			continue;
 		}
+
+		if(strcmp(option, "pipeline") == 0) {
+			/* Split the directions in different threads. */
+			nori_pipeline = 1;
+			continue;
+		}
+
+		if(strcmp(option, "threads") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			nori_senders_nr = atoi(argv[i+1]);
+			i += 1;
+
+			if(nori_senders_nr < 1) {
+				printf("At least one sender thread is needed!\n");
+				return 1;
+			}
+
+			continue;
+		}
+
+		if(strcmp(option, "queues") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			nori_queues = atoi(argv[i+1]);
+			i += 1;
+
+			if(nori_queues < 1 || nori_queues > TUNW_MAX_QUEUES) {
+				printf("Queues must be between 1 and %d!\n",
+					TUNW_MAX_QUEUES);
+				return 1;
+			}
+
+			continue;
+		}
+
+		if(strcmp(option, "backend") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			if(rina_backend_use(argv[i+1])) {
+				printf("Backend %s not available!\n", argv[i+1]);
+				return 1;
+			}
+
+			i += 1;
+
+			continue;
+		}
+
+		if(strcmp(option, "handoff") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			nori_handoff_path = argv[i+1];
+			i += 1;
+
+			continue;
+		}
+
+		if(strcmp(option, "shm") == 0) {
+			/* Local AEs do not need the stack. */
+			nori_shm = 1;
+			continue;
+		}
+
+		if(strcmp(option, "compile") == 0) {
+			/* Rules become native code, if possible. */
+			nori_compile = 1;
+			continue;
+		}
+
+		if(strcmp(option, "prewarm") == 0) {
+			/* Do not wait for the first packet to get a flow. */
+			nori_prewarm_flows = 1;
+			continue;
+		}
+
+		if(strcmp(option, "max-flows") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			nori_max_flows = (unsigned int)atoi(argv[i+1]);
+			i += 1;
+
+			continue;
+		}
+
+		if(strcmp(option, "idle") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			nori_idle = (unsigned int)atoi(argv[i+1]);
+			i += 1;
+
+			continue;
+		}
+
+		if(strcmp(option, "accept-rate") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			nori_accept_rate = (unsigned int)atoi(argv[i+1]);
+			i += 1;
+
+			continue;
+		}
+
+		if(strcmp(option, "ring") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			nori_ring_depth = atoi(argv[i+1]);
+			i += 1;
+
+			if(nori_ring_depth < 1) {
+				printf("Rings need at least one slot!\n");
+				return 1;
+			}
+
+			continue;
+		}
+
+		if(strcmp(option, "cache") == 0) {
+			if(i + 1 >= argc) {
+				printf("Not enough arguments!");
+				return 1;
+			}
+
+			/* Consume one argument. */
+			nori_fc_size = (unsigned int)atoi(argv[i+1]);
+			i += 1;
+
+			continue;
+		}
+	}
+
+	if(nori_pipeline && nori_queues > 1) {
+		printf("Pipelined mode does not support more queues!\n");
+		return 1;
 	}
 
 	return 0;
@@ -506,8 +3984,12 @@ int parse_args(int argc, char ** argv) {
  ******************************************************************************/
 
 int main(int argc, char ** argv) {
+	int i = 0;
+
 	/* User want to terminate this. */
 	signal(SIGINT, handle_ctrlc);
+	/* User wants to see the counters. */
+	signal(SIGUSR1, handle_stats);
 
 	/* Direct invocation, no arguments. */
 	if(argc < 2) {
@@ -515,7 +3997,39 @@ int main(int argc, char ** argv) {
 		return 0;
 	}
 
-	pthread_spin_init(&nori_mt_lock, 0);
+	if(ht_init(&nori_flows_by_port, 64)) {
+		printf("Not enough memory for the flow table.\n");
+		return 0;
+	}
+
+	if(ht_init(&nori_reqs, 16)) {
+		printf("Not enough memory for the allocation table.\n");
+		return 0;
+	}
+
+	nori_stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(nori_stopfd < 0) {
+		printf("Cannot create the stop descriptor.\n");
+		return 0;
+	}
+
+	nori_statsfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(nori_statsfd < 0) {
+		printf("Cannot create the stats descriptor.\n");
+		return 0;
+	}
+
+	/* Perform operations depending on what the user requested. */
+	if(parse_args(argc, argv)) {
+		return 0;
+	}
+
+	if(nori_shm && rina_backend_shm()) {
+		printf("Shared memory cannot be used...\n");
+		return 0;
+	}
 
 	/* Initialize RINA subsystem. */
 	if(rina_init()) {
@@ -523,42 +4037,154 @@ int main(int argc, char ** argv) {
 		return 0;
 	}
 
-	/* Perform operations depending on what the user requested. */
-	if(parse_args(argc, argv)) {
+	printf("Using the %s backend\n", rina_backend_name());
+
+	/* With a limit, every flow is there from the start. */
+	if(slab_init(&nori_flow_slab, sizeof(struct known_flow),
+		nori_max_flows ? nori_max_flows : NORI_FLOW_CHUNK,
+		NORI_FLOW_CHUNK)) {
+
+		printf("Not enough memory for the flows.\n");
 		return 0;
 	}
 
 	printf("Starting NORI instance %s-%s\n", 
 		nori_name, nori_instance);
 
-	nori_dev_fd = tun_create(nori_dev_name, nori_dev_type, nori_dev_pers);
-
-	if(nori_dev_fd < 0) {
-		printf("Cannot create TUN/TAP device.\n");
+	/* Device and flows of the NORI we replace, if any. */
+	if(nori_handoff_path && nori_takeover() < 0) {
 		goto stop;
 	}
 
+	if(nori_takeover_fd >= 0) {
+		/* Its queues come with it. */
+		if(nori_pipeline && nori_queues > 1) {
+			printf("Pipelined mode does not support more queues!\n");
+			goto closefd;
+		}
+	} else if(nori_queues > 1) {
+		if(tun_create_mq(nori_dev_name, nori_dev_type, nori_dev_pers,
+			nori_dev_fds, nori_queues)) {
+
+			printf("Cannot create multi-queue TUN/TAP device.\n");
+			goto stop;
+		}
+	} else {
+		nori_dev_fds[0] = tun_create(
+			nori_dev_name, nori_dev_type, nori_dev_pers);
+
+		if(nori_dev_fds[0] < 0) {
+			printf("Cannot create TUN/TAP device.\n");
+			goto stop;
+		}
+	}
+
+	nori_dev_fd = nori_dev_fds[0];
+
 	/* We want async I/O. */
-	tun_async_io(nori_dev_fd);
+	for(i = 0; i < nori_queues; i++) {
+		tun_async_io(nori_dev_fds[i]);
+	}
 
 	/* Whatever happens, the dictionary is always the last argument. */
-	if(dict_parse(argv[argc - 1])) {
+	if(dict_parse(argv[argc - 1], nori_difs[0])) {
+		goto closefd;
+	}
+
+	/* The interpreter takes the rules if they cannot be built, or if it
+	 * is faster.
+	 */
+	if(nori_compile && dictc_load(&nori_compiled)) {
+		printf("Rules not compiled; interpreting them.\n");
+	} else if(nori_compiled) {
+		nori_compile_pick();
+	}
+
+	nori_direct_init();
+	nori_wheel_init();
+	nori_keep_init();
+
+	/* The main thread reads the interface only if nobody else does. */
+	if(nori_worker_init(
+		&nori_main, nori_dev_fd, !nori_pipeline && nori_queues == 1)) {
+
 		goto closefd;
 	}
 
-	/* Try to register an AE. */
-	if(rina_create_AE(nori_name, nori_instance, nori_dif)) {
+	/* Whatever is retired, flows or their sockets, wakes them up. */
+	ep_waker(nori_kick_workers);
+
+	/* Try to register an AE; once the old one has left, if replacing it. */
+	if(nori_takeover_fd < 0 && nori_register()) {
 		goto closefd;
 	}
 
+	/* Instances registered so far can be found now. */
+	nori_wild_init();
+
+	if(nori_queues > 1 && nori_workers_start(nori_dev_fds)) {
+		goto release;
+	}
+
+	if(nori_pipeline && nori_pipeline_start()) {
+		goto release;
+	}
+
+	if(nori_prewarm_flows) {
+		nori_prewarm();
+	}
+
+	if(nori_takeover_fd >= 0) {
+		nori_takeover_flows();
+	} else {
+		nori_handoff_start();
+	}
+
+	/* Flows from the peers can be served now. */
+	if(nori_ctrl_start()) {
+		goto release;
+	}
+
+	/* The old NORI can go; we are about to serve the traffic. */
+	if(nori_takeover_fd >= 0) {
+		nori_takeover_done();
+	}
+
 	/* Does not return until the end. */
 	nori_loop();
 
+release:
+	nori_ctrl_stop();
+
+	if(nori_queues > 1) {
+		nori_workers_stop();
+	}
+
+	if(nori_pipeline) {
+		nori_pipeline_stop();
+	}
+
+	nori_stats();
+
+	/* All together, rather than one after the other. */
+	nori_teardown();
+
 	/* Release a prevously allocated AE. */
-	rina_release_AE(nori_name, nori_instance, nori_dif);
+	if(nori_registered) {
+		nori_unregister(nori_difs_nr);
+	}
+
+	/* The NORI which took over can register now. */
+	if(nori_heir_fd >= 0) {
+		close(nori_heir_fd);
+	}
 
 closefd:
-	close(nori_dev_fd);
+	nori_worker_release(&nori_main);
+
+	for(i = 0; i < nori_queues; i++) {
+		tun_close(nori_dev_fds[i]);
+	}
 stop:
 	/* Stop and dispose any waiting loop. */
 	rina_stop();
@@ -30,21 +30,32 @@
  * Displacement starting from IP header. 
  */
 
+#define IPV4_FRAG_OFFSET	6 /* Flags and fragment offset. */
 #define IPV4_PROTO_OFFSET	9
 #define IPV4_SOURCE_OFFSET	12
 #define IPV4_DEST_OFFSET	16
 #define IPV4_HEADER_SIZE(x)	((x  & 0x0f) * 4) /* Using IHL */
 
+/*
+ * Protocol numbers.
+ */
+
+#define IPV4_PROTO_ICMP		1
+#define IPV4_PROTO_TCP		6
+#define IPV4_PROTO_UDP		17
+
 /*
  * Displacements for ICMP protocol.
  */
 
+#define IPV4_ICMP_TYPE		0
 #define IPV4_ICMP_CODE		1
 
 /* 
  * Displacements valid for both TCP and UDP protocols. 
  */
 
+#define IPV4_TDP_SOURCEP_OFFSET	0
 #define IPV4_TDP_DESTP_OFFSET	2
 
 /* 
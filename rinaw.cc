@@ -17,8 +17,13 @@
  * Contributors and changes:
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string>
+#include <list>
+#include <map>
+#include <new>
+#include <vector>
 
 #define RINA_PREFIX "nori"
 #include <librina/logs.h>
@@ -28,6 +33,11 @@
 #include <asm/unistd_64.h>
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "rinaw.h"
 
 using namespace std;
 using namespace rina;
@@ -38,18 +48,475 @@ extern "C"
 /* Interrupt the listening loop when waiting for RINA subsystem events. */
 static int rina_list_stop = 0;
 
+/*
+ * Event dispatcher:
+ *
+ * librina only offers blocking/timed waits on its event producer, so a single
+ * thread owns it and dispatches every event. Responses are matched by
+ * sequence number with a table of pending operations, which are completed
+ * through their own callback; this way any number of requests can be in
+ * flight at the same time. Everything else is unsolicited: it is queued for
+ * rina_listen_for_events, which hands it to the handler registered for its
+ * type. Queued events are also signaled on an eventfd, so the caller can
+ * sleep on the descriptor together with its own ones.
+ */
+
+struct rina_op;
+
+/* Completes an operation; runs in the dispatcher with the queue lock held. */
+typedef void (* rina_op_done)(struct rina_op * op, IPCEvent * event);
+
+/* Operation waiting for its response. */
+struct rina_op {
+	/* What to do once the response arrives. */
+	rina_op_done done;
+	/* The response, for who waits on it. */
+	IPCEvent * event;
+};
+
+/* Callbacks given to the listener. */
+struct rina_listener {
+	void * (* flow_serve)(void * args);
+	void (* flow_release)(int port);
+	void (* flow_ready)(int handle, rina_flow port);
+};
+
+/* Handler of an unsolicited event; runs in the listener. */
+typedef void (* rina_handler)(IPCEvent * event, struct rina_listener * l);
+
+/* Operations waiting for a response, by sequence number. */
+static map<unsigned int, struct rina_op *> rina_ops;
+/* Responses which arrived before their operation was registered. */
+static map<unsigned int, IPCEvent *> rina_early;
+/* Unsolicited events waiting to be consumed. */
+static list<IPCEvent *> rina_evq;
+/* Handlers of the unsolicited events, by type. */
+static map<int, rina_handler> rina_handlers;
+
+/* Lock and condition protecting the tables and the queue. */
+static pthread_mutex_t rina_evq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rina_evq_cond = PTHREAD_COND_INITIALIZER;
+/* Readable while there are events in the queue. */
+static int rina_evfd = -1;
+/* Thread which dispatches the events. */
+static pthread_t rina_pump;
+
+/* Is this the response to one of our requests? */
+static int rina_event_is_response(IPCEvent * event) {
+	switch(event->eventType) {
+	case ALLOCATE_FLOW_REQUEST_RESULT_EVENT:
+	case DEALLOCATE_FLOW_RESPONSE_EVENT:
+	case REGISTER_APPLICATION_RESPONSE_EVENT:
+	case UNREGISTER_APPLICATION_RESPONSE_EVENT:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Queue an event for the listener; needs the queue lock. */
+static void rina_event_post(IPCEvent * event) {
+	eventfd_t one = 1;
+
+	rina_evq.push_back(event);
+	eventfd_write(rina_evfd, one);
+	pthread_cond_broadcast(&rina_evq_cond);
+}
+
+static void * rina_event_pump(void * args) {
+	map<unsigned int, struct rina_op *>::iterator it;
+	IPCEvent * event = 0;
+
+	while(!rina_list_stop) {
+		/* Wake up once in a while to check for the stop flag. */
+		event = ipcEventProducer->eventTimedWait(1, 0);
+
+		if(!event) {
+			continue;
+		}
+
+		pthread_mutex_lock(&rina_evq_lock);
+
+		if(!rina_event_is_response(event)) {
+			rina_event_post(event);
+			pthread_mutex_unlock(&rina_evq_lock);
+			continue;
+		}
+
+		it = rina_ops.find(event->sequenceNumber);
+
+		if(it != rina_ops.end()) {
+			struct rina_op * op = it->second;
+
+			rina_ops.erase(it);
+			op->done(op, event);
+		} else {
+			/* The requester did not register it yet. */
+			rina_early[event->sequenceNumber] = event;
+		}
+
+		pthread_mutex_unlock(&rina_evq_lock);
+	}
+
+	return 0;
+}
+
+/* Register an operation waiting for the response to request 'seqnum'. It
+ * completes at once if the response is already there.
+ */
+static void rina_op_start(struct rina_op * op, unsigned int seqnum) {
+	map<unsigned int, IPCEvent *>::iterator it;
+
+	pthread_mutex_lock(&rina_evq_lock);
+
+	it = rina_early.find(seqnum);
+
+	if(it != rina_early.end()) {
+		IPCEvent * event = it->second;
+
+		rina_early.erase(it);
+		op->done(op, event);
+	} else {
+		rina_ops[seqnum] = op;
+	}
+
+	pthread_mutex_unlock(&rina_evq_lock);
+}
+
+/* Completion of operations which somebody waits for. */
+static void rina_op_signal(struct rina_op * op, IPCEvent * event) {
+	op->event = event;
+	pthread_cond_broadcast(&rina_evq_cond);
+}
+
+/* Completion of operations whose result goes to the listener. */
+static void rina_op_post(struct rina_op * op, IPCEvent * event) {
+	rina_event_post(event);
+	delete op;
+}
+
+/* Wait for the response of an operation started with rina_op_signal.
+ *
+ * Returns the response, or 0 if stopped before it arrived.
+ */
+static IPCEvent * rina_op_wait(struct rina_op * op, unsigned int seqnum) {
+	IPCEvent * event = 0;
+	struct timespec ts;
+
+	pthread_mutex_lock(&rina_evq_lock);
+
+	while(!op->event && !rina_list_stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+
+		pthread_cond_timedwait(&rina_evq_cond, &rina_evq_lock, &ts);
+	}
+
+	event = op->event;
+
+	/* Nobody is going to wait for it anymore. */
+	if(!event) {
+		rina_ops.erase(seqnum);
+	}
+
+	pthread_mutex_unlock(&rina_evq_lock);
+
+	return event;
+}
+
+/* Pop the next unsolicited event; wait for it only if requested to. */
+static IPCEvent * rina_event_next(int wait) {
+	IPCEvent * event = 0;
+	eventfd_t cnt = 0;
+	struct timespec ts;
+
+	pthread_mutex_lock(&rina_evq_lock);
+
+	while(wait && rina_evq.empty() && !rina_list_stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+
+		pthread_cond_timedwait(&rina_evq_cond, &rina_evq_lock, &ts);
+	}
+
+	if(!rina_evq.empty()) {
+		event = rina_evq.front();
+		rina_evq.pop_front();
+	}
+
+	/* Nothing more to report; rearm the descriptor. */
+	if(rina_evq.empty()) {
+		eventfd_read(rina_evfd, &cnt);
+	}
+
+	pthread_mutex_unlock(&rina_evq_lock);
+
+	return event;
+}
+
+/* Register the handler of an unsolicited event type. */
+static void rina_handle(int type, rina_handler h) {
+	rina_handlers[type] = h;
+}
+
+/*
+ * Incoming flows:
+ *
+ * Requests from remote peers are accepted by a fixed pool of threads, so a
+ * burst of them does not become a burst of threads, and the dispatcher is
+ * never stuck waiting for an answer of the stack. Admission is limited with
+ * a token bucket; requests over the rate, or which find the backlog full,
+ * are refused.
+ */
+
+/* Threads accepting the incoming flows. */
+#define RINA_ACCEPT_THREADS	4
+/* Incoming requests which can wait for a thread. */
+#define RINA_ACCEPT_BACKLOG	1024
+
+/* Incoming request waiting to be served. */
+struct rina_accept {
+	/* The request itself. */
+	FlowRequestEvent * event;
+	/* Callbacks of the listener which got it. */
+	struct rina_listener l;
+};
+
+/* Requests waiting for a thread. */
+static list<struct rina_accept> rina_acceptq;
+/* Lock and condition protecting the requests. */
+static pthread_mutex_t rina_accept_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rina_accept_cond = PTHREAD_COND_INITIALIZER;
+/* Threads started, lazily at the first request. */
+static int rina_acceptors = 0;
+
+/* Requests admitted per second and maximum burst; no limit if rate is 0. */
+static unsigned int rina_accept_rate = 0;
+static unsigned int rina_accept_burst = 0;
+/* Requests which can be still admitted, and when they were computed. */
+static double rina_accept_tokens = 0;
+static struct timespec rina_accept_last;
+
+/* Can one more request be admitted? */
+static int rina_accept_admit(void) {
+	struct timespec now;
+
+	if(!rina_accept_rate) {
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	rina_accept_tokens +=
+		((now.tv_sec - rina_accept_last.tv_sec) +
+		(now.tv_nsec - rina_accept_last.tv_nsec) / 1000000000.0) *
+		rina_accept_rate;
+
+	if(rina_accept_tokens > rina_accept_burst) {
+		rina_accept_tokens = rina_accept_burst;
+	}
+
+	rina_accept_last = now;
+
+	if(rina_accept_tokens < 1) {
+		return 0;
+	}
+
+	rina_accept_tokens -= 1;
+
+	return 1;
+}
+
+/* Answer an incoming request and give the flow to the listener. */
+static void rina_accept_serve(struct rina_accept * a) {
+	struct rina_AP_info * ai;
+
+	try {
+		rina::FlowInformation flow =
+			ipcManager->allocateFlowResponse(*a->event, 0, true);
+
+		ai = (struct rina_AP_info *)malloc(
+			sizeof(struct rina_AP_info));
+
+		if(!ai) {
+			printf("No more memory!");
+			a->l.flow_release(flow.portId);
+			return;
+		}
+
+		/* Populate information about this flow. */
+		snprintf(ai->name, sizeof(ai->name), "%s",
+			flow.remoteAppName.toString().c_str());
+		snprintf(ai->dif, sizeof(ai->dif), "%s",
+			a->event->DIFName.processName.c_str());
+
+		ai->port = flow.portId;
+	} catch (Exception & e) {
+		return;
+	}
+
+	a->l.flow_serve(ai);
+}
+
+static void * rina_accept_loop(void * args) {
+	struct rina_accept a;
+	struct timespec ts;
+
+	while(!rina_list_stop) {
+		pthread_mutex_lock(&rina_accept_lock);
+
+		while(rina_acceptq.empty() && !rina_list_stop) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+
+			pthread_cond_timedwait(
+				&rina_accept_cond, &rina_accept_lock, &ts);
+		}
+
+		if(rina_acceptq.empty()) {
+			pthread_mutex_unlock(&rina_accept_lock);
+			break;
+		}
+
+		a = rina_acceptq.front();
+		rina_acceptq.pop_front();
+
+		pthread_mutex_unlock(&rina_accept_lock);
+
+		rina_accept_serve(&a);
+		delete a.event;
+	}
+
+	return 0;
+}
+
+/* Start the accepting threads.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int rina_accept_start(void) {
+	pthread_attr_t attr;
+	pthread_t t;
+
+	/* They leave on their own once stopped. */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for(; rina_acceptors < RINA_ACCEPT_THREADS; rina_acceptors++) {
+		if(pthread_create(&t, &attr, rina_accept_loop, 0)) {
+			break;
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return rina_acceptors > 0 ? 0 : -1;
+}
+
+/* A remote peer asks for a flow with us. */
+static void rina_on_flow_request(IPCEvent * event, struct rina_listener * l) {
+	FlowRequestEvent * fre = dynamic_cast<FlowRequestEvent*>(event);
+	struct rina_accept a;
+	int queued = 0;
+
+	if(!rina_acceptors) {
+		rina_accept_start();
+	}
+
+	if(rina_acceptors && rina_accept_admit()) {
+		pthread_mutex_lock(&rina_accept_lock);
+
+		if(rina_acceptq.size() < RINA_ACCEPT_BACKLOG) {
+			try {
+				a.event = new FlowRequestEvent(*fre);
+				a.l = *l;
+
+				rina_acceptq.push_back(a);
+				pthread_cond_signal(&rina_accept_cond);
+
+				queued = 1;
+			} catch (bad_alloc & e) {
+				queued = 0;
+			}
+		}
+
+		pthread_mutex_unlock(&rina_accept_lock);
+	}
+
+	/* Refuse it, so the peer does not wait for nothing. */
+	if(!queued) {
+		try {
+			ipcManager->allocateFlowResponse(*fre, -1, true);
+		} catch (Exception & e) {
+			/* Nothing else to do. */
+		}
+	}
+}
+
+/* Result of an allocation requested without waiting. */
+static void rina_on_flow_result(IPCEvent * event, struct rina_listener * l) {
+	AllocateFlowRequestResultEvent * afrr =
+		dynamic_cast<AllocateFlowRequestResultEvent*>(event);
+	int handle = (int)(event->sequenceNumber & 0x7fffffff);
+	int port_id = -1;
+
+	try {
+		if(afrr->portId < 0) {
+			ipcManager->withdrawPendingFlow(afrr->sequenceNumber);
+		} else {
+			port_id = ipcManager->commitPendingFlow(
+				afrr->sequenceNumber,
+				afrr->portId,
+				afrr->difName).portId;
+		}
+	} catch (Exception & e) {
+		port_id = -1;
+	}
+
+	l->flow_ready(handle, port_id < 0 ? -1 : port_id);
+}
+
+/* A flow has been de-allocated. */
+static void rina_on_flow_gone(IPCEvent * event, struct rina_listener * l) {
+	int port_id = dynamic_cast<FlowDeallocatedEvent*>(event)->portId;
+
+	l->flow_release(port_id);
+
+	ipcManager->flowDeallocated(port_id);
+}
+
 /*
  * Rina subsystem operations:
  */
 
-int rina_init(void) {
+static int irati_init(void) {
 	/* Raise the log level to hide everything... */
 	setLogLevel("ERR");
 
+	rina_handle(FLOW_ALLOCATION_REQUESTED_EVENT, rina_on_flow_request);
+	rina_handle(ALLOCATE_FLOW_REQUEST_RESULT_EVENT, rina_on_flow_result);
+	rina_handle(FLOW_DEALLOCATED_EVENT, rina_on_flow_gone);
+
+	rina_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(rina_evfd < 0) {
+		return -1;
+	}
+
+	if(pthread_create(&rina_pump, NULL, rina_event_pump, 0)) {
+		close(rina_evfd);
+		rina_evfd = -1;
+		return -1;
+	}
+
 	return 0;
 }
 
-int rina_stop(void) {
+static int irati_event_fd(void) {
+	return rina_evfd;
+}
+
+static int irati_stop(void) {
 	/* This cause any running loop to be stopped. */
 	rina_list_stop = 1;
 
@@ -60,37 +527,125 @@ int rina_stop(void) {
  * I/O operations:
  */
 
-#include "rinaw.h"
-
 /* Read a SDU... */
-int rina_read_sdu(rina_flow port, char * buffer, unsigned int size) {
+static int irati_read_sdu(
+	rina_flow port, char * buffer, unsigned int size) {
+
+	int ret = 0;
+
 	try {
-		return ipcManager->readSDU(port, buffer, size);
-	} catch (FlowNotAllocatedException fnae) {
+		ret = ipcManager->readSDU(port, buffer, size);
+	} catch (FlowNotAllocatedException & e) {
 		return -2;
-	} catch (Exception e) {
+	} catch (Exception & e) {
 		return -1;
 	}
+
+	/* Non-blocking flow with nothing there. */
+	return ret == -EAGAIN ? 0 : ret;
 }
 
 /* Send a SDU somewhere... */
-int rina_write_sdu(rina_flow port, char * buffer, unsigned int size) {
+static int irati_write_sdu(
+	rina_flow port, char * buffer, unsigned int size) {
+
+	int ret = 0;
+
 	try {
-		return ipcManager->writeSDU(port, buffer, size);
-	} catch (FlowNotAllocatedException fnae) {
+		ret = ipcManager->writeSDU(port, buffer, size);
+	} catch (FlowNotAllocatedException & e) {
 		return -2;
-	} catch (Exception e) {
+	} catch (Exception & e) {
 		return -1;
 	}
+
+	/* Non-blocking flow with no room left. */
+	return ret == -EAGAIN ? 0 : ret;
+}
+
+/* Result of an I/O on the flow descriptor, in the same terms of the stack. */
+static int rina_fd_result(ssize_t ret) {
+	if(ret > 0) {
+		return (int)ret;
+	}
+
+	/* Descriptor closed under us: the flow is gone. */
+	if(ret == 0) {
+		return -2;
+	}
+
+	return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+}
+
+/* Read many SDUs, one per buffer. */
+static int irati_read_sdus(
+	rina_flow port, int fd, struct iovec * iov, int n) {
+
+	int i = 0;
+	int ret = 0;
+
+	for(i = 0; i < n; i++) {
+		/* One read per SDU, without going through the stack. */
+		if(fd >= 0) {
+			ret = rina_fd_result(
+				read(fd, iov[i].iov_base, iov[i].iov_len));
+		} else {
+			ret = irati_read_sdu(
+				port, (char *)iov[i].iov_base, iov[i].iov_len);
+		}
+
+		if(ret <= 0) {
+			break;
+		}
+
+		iov[i].iov_len = ret;
+	}
+
+	/* Report the error next time, if something has been moved. */
+	return i > 0 ? i : ret;
+}
+
+/* Send many SDUs, one per buffer. */
+static int irati_write_sdus(
+	rina_flow port, int fd, struct iovec * iov, int n) {
+
+	int i = 0;
+	int ret = 0;
+
+	for(i = 0; i < n; i++) {
+		if(fd >= 0) {
+			ret = rina_fd_result(
+				write(fd, iov[i].iov_base, iov[i].iov_len));
+		} else {
+			ret = irati_write_sdu(
+				port, (char *)iov[i].iov_base, iov[i].iov_len);
+		}
+
+		if(ret <= 0) {
+			break;
+		}
+	}
+
+	return i > 0 ? i : ret;
 }
 
 /*
  * Operations on the single flow:
  */
 
+/* Descriptor which can be polled for incoming SDUs. */
+static int irati_flow_fd(rina_flow port) {
+	try {
+		return ipcManager->getFlowInformation(port).fd;
+	} catch (Exception &e) {
+		return -1;
+	}
+}
+
 /* Swap the flow behavior to async. */
-int rina_async_flow(rina_flow port) {
+static int irati_async_flow(rina_flow port) {
 	long int result = -1;
+	int fd = irati_flow_fd(port);
 
 	result = syscall(__NR_flow_io_ctl, port, F_GETFL);
 	result = syscall(__NR_flow_io_ctl, port, F_SETFL, result | O_NONBLOCK);
@@ -100,56 +655,93 @@ int rina_async_flow(rina_flow port) {
 		return result;
 	}
 
+	/* The descriptor is used for I/O too; it must not wait either. */
+	if(fd >= 0) {
+		result = fcntl(fd, F_GETFL);
+
+		if(result < 0 || fcntl(fd, F_SETFL, result | O_NONBLOCK) < 0) {
+			printf("Error wile controlling flow on %d\n", port);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
+/* Translate our QoS into the stack one. */
+static void rina_qos_spec(struct rina_qos * qos, FlowSpecification * spec) {
+	spec->averageBandwidth = qos->averageBandwidth;
+	spec->averageSDUBandwidth = qos->averageSDUBandwidth;
+	spec->delay = qos->delay;
+	spec->jitter = qos->jitter;
+	spec->maxAllowableGap = qos->maxAllowableGap;
+	spec->maxSDUsize = qos->maxSDUsize;
+	spec->orderedDelivery = qos->orderedDelivery;
+	spec->partialDelivery = qos->partialDelivery;
+	spec->peakBandwidthDuration = qos->peakBandwidthDuration;
+	spec->peakSDUBandwidthDuration = qos->peakSDUBandwidthDuration;
+	spec->undetectedBitErrorRate = qos->undetectedBitErrorRate;
+}
+
+/* Ask for a flow, in the given DIF if any.
+ *
+ * Returns the sequence number of the request.
+ */
+static unsigned int rina_flow_request(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn,
+	FlowSpecification * spec) {
+
+	string sn(srcn);
+	string si(srci);
+	string dn(dstn);
+	string di(dsti);
+
+	if(difn && difn[0]) {
+		return ipcManager->requestFlowAllocationInDIF(
+			ApplicationProcessNamingInformation(sn, si),
+			ApplicationProcessNamingInformation(dn, di),
+			ApplicationProcessNamingInformation(
+				string(difn), string()),
+			*spec);
+	}
+
+	return ipcManager->requestFlowAllocation(
+		ApplicationProcessNamingInformation(sn, si),
+		ApplicationProcessNamingInformation(dn, di),
+		*spec);
+}
+
 /* Request a flow to a certain AE within a DIF. */
-rina_flow rina_request_flow(
+static rina_flow irati_request_flow(
 	const char * srcn, /* Source info */
 	const char * srci,
 	const char * dstn, /* Destination info */
 	const char * dsti,
+	const char * difn, /* DIF to use, or 0. */
 	struct rina_qos * qos) { /* Qos to use. */
 
 	AllocateFlowRequestResultEvent * afrrevent;
 	FlowSpecification qos_spec;
 	IPCEvent * event;
-
-	string sn(srcn);
-	string si(srci);
-	string dn(dstn);
-	string di(dsti);
+	struct rina_op op = {rina_op_signal, 0};
 
 	unsigned int seqnum;
 
 	/* Setup the qos to respect. */
-	qos_spec.averageBandwidth = qos->averageBandwidth;
-	qos_spec.averageSDUBandwidth = qos->averageSDUBandwidth;
-	qos_spec.delay = qos->delay;
-	qos_spec.jitter = qos->jitter;
-	qos_spec.maxAllowableGap = qos->maxAllowableGap;
-	qos_spec.maxSDUsize = qos->maxSDUsize;
-	qos_spec.orderedDelivery = qos->orderedDelivery;
-	qos_spec.partialDelivery = qos->partialDelivery;
-	qos_spec.peakBandwidthDuration = qos->peakBandwidthDuration;
-	qos_spec.peakSDUBandwidthDuration = qos->peakSDUBandwidthDuration;
-	qos_spec.undetectedBitErrorRate = qos->undetectedBitErrorRate;
-
-	seqnum = ipcManager->requestFlowAllocation(
-		ApplicationProcessNamingInformation(sn, si),
-		ApplicationProcessNamingInformation(dn, di),
-		qos_spec);
+	rina_qos_spec(qos, &qos_spec);
 
-	/* Again, wait for an event or user break. */
-	while(!rina_list_stop) {
-		event = ipcEventProducer->eventWait();
+	seqnum = rina_flow_request(srcn, srci, dstn, dsti, difn, &qos_spec);
 
-		if (event && event->eventType ==
-				ALLOCATE_FLOW_REQUEST_RESULT_EVENT &&
-			event->sequenceNumber == seqnum) {
+	/* Wait for the response or user break. */
+	rina_op_start(&op, seqnum);
+	event = rina_op_wait(&op, seqnum);
 
-			break;
-		}
+	if(!event) {
+		return -1;
 	}
 
 	afrrevent = dynamic_cast<AllocateFlowRequestResultEvent*>(event);
@@ -160,6 +752,8 @@ rina_flow rina_request_flow(
 			afrrevent->portId,
 			afrrevent->difName);
 
+	delete event;
+
 	if (flow.portId < 0) {
 		return -1;
 	}
@@ -167,34 +761,127 @@ rina_flow rina_request_flow(
 	return flow.portId;
 }
 
+static int irati_request_flow_async(
+	const char * srcn, /* Source info */
+	const char * srci,
+	const char * dstn, /* Destination info */
+	const char * dsti,
+	const char * difn, /* DIF to use, or 0. */
+	struct rina_qos * qos) { /* Qos to use. */
+
+	FlowSpecification qos_spec;
+	struct rina_op * op = 0;
+
+	unsigned int seqnum = 0;
+	int requested = 0;
+
+	rina_qos_spec(qos, &qos_spec);
+
+	try {
+		seqnum = rina_flow_request(
+			srcn, srci, dstn, dsti, difn, &qos_spec);
+		requested = 1;
+
+		op = new rina_op;
+	} catch (Exception & e) {
+		return -1;
+	} catch (bad_alloc & e) {
+		/* Only a request which went out has something to withdraw. */
+		if(requested) {
+			ipcManager->withdrawPendingFlow(seqnum);
+		}
+
+		return -1;
+	}
+
+	/* The result goes to the listener. */
+	op->done = rina_op_post;
+	op->event = 0;
+
+	rina_op_start(op, seqnum);
+
+	return (int)(seqnum & 0x7fffffff);
+}
+
 /* Release a previously registered flow. */
-int rina_release_flow(rina_flow port) {
+static int irati_release_flow(rina_flow port) {
 	DeallocateFlowResponseEvent * resp = 0;
 	unsigned int seqNum;
 	IPCEvent * event;
+	struct rina_op op = {rina_op_signal, 0};
 
 	seqNum = ipcManager->requestFlowDeallocation(port);
 
-	/* Again, wait for an event or user break. */
-	while(!rina_list_stop) {
-		event = ipcEventProducer->eventWait();
-
-		if (event && event->eventType ==
-				DEALLOCATE_FLOW_RESPONSE_EVENT &&
-			event->sequenceNumber == seqNum) {
+	/* Wait for the response or user break. */
+	rina_op_start(&op, seqNum);
+	event = rina_op_wait(&op, seqNum);
 
-			break;
-		}
+	if(!event) {
+		return -1;
 	}
 
 	resp = dynamic_cast<DeallocateFlowResponseEvent*>(event);
 	ipcManager->flowDeallocationResult(port, resp->result == 0);
 
+	delete event;
+
 	return 0;
 }
 
+static int irati_release_flows(rina_flow * ports, int n) {
+	DeallocateFlowResponseEvent * resp = 0;
+	IPCEvent * event = 0;
+	int ret = 0;
+	int i = 0;
+
+	vector<struct rina_op> ops(n);
+	vector<unsigned int> seqnums(n);
+	vector<int> started(n, 0);
+
+	/* Send all the requests before waiting for anything. */
+	for(i = 0; i < n; i++) {
+		try {
+			seqnums[i] = ipcManager->requestFlowDeallocation(
+				ports[i]);
+		} catch (Exception & e) {
+			ret = -1;
+			continue;
+		}
+
+		ops[i].done = rina_op_signal;
+		ops[i].event = 0;
+		started[i] = 1;
+
+		rina_op_start(&ops[i], seqnums[i]);
+	}
+
+	for(i = 0; i < n; i++) {
+		if(!started[i]) {
+			continue;
+		}
+
+		event = rina_op_wait(&ops[i], seqnums[i]);
+
+		if(!event) {
+			ret = -1;
+			continue;
+		}
+
+		resp = dynamic_cast<DeallocateFlowResponseEvent*>(event);
+		ipcManager->flowDeallocationResult(ports[i], resp->result == 0);
+
+		if(resp->result != 0) {
+			ret = -1;
+		}
+
+		delete event;
+	}
+
+	return ret;
+}
+
 /* Swap the flow behavior to sync. */
-int rina_sync_flow(rina_flow port) {
+static int irati_sync_flow(rina_flow port) {
 	long int result = -1;
 
 	result = syscall(__NR_flow_io_ctl, port, F_GETFL);
@@ -213,7 +900,7 @@ int rina_sync_flow(rina_flow port) {
  */
 
 /* Creates an AE into RINA subsystems. */
-int rina_create_AE(
+static int irati_create_AE(
 	const char * name, const char * instance, const char * difn) {
 
 	unsigned int seqnum = 0;
@@ -221,6 +908,8 @@ int rina_create_AE(
 	ApplicationRegistrationInformation ari;
 	RegisterApplicationResponseEvent * resp = 0;
 	IPCEvent * event = 0;
+	struct rina_op op = {rina_op_signal, 0};
+	int ret = 0;
 
 	string ns(name);
 	string is(instance);
@@ -235,17 +924,12 @@ int rina_create_AE(
 
 	seqnum = ipcManager->requestApplicationRegistration(ari);
 
-	/* Again, wait for an event or user break. */
-	while(!rina_list_stop) {
-		event = ipcEventProducer->eventWait();
-
-		/* Event! */
-		if (event && event->eventType ==
-				REGISTER_APPLICATION_RESPONSE_EVENT &&
-			event->sequenceNumber == seqnum) {
+	/* Wait for the response or user break. */
+	rina_op_start(&op, seqnum);
+	event = rina_op_wait(&op, seqnum);
 
-			break;
-		}
+	if(!event) {
+		return -1;
 	}
 
 	resp = dynamic_cast<RegisterApplicationResponseEvent*>(event);
@@ -255,20 +939,24 @@ int rina_create_AE(
 		ipcManager->commitPendingRegistration(seqnum, resp->DIFName);
 	} else {
 		ipcManager->withdrawPendingRegistration(seqnum);
-		return -1;
+		ret = -1;
 	}
 
-	return 0;
+	delete event;
+
+	return ret;
 }
 
 /* Releases an AE from the RINA subsystems. */
-int rina_release_AE(
+static int irati_release_AE(
 	const char * name, const char * instance, const char * difn) {
 
 	unsigned int seqnum = 0;
 
 	UnregisterApplicationResponseEvent * resp = 0;
 	IPCEvent * event = 0;
+	struct rina_op op = {rina_op_signal, 0};
+	int ret = 0;
 
 	string ns(name);
 	string is(instance);
@@ -278,16 +966,12 @@ int rina_release_AE(
 		ApplicationProcessNamingInformation(ns, is),
 		ApplicationProcessNamingInformation(dn, string()));
 
-	/* Again, wait for an event or user break. */
-	while(!rina_list_stop) {
-		event = ipcEventProducer->eventWait();
-		if (event &&
-			event->eventType ==
-				UNREGISTER_APPLICATION_RESPONSE_EVENT &&
-			event->sequenceNumber == seqnum) {
+	/* Wait for the response or user break. */
+	rina_op_start(&op, seqnum);
+	event = rina_op_wait(&op, seqnum);
 
-			break;
-		}
+	if(!event) {
+		return -1;
 	}
 
 	resp = dynamic_cast<UnregisterApplicationResponseEvent*>(event);
@@ -296,102 +980,89 @@ int rina_release_AE(
 		ipcManager->appUnregistrationResult(seqnum, true);
 	} else {
 		ipcManager->appUnregistrationResult(seqnum, false);
-		return -1;
+		ret = -1;
 	}
 
-	return 0;
+	delete event;
+
+	return ret;
 }
 
 /*
  * Main procedure which reacts to RINA events.
  */
 
-int rina_listen_for_events(
+static int irati_flow_admission(unsigned int rate, unsigned int burst) {
+	rina_accept_rate = rate;
+	rina_accept_burst = burst ? burst : 1;
+	rina_accept_tokens = rina_accept_burst;
+
+	clock_gettime(CLOCK_MONOTONIC, &rina_accept_last);
+
+	return 0;
+}
+
+static int irati_listen_for_events(
 	void * (* flow_serve)(void * args),
 	void (* flow_release)(int port),
+	void (* flow_ready)(int handle, rina_flow port),
 	int async) {
 
-	pthread_t t = 0;
-	struct rina_AP_info * ai;
+	struct rina_listener l = {flow_serve, flow_release, flow_ready};
+	map<int, rina_handler>::iterator h;
 
 	do {
-		/* Wait no more than half microsecond...*/
-		IPCEvent * event = ipcEventProducer->eventTimedWait(0, 500000);
-		int port_id = 0;
+		/* Consume what is already there if async, otherwise wait. */
+		IPCEvent * event = rina_event_next(!async);
 
 		if (!event) {
-			continue;
-		}
-
-		switch (event->eventType) {
-
-		/* AE creation event. */
-		case REGISTER_APPLICATION_RESPONSE_EVENT:
-			ipcManager->commitPendingRegistration(
-				event->sequenceNumber,
-				dynamic_cast<RegisterApplicationResponseEvent*>(
-					event)->DIFName);
-			break;
-
-		/* AE release event. */
-		case UNREGISTER_APPLICATION_RESPONSE_EVENT:
-			ipcManager->appUnregistrationResult(
-				event->sequenceNumber,
-				dynamic_cast<UnregisterApplicationResponseEvent*>(
-					event)->result == 0);
-			break;
-
-		/* A signal inform that a flow creation event occurs. */
-		case FLOW_ALLOCATION_REQUESTED_EVENT: {
-			rina::FlowInformation flow =
-				ipcManager->allocateFlowResponse(
-				*dynamic_cast<FlowRequestEvent*>(
-					event), 0, true);
-
-			ai = (struct rina_AP_info *)malloc(
-				sizeof(struct rina_AP_info));
-
-			if(!ai) {
-				printf("No more memory!");
-				flow_release(flow.portId);
+			/* Nothing left for an async call. */
+			if (async) {
 				break;
 			}
 
-			/* Populate information about this flow. */
-			memcpy(ai->name,
-				flow.remoteAppName.toString().c_str(),
-				strlen(flow.remoteAppName.toString().c_str()));
-
-			ai->port = flow.portId;
-
-			/* Create the thread which will take care of it. */
-			if(pthread_create(&t, NULL, flow_serve, ai)) {
-				printf("Pthread failure");
-				free(ai);
-				break;
-			}
-
-			break;
+			continue;
 		}
 
-		/* A signal inform that a flow has been de-allocated. */
-		case FLOW_DEALLOCATED_EVENT:
-			port_id = dynamic_cast<FlowDeallocatedEvent*>(
-				event)->portId;
-
-			flow_release(port_id);
+		h = rina_handlers.find(event->eventType);
 
-			ipcManager->flowDeallocated(port_id);
-			break;
-
-		default:
-			break;
+		/* Events nobody is interested in are dropped. */
+		if(h != rina_handlers.end()) {
+			h->second(event, &l);
 		}
 
-	/* Loop only if you have not to stop or to wait. */
-	} while(!rina_list_stop && !async);
+		delete event;
+
+	/* Async calls drain the queue and leave. */
+	} while(!rina_list_stop);
 
 	return 0;
 }
 
+/* IRATI stack, through librina. */
+struct rina_backend rina_irati = {
+	"irati",
+	irati_init,
+	irati_stop,
+	irati_event_fd,
+	irati_read_sdu,
+	irati_write_sdu,
+	irati_read_sdus,
+	irati_write_sdus,
+	irati_flow_fd,
+	irati_async_flow,
+	irati_sync_flow,
+	irati_request_flow,
+	irati_request_flow_async,
+	irati_release_flow,
+	irati_release_flows,
+	0,
+	0,
+	irati_create_AE,
+	irati_release_AE,
+	0,
+	irati_flow_admission,
+	irati_listen_for_events
+};
+
 } /* extern "C" */
@@ -20,6 +20,8 @@
 #ifndef __NORI_RINAW_H
 #define __NORI_RINAW_H
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -74,9 +76,110 @@ struct rina_qos {
 /* Information about a flow. */
 struct rina_AP_info {
 	char name[256];
+	/* DIF the flow comes through; empty if the stack does not tell. */
+	char dif[256];
 	int port;
 };
 
+/*
+ * Backends:
+ */
+
+/* Implementation of the operations below over a given transport. Optional
+ * operations can be left to 0, and a generic version is used instead.
+ */
+struct rina_backend {
+	/* Name used to select it. */
+	const char * name;
+
+	int (* init)(void);
+	int (* stop)(void);
+	int (* event_fd)(void);
+
+	int (* read_sdu)(rina_flow port, char * buffer, unsigned int size);
+	int (* write_sdu)(rina_flow port, char * buffer, unsigned int size);
+	/* Optional; one SDU at a time otherwise. */
+	int (* read_sdus)(rina_flow port, int fd, struct iovec * iov, int n);
+	/* Optional; one SDU at a time otherwise. */
+	int (* write_sdus)(rina_flow port, int fd, struct iovec * iov, int n);
+
+	int (* flow_fd)(rina_flow port);
+	int (* async_flow)(rina_flow port);
+	int (* sync_flow)(rina_flow port);
+
+	rina_flow (* request_flow)(
+		const char * srcn,
+		const char * srci,
+		const char * dstn,
+		const char * dsti,
+		const char * difn,
+		struct rina_qos * qos);
+	int (* request_flow_async)(
+		const char * srcn,
+		const char * srci,
+		const char * dstn,
+		const char * dsti,
+		const char * difn,
+		struct rina_qos * qos);
+	int (* release_flow)(rina_flow port);
+	/* Optional; one flow at a time otherwise. */
+	int (* release_flows)(rina_flow * ports, int n);
+	/* Optional; flows cannot be handed to another process otherwise. */
+	int (* export_flow)(rina_flow port);
+	rina_flow (* import_flow)(int fd);
+
+	int (* create_AE)(
+		const char * name, const char * instance, const char * difn);
+	int (* release_AE)(
+		const char * name, const char * instance, const char * difn);
+	/* Optional; instances cannot be discovered otherwise. */
+	int (* lookup)(
+		const char * name,
+		const char * difn,
+		void (* found)(const char * instance, void * arg),
+		void * arg);
+
+	/* Optional; no limit can be set otherwise. */
+	int (* flow_admission)(unsigned int rate, unsigned int burst);
+	int (* listen_for_events)(
+		void * (* flow_serve)(void * args),
+		void (* flow_release)(int port),
+		void (* flow_ready)(int handle, rina_flow port),
+		int async);
+};
+
+#ifndef NORI_NO_IRATI
+/* IRATI stack. */
+extern struct rina_backend rina_irati;
+#endif
+/* UDP sockets on this host; every AE listens on a port given by its name. */
+extern struct rina_backend rina_udp;
+/* Flows between the AEs of this same process. */
+extern struct rina_backend rina_loop;
+
+/* Backend which moves the flows between AEs of this host through shared
+ * memory, and everything else through 'lower'.
+ */
+struct rina_backend * rina_shm_over(struct rina_backend * lower);
+
+/* Select the backend used by the operations below, by name; to be done
+ * before rina_init. If none is selected IRATI is used, or UDP when built
+ * without IRATI.
+ *
+ * Returns 0 on success, a negative error number if there is no such backend.
+ */
+int rina_backend_use(const char * name);
+
+/* Move the flows between AEs of this host through shared memory, on top of
+ * the backend selected; to be done before rina_init.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int rina_backend_shm(void);
+
+/* Name of the backend in use. */
+const char * rina_backend_name(void);
+
 /*
  * Rina subsystem operations:
  */
@@ -86,42 +189,122 @@ int rina_init(void);
 /* Stop any operation and prepare to close. */
 int rina_stop(void);
 
+/* Descriptor which becomes readable when RINA events are waiting to be
+ * processed by rina_listen_for_events.
+ *
+ * Returns the descriptor, a negative number if not available.
+ */
+int rina_event_fd(void);
+
 /*
  * I/O operations:
  */
 
-/* Read a SDU... */
+/* Read a SDU...
+ *
+ * Returns the bytes read, 0 if a non-blocking flow has nothing, -2 if the
+ * flow is not allocated, another negative number on other errors.
+ */
 int rina_read_sdu(rina_flow port, char * buffer, unsigned int size);
 
-/* Send a SDU somewhere... */
+/* Send a SDU somewhere...
+ *
+ * Returns the bytes sent, 0 if a non-blocking flow has no room, -2 if the
+ * flow is not allocated, another negative number on other errors.
+ */
 int rina_write_sdu(rina_flow port, char * buffer, unsigned int size);
 
+/* Read up to 'n' SDUs, one in each of the given buffers, whose length is
+ * set to the size of the SDU. 'fd' is the descriptor given by rina_flow_fd,
+ * used to read without going through the stack, or negative.
+ *
+ * Returns the number of SDUs read, or what rina_read_sdu returns if the
+ * first one fails; an error after some SDUs is reported by the next call.
+ */
+int rina_read_sdus(rina_flow port, int fd, struct iovec * iov, int n);
+
+/* Send up to 'n' SDUs, one from each of the given buffers. 'fd' is as in
+ * rina_read_sdus.
+ *
+ * Returns the number of SDUs sent, or what rina_write_sdu returns if the
+ * first one fails. On a non-blocking flow the ones after it are not sent.
+ */
+int rina_write_sdus(rina_flow port, int fd, struct iovec * iov, int n);
+
 /*
  * Operations on the single flow:
  */
 
-/* Swap the flow behavior to async. */
+/* Descriptor which becomes readable when SDUs are waiting on the flow.
+ *
+ * Returns the descriptor, a negative number if the stack does not expose one.
+ */
+int rina_flow_fd(rina_flow port);
+
+/* Swap the flow behavior to async; reads and writes do not wait anymore.
+ * Meant to be done once, when the flow is set up.
+ */
 int rina_async_flow(rina_flow port);
 
-/* Request a flow to a certain AE within a DIF. */
+/* Request a flow to a certain AE within a DIF; with no DIF name, the stack
+ * chooses one.
+ */
 rina_flow rina_request_flow(
 	const char * srcn, /* Source info */
 	const char * srci,
 	const char * dstn, /* Destination info */
 	const char * dsti,
+	const char * difn, /* DIF to use, or 0. */
+	struct rina_qos * qos); /* Qos to use. */
+
+/* Request a flow without waiting for the result, which is reported later
+ * by rina_listen_for_events through the given handle.
+ *
+ * Returns the handle of the request, a negative error number on error.
+ */
+int rina_request_flow_async(
+	const char * srcn, /* Source info */
+	const char * srci,
+	const char * dstn, /* Destination info */
+	const char * dsti,
+	const char * difn, /* DIF to use, or 0. */
 	struct rina_qos * qos); /* Qos to use. */
 
 /* Release a previously registered flow. */
 int rina_release_flow(rina_flow port);
 
+/* Release many flows at once, waiting for all of them.
+ *
+ * Returns 0 on success, a negative error number if some failed.
+ */
+int rina_release_flows(rina_flow * ports, int n);
+
 /* Swap the flow behavior to sync. */
 int rina_sync_flow(rina_flow port);
 
+/* Descriptor which carries the flow to another process, to be sent there
+ * with SCM_RIGHTS. It is a new one, which the caller closes once sent, and
+ * stays valid even if the flow is released meanwhile. The flow stays usable
+ * here too, but it must not be released anymore: that would release it for
+ * the other process as well.
+ *
+ * Returns the descriptor, a negative number if the flow cannot leave.
+ */
+int rina_export_flow(rina_flow port);
+
+/* Take a flow exported by another process, given its descriptor.
+ *
+ * Returns the flow, a negative error number on error.
+ */
+rina_flow rina_import_flow(int fd);
+
 /*
  * Operations at AE level:
  */
 
-/* Creates an AE into RINA subsystems. */
+/* Creates an AE into RINA subsystems; called once per DIF, the AE can be
+ * registered in more of them.
+ */
 int rina_create_AE(
 	const char * name, const char * instance, const char * difn);
 
@@ -129,17 +312,39 @@ int rina_create_AE(
 int rina_release_AE(
 	const char * name, const char * instance, const char * difn);
 
+/* Find the instances of an AE which are registered in a DIF, or in any DIF
+ * if no name is given; 'found' is called for each of them, and could be
+ * called more times for the same one.
+ *
+ * Returns 0 on success, a negative error number if the stack cannot tell.
+ */
+int rina_lookup(
+	const char * name,
+	const char * difn,
+	void (* found)(const char * instance, void * arg),
+	void * arg);
+
 /*
  * Main procedure which reacts to RINA events.
  */
 
+/* Limit the flows accepted from remote peers to 'rate' per second, with
+ * bursts of up to 'burst' of them; requests over the limit are refused. A
+ * rate of 0 disables the limit. Call it before listening for events.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int rina_flow_admission(unsigned int rate, unsigned int burst);
+
 /* Listen for important events to occurr within the RINA subsystem. */
 int rina_listen_for_events(
-	/* Serve new flow for this AE. */
+	/* Serve new flow for this AE; runs in one of the accepting threads. */
 	void * (* flow_serve)(void * args),
 	/* React to a flow deallocation. */
 	void (* flow_release)(int port),
-	/* You want async operation? */
+	/* Result of an async allocation; port is negative if it failed. */
+	void (* flow_ready)(int handle, rina_flow port),
+	/* Only process already pending events and return? */
 	int async);
 
 #ifdef __cplusplus
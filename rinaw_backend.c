@@ -0,0 +1,276 @@
+/* Selection of the transport behind rinaw.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rinaw.h"
+
+/* Backends NORI can use. */
+static struct rina_backend * rina_backends[] = {
+#ifndef NORI_NO_IRATI
+	&rina_irati,
+#endif
+	&rina_udp,
+	&rina_loop,
+	0
+};
+
+/* Backend in use. */
+static struct rina_backend * rina_be = 0;
+
+int rina_backend_use(const char * name) {
+	int i = 0;
+
+	for(i = 0; rina_backends[i]; i++) {
+		if(strcmp(rina_backends[i]->name, name) == 0) {
+			rina_be = rina_backends[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int rina_backend_shm(void) {
+	if(!rina_be) {
+		rina_be = rina_backends[0];
+	}
+
+	rina_be = rina_shm_over(rina_be);
+
+	return 0;
+}
+
+const char * rina_backend_name(void) {
+	return rina_be ? rina_be->name : rina_backends[0]->name;
+}
+
+/*
+ * Rina subsystem operations:
+ */
+
+int rina_init(void) {
+	if(!rina_be) {
+		rina_be = rina_backends[0];
+	}
+
+	return rina_be->init();
+}
+
+int rina_stop(void) {
+	/* Could be stopped before anything started. */
+	if(!rina_be) {
+		return 0;
+	}
+
+	return rina_be->stop();
+}
+
+int rina_event_fd(void) {
+	return rina_be->event_fd();
+}
+
+/*
+ * I/O operations:
+ */
+
+int rina_read_sdu(rina_flow port, char * buffer, unsigned int size) {
+	return rina_be->read_sdu(port, buffer, size);
+}
+
+int rina_write_sdu(rina_flow port, char * buffer, unsigned int size) {
+	return rina_be->write_sdu(port, buffer, size);
+}
+
+int rina_read_sdus(rina_flow port, int fd, struct iovec * iov, int n) {
+	int i = 0;
+	int ret = 0;
+
+	if(rina_be->read_sdus) {
+		return rina_be->read_sdus(port, fd, iov, n);
+	}
+
+	for(i = 0; i < n; i++) {
+		ret = rina_be->read_sdu(
+			port, (char *)iov[i].iov_base, iov[i].iov_len);
+
+		if(ret <= 0) {
+			break;
+		}
+
+		iov[i].iov_len = ret;
+	}
+
+	return i > 0 ? i : ret;
+}
+
+int rina_write_sdus(rina_flow port, int fd, struct iovec * iov, int n) {
+	int i = 0;
+	int ret = 0;
+
+	if(rina_be->write_sdus) {
+		return rina_be->write_sdus(port, fd, iov, n);
+	}
+
+	for(i = 0; i < n; i++) {
+		ret = rina_be->write_sdu(
+			port, (char *)iov[i].iov_base, iov[i].iov_len);
+
+		if(ret <= 0) {
+			break;
+		}
+	}
+
+	return i > 0 ? i : ret;
+}
+
+/*
+ * Operations on the single flow:
+ */
+
+int rina_flow_fd(rina_flow port) {
+	return rina_be->flow_fd(port);
+}
+
+int rina_async_flow(rina_flow port) {
+	return rina_be->async_flow(port);
+}
+
+int rina_sync_flow(rina_flow port) {
+	return rina_be->sync_flow(port);
+}
+
+rina_flow rina_request_flow(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn,
+	struct rina_qos * qos) {
+
+	return rina_be->request_flow(srcn, srci, dstn, dsti, difn, qos);
+}
+
+int rina_request_flow_async(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn,
+	struct rina_qos * qos) {
+
+	return rina_be->request_flow_async(
+		srcn, srci, dstn, dsti, difn, qos);
+}
+
+int rina_release_flow(rina_flow port) {
+	return rina_be->release_flow(port);
+}
+
+int rina_release_flows(rina_flow * ports, int n) {
+	int i = 0;
+	int ret = 0;
+
+	if(rina_be->release_flows) {
+		return rina_be->release_flows(ports, n);
+	}
+
+	for(i = 0; i < n; i++) {
+		if(rina_be->release_flow(ports[i])) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int rina_export_flow(rina_flow port) {
+	if(rina_be->export_flow) {
+		return rina_be->export_flow(port);
+	}
+
+	return -1;
+}
+
+rina_flow rina_import_flow(int fd) {
+	if(rina_be->import_flow) {
+		return rina_be->import_flow(fd);
+	}
+
+	return -1;
+}
+
+/*
+ * Operations at AE level:
+ */
+
+int rina_create_AE(
+	const char * name, const char * instance, const char * difn) {
+
+	return rina_be->create_AE(name, instance, difn);
+}
+
+int rina_release_AE(
+	const char * name, const char * instance, const char * difn) {
+
+	return rina_be->release_AE(name, instance, difn);
+}
+
+int rina_lookup(
+	const char * name,
+	const char * difn,
+	void (* found)(const char * instance, void * arg),
+	void * arg) {
+
+	if(rina_be->lookup) {
+		return rina_be->lookup(name, difn, found, arg);
+	}
+
+	printf("Backend %s cannot discover instances\n", rina_be->name);
+	return -1;
+}
+
+/*
+ * Main procedure which reacts to RINA events.
+ */
+
+int rina_flow_admission(unsigned int rate, unsigned int burst) {
+	if(rina_be->flow_admission) {
+		return rina_be->flow_admission(rate, burst);
+	}
+
+	/* No limit is what the backend does anyway. */
+	if(rate == 0) {
+		return 0;
+	}
+
+	printf("Backend %s cannot limit the accepted flows\n", rina_be->name);
+	return -1;
+}
+
+int rina_listen_for_events(
+	void * (* flow_serve)(void * args),
+	void (* flow_release)(int port),
+	void (* flow_ready)(int handle, rina_flow port),
+	int async) {
+
+	return rina_be->listen_for_events(
+		flow_serve, flow_release, flow_ready, async);
+}
@@ -0,0 +1,1288 @@
+/* Shared-memory flows between the NORI instances of a host.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rinaw.h"
+
+/*
+ * Flows between AEs of this host, through shared memory.
+ *
+ * Every AE also listens on an abstract local socket named after it. A flow
+ * request toward an AE which is there is not given to the backend below:
+ * the requester creates a memory segment with two single-producer/single-
+ * consumer rings, one per direction, and two eventfds to wake up the
+ * readers, and passes them on the socket. Packets are copied in and out of
+ * the rings without entering the kernel; a reader is woken up only if it
+ * went to sleep. The socket is kept to notice when a peer leaves.
+ *
+ * Flows to anything else, and all the events of the backend below, go
+ * through as they are.
+ */
+
+/* Local flows at most. */
+#define SHMW_FLOWS		1024
+/* Ports of local flows; out of the way of the backend ones. */
+#define SHMW_PORT_BASE		(1 << 20)
+/* Handles of local requests, as above. */
+#define SHMW_HANDLE_BASE	0x40000000
+/* AEs which can be registered at the same time. */
+#define SHMW_AES		16
+/* Slots of a ring; power of 2. */
+#define SHMW_SLOTS		1024
+/* Size of a slot, including its length; bigger SDUs are dropped. */
+#define SHMW_SLOT_SIZE		2048
+/* Size of huge pages, to round the segment. */
+#define SHMW_HUGE		(2 * 1024 * 1024)
+/* Time waiting for events in a blocking listen, in milliseconds. */
+#define SHMW_TICK		100
+/* Time a released segment stays mapped, in milliseconds. */
+#define SHMW_GRACE		1000
+/* Events processed at once. */
+#define SHMW_EVENTS		16
+/* Identifies a segment of this kind. */
+#define SHMW_MAGIC		0x4e4f5249
+
+/* State of a local flow. */
+#define SHMW_FREE		0
+#define SHMW_PENDING		1
+#define SHMW_UP			2
+#define SHMW_GONE		3
+
+/* What is waited in the epoll set; in the upper half of its data. */
+#define SHMW_EV_LOWER		1
+#define SHMW_EV_QUEUE		2
+#define SHMW_EV_AE		3
+#define SHMW_EV_FLOW		4
+
+/* Size of a cache line, to keep producer and consumer apart. */
+#define SHMW_CACHELINE		64
+
+struct shm_slot {
+	unsigned int size;
+	char data[SHMW_SLOT_SIZE - sizeof(unsigned int)];
+};
+
+/* Ring living in the shared segment; only indexes, no pointers. */
+struct shm_ring {
+	/* Next slot to write; moved by the producer only. */
+	unsigned int head __attribute__((aligned(SHMW_CACHELINE)));
+	/* Next slot to read; moved by the consumer only. */
+	unsigned int tail __attribute__((aligned(SHMW_CACHELINE)));
+	/* Consumer is waiting for a wake up. */
+	int sleeping __attribute__((aligned(SHMW_CACHELINE)));
+
+	struct shm_slot slots[SHMW_SLOTS]
+		__attribute__((aligned(SHMW_CACHELINE)));
+};
+
+/* Shared segment of a flow. */
+struct shm_seg {
+	unsigned int magic;
+	unsigned int slots;
+	unsigned int slot_size;
+
+	/* Requester --> acceptor, and back. */
+	struct shm_ring ring[2];
+};
+
+struct shm_flow {
+	/* One of SHMW_FREE... */
+	int state;
+	/* Socket shared with the peer. */
+	int ctrl;
+	/* Wakes us up when something is there to read. */
+	int rxfd;
+	/* Wakes the peer up. */
+	int txfd;
+	/* Do reads wait? */
+	int sync;
+	/* More threads of this process can write on the flow. */
+	int tx_lock;
+
+	struct shm_seg * seg;
+	size_t len;
+	struct shm_ring * tx;
+	struct shm_ring * rx;
+
+	/* When it was released; monotonic milliseconds. */
+	unsigned long freed;
+};
+
+/* Request sent to the acceptor, along with the descriptors. */
+struct shm_req {
+	unsigned int magic;
+	/* Who asks, as "<name>:<instance>". */
+	char name[256];
+	/* DIF the flow is asked in. */
+	char dif[256];
+};
+
+struct shm_ae {
+	/* Name of the AE and DIF it is registered in, as
+	 * "<name>:<instance>@<dif>"; empty if not used.
+	 */
+	char name[256];
+	/* Where local requests arrive, or negative. */
+	int fd;
+};
+
+/* Result of a local request, reported by the next listen. */
+struct shm_event {
+	int handle;
+	rina_flow port;
+
+	struct shm_event * next;
+};
+
+/* Backend used for everything which is not local. */
+static struct rina_backend * shm_lower = 0;
+/* Name given to this combination. */
+static char shm_name[32];
+/* Stop any blocking listen. */
+static int shm_stop_req = 0;
+
+/* Local flows; the port is SHMW_PORT_BASE plus the index. */
+static struct shm_flow shm_flows[SHMW_FLOWS];
+/* Where to look for the next free slot. */
+static int shm_next = 0;
+/* Released flows whose segment is still mapped. */
+static int shm_stale = 0;
+/* Registered AEs. */
+static struct shm_ae shm_aes[SHMW_AES];
+/* Last request handle given. */
+static unsigned int shm_handles = 0;
+
+/* Results waiting to be reported, oldest first. */
+static struct shm_event * shm_evq = 0;
+static struct shm_event ** shm_evq_tail = &shm_evq;
+/* Signals queued results. */
+static int shm_evfd = -1;
+/* Everything which can wake up the listener. */
+static int shm_epfd = -1;
+
+/* Protects flows, AEs and the event queue. */
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Monotonic clock in milliseconds. */
+static unsigned long shm_now(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* Is it a local flow? */
+static int shm_local(rina_flow port) {
+	return port >= SHMW_PORT_BASE && port < SHMW_PORT_BASE + SHMW_FLOWS;
+}
+
+/* Local flow of a port. */
+static struct shm_flow * shm_flow(rina_flow port) {
+	return &shm_flows[port - SHMW_PORT_BASE];
+}
+
+/* Name of an AE within a DIF, which is where it listens. */
+static void shm_ae_name(char * ae, int size,
+	const char * name, const char * instance, const char * difn) {
+
+	snprintf(ae, size, "%s:%s@%s", name, instance, difn ? difn : "");
+}
+
+/* Address where a local AE listens; one per DIF it is registered in, so
+ * local flows stay within the DIF asked.
+ */
+static socklen_t shm_ae_addr(const char * name, struct sockaddr_un * sa) {
+	memset(sa, 0, sizeof(struct sockaddr_un));
+	sa->sun_family = AF_UNIX;
+
+	/* Abstract name: first byte left to 0. */
+	snprintf(sa->sun_path + 1, sizeof(sa->sun_path) - 1,
+		"nori-shm/%s", name);
+
+	return offsetof(struct sockaddr_un, sun_path) + 1 +
+		strlen(sa->sun_path + 1);
+}
+
+/* Add a descriptor to the listener ones. */
+static int shm_watch(int fd, unsigned int what, unsigned int idx) {
+	struct epoll_event ev = {0};
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t)what << 32) | idx;
+
+	return epoll_ctl(shm_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Take a free flow slot; shm_lock held.
+ *
+ * Returns the port, a negative error number if there are no free ones.
+ */
+static int shm_flow_get(void) {
+	int i = 0;
+	int p = 0;
+
+	for(i = 0; i < SHMW_FLOWS; i++) {
+		p = (shm_next + i) % SHMW_FLOWS;
+
+		/* Not the ones which could still be in use. */
+		if(shm_flows[p].state == SHMW_FREE && !shm_flows[p].seg) {
+			memset(&shm_flows[p], 0, sizeof(struct shm_flow));
+
+			shm_flows[p].ctrl = -1;
+			shm_flows[p].rxfd = -1;
+			shm_flows[p].txfd = -1;
+			shm_flows[p].state = SHMW_PENDING;
+			shm_next = (p + 1) % SHMW_FLOWS;
+
+			return SHMW_PORT_BASE + p;
+		}
+	}
+
+	return -1;
+}
+
+/* Let a local flow go with all its resources; shm_lock held. */
+static void shm_flow_put(rina_flow port) {
+	struct shm_flow * f = shm_flow(port);
+
+	if(f->ctrl >= 0) {
+		epoll_ctl(shm_epfd, EPOLL_CTL_DEL, f->ctrl, 0);
+		close(f->ctrl);
+	}
+
+	if(f->rxfd >= 0) {
+		close(f->rxfd);
+	}
+
+	if(f->txfd >= 0) {
+		close(f->txfd);
+	}
+
+	/* The dataplane could be still on it; unmapped later. */
+	if(f->seg) {
+		f->freed = shm_now();
+		shm_stale++;
+	}
+
+	f->ctrl = -1;
+	f->rxfd = -1;
+	f->txfd = -1;
+
+	__atomic_store_n(&f->state, SHMW_FREE, __ATOMIC_RELEASE);
+}
+
+/* Unmap the segments released long enough ago. */
+static void shm_unmap_stale(void) {
+	unsigned long now = 0;
+	int i = 0;
+
+	if(!shm_stale) {
+		return;
+	}
+
+	now = shm_now();
+
+	pthread_mutex_lock(&shm_lock);
+
+	for(i = 0; i < SHMW_FLOWS; i++) {
+		if(shm_flows[i].state != SHMW_FREE || !shm_flows[i].seg ||
+			shm_flows[i].freed + SHMW_GRACE > now) {
+
+			continue;
+		}
+
+		munmap(shm_flows[i].seg, shm_flows[i].len);
+		shm_flows[i].seg = 0;
+		shm_stale--;
+	}
+
+	pthread_mutex_unlock(&shm_lock);
+}
+
+/* Map the segment of a flow and set its direction.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int shm_flow_map(struct shm_flow * f, int fd, int acceptor) {
+	struct stat st;
+
+	if(fstat(fd, &st) || st.st_size < sizeof(struct shm_seg)) {
+		return -1;
+	}
+
+	f->len = st.st_size;
+	f->seg = mmap(0, f->len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, 0);
+
+	if(f->seg == MAP_FAILED) {
+		f->seg = 0;
+		return -1;
+	}
+
+	if(f->seg->magic != SHMW_MAGIC ||
+		f->seg->slots != SHMW_SLOTS ||
+		f->seg->slot_size != SHMW_SLOT_SIZE) {
+
+		return -1;
+	}
+
+	f->tx = &f->seg->ring[acceptor ? 1 : 0];
+	f->rx = &f->seg->ring[acceptor ? 0 : 1];
+
+	return 0;
+}
+
+/* Create a segment of 'len' bytes with the given memfd flags.
+ *
+ * Returns its descriptor, a negative error number on error.
+ */
+static int shm_seg_try(size_t len, unsigned int flags) {
+	struct shm_seg * seg = 0;
+	int fd = memfd_create("nori-shm", MFD_CLOEXEC | flags);
+
+	if(fd < 0) {
+		return -1;
+	}
+
+	/* Huge pages could be not reserved: mapping is what tells. */
+	if(ftruncate(fd, len) || (seg = mmap(0, len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+
+		close(fd);
+		return -1;
+	}
+
+	/* Readers sleep until told otherwise. */
+	seg->magic = SHMW_MAGIC;
+	seg->slots = SHMW_SLOTS;
+	seg->slot_size = SHMW_SLOT_SIZE;
+	seg->ring[0].sleeping = 1;
+	seg->ring[1].sleeping = 1;
+
+	munmap(seg, len);
+
+	return fd;
+}
+
+/* Create the segment of a new flow, on huge pages if possible.
+ *
+ * Returns its descriptor, a negative error number on error.
+ */
+static int shm_seg_create(void) {
+	size_t len = sizeof(struct shm_seg);
+	int fd = shm_seg_try(
+		(len + SHMW_HUGE - 1) / SHMW_HUGE * SHMW_HUGE, MFD_HUGETLB);
+
+	if(fd < 0) {
+		fd = shm_seg_try(len, 0);
+	}
+
+	return fd;
+}
+
+/* Queue the result of a local request for the listener.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int shm_post(int handle, rina_flow port) {
+	struct shm_event * e = malloc(sizeof(struct shm_event));
+
+	if(!e) {
+		return -1;
+	}
+
+	e->handle = handle;
+	e->port = port;
+	e->next = 0;
+
+	pthread_mutex_lock(&shm_lock);
+	*shm_evq_tail = e;
+	shm_evq_tail = &e->next;
+	pthread_mutex_unlock(&shm_lock);
+
+	eventfd_write(shm_evfd, 1);
+
+	return 0;
+}
+
+/*
+ * Rina subsystem operations:
+ */
+
+static int shm_init(void) {
+	int i = 0;
+
+	for(i = 0; i < SHMW_AES; i++) {
+		shm_aes[i].fd = -1;
+	}
+
+	if(shm_lower->init()) {
+		return -1;
+	}
+
+	shm_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	shm_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if(shm_evfd < 0 || shm_epfd < 0) {
+		return -1;
+	}
+
+	if(shm_watch(shm_evfd, SHMW_EV_QUEUE, 0)) {
+		return -1;
+	}
+
+	/* Its events wake up the listener too, if it has a descriptor. */
+	if(shm_lower->event_fd() >= 0 &&
+		shm_watch(shm_lower->event_fd(), SHMW_EV_LOWER, 0)) {
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static int shm_stop(void) {
+	shm_stop_req = 1;
+	return shm_lower->stop();
+}
+
+static int shm_event_fd(void) {
+	return shm_epfd;
+}
+
+/*
+ * I/O operations:
+ */
+
+/* Take SDUs out of the ring of a local flow. */
+static int shm_read(struct shm_flow * f, struct iovec * iov, int n) {
+	struct shm_ring * r = f->rx;
+	struct shm_slot * s = 0;
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned int tail = r->tail;
+	unsigned int size = 0;
+	eventfd_t cnt = 0;
+	int i = 0;
+
+	for(i = 0; i < n && tail != head; i++, tail++) {
+		s = &r->slots[tail & (SHMW_SLOTS - 1)];
+		size = s->size;
+
+		/* Never trust the peer with sizes. */
+		if(size > iov[i].iov_len || size > sizeof(s->data)) {
+			size = iov[i].iov_len < sizeof(s->data) ?
+				iov[i].iov_len : sizeof(s->data);
+		}
+
+		memcpy(iov[i].iov_base, s->data, size);
+		iov[i].iov_len = size;
+	}
+
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+	/* Maybe more is there: keep the wake up armed. */
+	if(i == n) {
+		return i;
+	}
+
+	/* Empty: go to sleep, unless something arrived meanwhile. */
+	eventfd_read(f->rxfd, &cnt);
+	__atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != tail) {
+		eventfd_write(f->rxfd, 1);
+	}
+
+	return i;
+}
+
+/* Put SDUs in the ring of a local flow. */
+static int shm_write(struct shm_flow * f, struct iovec * iov, int n) {
+	struct shm_ring * r = f->tx;
+	struct shm_slot * s = 0;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	int i = 0;
+
+	while(__atomic_test_and_set(&f->tx_lock, __ATOMIC_ACQUIRE));
+
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	for(i = 0; i < n && head - tail < SHMW_SLOTS; i++, head++) {
+		/* Would not fit; lost as if the flow was full. */
+		if(iov[i].iov_len > sizeof(s->data)) {
+			break;
+		}
+
+		s = &r->slots[head & (SHMW_SLOTS - 1)];
+		s->size = iov[i].iov_len;
+		memcpy(s->data, iov[i].iov_base, s->size);
+	}
+
+	__atomic_store_n(&r->head, head, __ATOMIC_SEQ_CST);
+
+	__atomic_clear(&f->tx_lock, __ATOMIC_RELEASE);
+
+	/* Wake the reader up once, if it sleeps; the line is only read while
+	 * it is busy.
+	 */
+	if(i > 0 && __atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST) &&
+		__atomic_exchange_n(&r->sleeping, 0, __ATOMIC_SEQ_CST)) {
+
+		eventfd_write(f->txfd, 1);
+	}
+
+	return i;
+}
+
+static int shm_read_sdus(rina_flow port, int fd, struct iovec * iov, int n) {
+	struct shm_flow * f = 0;
+	struct pollfd p = {0};
+	int ret = 0;
+
+	if(!shm_local(port)) {
+		if(shm_lower->read_sdus) {
+			return shm_lower->read_sdus(port, fd, iov, n);
+		}
+
+		ret = shm_lower->read_sdu(
+			port, (char *)iov[0].iov_base, iov[0].iov_len);
+
+		if(ret > 0) {
+			iov[0].iov_len = ret;
+			return 1;
+		}
+
+		return ret;
+	}
+
+	f = shm_flow(port);
+
+	if(__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != SHMW_UP) {
+		return -2;
+	}
+
+	for(;;) {
+		ret = shm_read(f, iov, n);
+
+		if(ret > 0 || !f->sync) {
+			return ret;
+		}
+
+		p.fd = f->rxfd;
+		p.events = POLLIN;
+
+		if(poll(&p, 1, -1) < 0) {
+			return -1;
+		}
+	}
+}
+
+static int shm_write_sdus(rina_flow port, int fd, struct iovec * iov, int n) {
+	struct shm_flow * f = 0;
+	int ret = 0;
+
+	if(!shm_local(port)) {
+		if(shm_lower->write_sdus) {
+			return shm_lower->write_sdus(port, fd, iov, n);
+		}
+
+		ret = shm_lower->write_sdu(
+			port, (char *)iov[0].iov_base, iov[0].iov_len);
+
+		return ret > 0 ? 1 : ret;
+	}
+
+	f = shm_flow(port);
+
+	if(__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != SHMW_UP) {
+		return -2;
+	}
+
+	return shm_write(f, iov, n);
+}
+
+static int shm_read_sdu(rina_flow port, char * buffer, unsigned int size) {
+	struct iovec iov = {buffer, size};
+	int ret = 0;
+
+	if(!shm_local(port)) {
+		return shm_lower->read_sdu(port, buffer, size);
+	}
+
+	ret = shm_read_sdus(port, -1, &iov, 1);
+
+	return ret > 0 ? (int)iov.iov_len : ret;
+}
+
+static int shm_write_sdu(rina_flow port, char * buffer, unsigned int size) {
+	struct iovec iov = {buffer, size};
+	int ret = 0;
+
+	if(!shm_local(port)) {
+		return shm_lower->write_sdu(port, buffer, size);
+	}
+
+	ret = shm_write_sdus(port, -1, &iov, 1);
+
+	return ret > 0 ? (int)size : ret;
+}
+
+/*
+ * Operations on the single flow:
+ */
+
+static int shm_flow_fd(rina_flow port) {
+	if(!shm_local(port)) {
+		return shm_lower->flow_fd(port);
+	}
+
+	return shm_flow(port)->rxfd;
+}
+
+static int shm_async_flow(rina_flow port) {
+	if(!shm_local(port)) {
+		return shm_lower->async_flow(port);
+	}
+
+	shm_flow(port)->sync = 0;
+	return 0;
+}
+
+static int shm_sync_flow(rina_flow port) {
+	if(!shm_local(port)) {
+		return shm_lower->sync_flow(port);
+	}
+
+	shm_flow(port)->sync = 1;
+	return 0;
+}
+
+/* Set up a flow with an AE of this host.
+ *
+ * Returns the port, -2 if the AE is not on this host, another negative
+ * error number on error.
+ */
+static int shm_request(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn) {
+
+	struct sockaddr_un sa;
+	struct shm_req req;
+	struct shm_flow * f = 0;
+	struct msghdr msg = {0};
+	struct iovec iov = {&req, sizeof(req)};
+	struct cmsghdr * cm = 0;
+
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	char dst[256];
+	int fds[3] = {-1, -1, -1};
+	int ctrl = -1;
+	int port = -1;
+
+	shm_ae_name(dst, sizeof(dst), dstn, dsti, difn);
+
+	ctrl = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	if(ctrl < 0) {
+		return -1;
+	}
+
+	/* Nobody on this host; not for us. */
+	if(connect(ctrl, (struct sockaddr *)&sa, shm_ae_addr(dst, &sa))) {
+		close(ctrl);
+		return -2;
+	}
+
+	pthread_mutex_lock(&shm_lock);
+	port = shm_flow_get();
+	pthread_mutex_unlock(&shm_lock);
+
+	if(port < 0) {
+		close(ctrl);
+		return -1;
+	}
+
+	f = shm_flow(port);
+	f->ctrl = ctrl;
+
+	fds[0] = shm_seg_create();
+	/* Wakes up the acceptor, and us. */
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	f->txfd = fds[1];
+	f->rxfd = fds[2];
+
+	if(fds[0] < 0 || fds[1] < 0 || fds[2] < 0) {
+		goto err;
+	}
+
+	if(shm_flow_map(f, fds[0], 0)) {
+		goto err;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.magic = SHMW_MAGIC;
+	snprintf(req.name, sizeof(req.name), "%s:%s", srcn, srci);
+	snprintf(req.dif, sizeof(req.dif), "%s", difn ? difn : "");
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, 3 * sizeof(int));
+
+	if(sendmsg(ctrl, &msg, MSG_NOSIGNAL) < 0) {
+		goto err;
+	}
+
+	/* Acceptor has its own copy now. */
+	close(fds[0]);
+	fds[0] = -1;
+
+	if(shm_watch(ctrl, SHMW_EV_FLOW, port - SHMW_PORT_BASE)) {
+		goto err;
+	}
+
+	/* Usable at once; what is written waits for the acceptor. */
+	__atomic_store_n(&f->state, SHMW_UP, __ATOMIC_RELEASE);
+
+	return port;
+
+err:
+	if(fds[0] >= 0) {
+		close(fds[0]);
+	}
+
+	pthread_mutex_lock(&shm_lock);
+	shm_flow_put(port);
+	pthread_mutex_unlock(&shm_lock);
+
+	return -1;
+}
+
+static rina_flow shm_request_flow(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn,
+	struct rina_qos * qos) {
+
+	int port = shm_request(srcn, srci, dstn, dsti, difn);
+
+	if(port != -2) {
+		return port;
+	}
+
+	return shm_lower->request_flow(srcn, srci, dstn, dsti, difn, qos);
+}
+
+static int shm_request_flow_async(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn,
+	struct rina_qos * qos) {
+
+	int port = shm_request(srcn, srci, dstn, dsti, difn);
+	int handle = 0;
+
+	if(port == -2) {
+		return shm_lower->request_flow_async(
+			srcn, srci, dstn, dsti, difn, qos);
+	}
+
+	handle = SHMW_HANDLE_BASE | (int)(__atomic_add_fetch(
+		&shm_handles, 1, __ATOMIC_RELAXED) & (SHMW_HANDLE_BASE - 1));
+
+	/* Reported as for the others, even if known already. */
+	if(shm_post(handle, port)) {
+		if(port >= 0) {
+			pthread_mutex_lock(&shm_lock);
+			shm_flow_put(port);
+			pthread_mutex_unlock(&shm_lock);
+		}
+
+		return -1;
+	}
+
+	return handle;
+}
+
+static int shm_release_flow(rina_flow port) {
+	if(!shm_local(port)) {
+		return shm_lower->release_flow(port);
+	}
+
+	pthread_mutex_lock(&shm_lock);
+
+	if(shm_flow(port)->state == SHMW_FREE) {
+		pthread_mutex_unlock(&shm_lock);
+		return -1;
+	}
+
+	/* The peer sees the socket closing. */
+	shm_flow_put(port);
+
+	pthread_mutex_unlock(&shm_lock);
+
+	return 0;
+}
+
+static int shm_release_flows(rina_flow * ports, int n) {
+	rina_flow * lower = malloc(sizeof(rina_flow) * n);
+	int nl = 0;
+	int ret = 0;
+	int i = 0;
+
+	if(!lower) {
+		return -1;
+	}
+
+	for(i = 0; i < n; i++) {
+		if(shm_local(ports[i])) {
+			if(shm_release_flow(ports[i])) {
+				ret = -1;
+			}
+		} else {
+			lower[nl++] = ports[i];
+		}
+	}
+
+	/* The others still go all together, if the backend can. */
+	if(nl > 0 && shm_lower->release_flows) {
+		if(shm_lower->release_flows(lower, nl)) {
+			ret = -1;
+		}
+	} else {
+		for(i = 0; i < nl; i++) {
+			if(shm_lower->release_flow(lower[i])) {
+				ret = -1;
+			}
+		}
+	}
+
+	free(lower);
+
+	return ret;
+}
+
+/* Local flows live in the segment of this process; they cannot leave. */
+static int shm_export_flow(rina_flow port) {
+	if(shm_local(port) || !shm_lower->export_flow) {
+		return -1;
+	}
+
+	return shm_lower->export_flow(port);
+}
+
+static rina_flow shm_import_flow(int fd) {
+	if(!shm_lower->import_flow) {
+		return -1;
+	}
+
+	return shm_lower->import_flow(fd);
+}
+
+/*
+ * Operations at AE level:
+ */
+
+static int shm_create_AE(
+	const char * name, const char * instance, const char * difn) {
+
+	struct sockaddr_un sa;
+	char ae[256];
+	int fd = -1;
+	int i = 0;
+
+	if(shm_lower->create_AE(name, instance, difn)) {
+		return -1;
+	}
+
+	shm_ae_name(ae, sizeof(ae), name, instance, difn);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+	/* Still reachable through the backend below. */
+	if(fd < 0 ||
+		bind(fd, (struct sockaddr *)&sa, shm_ae_addr(ae, &sa)) ||
+		listen(fd, SOMAXCONN)) {
+
+		printf("%s not reachable through shared memory\n", ae);
+
+		if(fd >= 0) {
+			close(fd);
+		}
+
+		return 0;
+	}
+
+	pthread_mutex_lock(&shm_lock);
+
+	for(i = 0; i < SHMW_AES; i++) {
+		if(!shm_aes[i].name[0]) {
+			break;
+		}
+	}
+
+	if(i == SHMW_AES || shm_watch(fd, SHMW_EV_AE, i)) {
+		pthread_mutex_unlock(&shm_lock);
+
+		printf("%s not reachable through shared memory\n", ae);
+		close(fd);
+
+		return 0;
+	}
+
+	strcpy(shm_aes[i].name, ae);
+	shm_aes[i].fd = fd;
+
+	pthread_mutex_unlock(&shm_lock);
+
+	return 0;
+}
+
+static int shm_release_AE(
+	const char * name, const char * instance, const char * difn) {
+
+	char ae[256];
+	int i = 0;
+
+	shm_ae_name(ae, sizeof(ae), name, instance, difn);
+
+	pthread_mutex_lock(&shm_lock);
+
+	for(i = 0; i < SHMW_AES; i++) {
+		if(shm_aes[i].name[0] && strcmp(shm_aes[i].name, ae) == 0) {
+			close(shm_aes[i].fd);
+
+			shm_aes[i].name[0] = 0;
+			shm_aes[i].fd = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&shm_lock);
+
+	return shm_lower->release_AE(name, instance, difn);
+}
+
+static int shm_lookup(
+	const char * name,
+	const char * difn,
+	void (* found)(const char * instance, void * arg),
+	void * arg) {
+
+	/* Local AEs are registered below too. */
+	if(!shm_lower->lookup) {
+		return -1;
+	}
+
+	return shm_lower->lookup(name, difn, found, arg);
+}
+
+/*
+ * Main procedure which reacts to events.
+ */
+
+static int shm_flow_admission(unsigned int rate, unsigned int burst) {
+	/* Local flows are not limited. */
+	if(shm_lower->flow_admission) {
+		return shm_lower->flow_admission(rate, burst);
+	}
+
+	return rate ? -1 : 0;
+}
+
+/* Someone of this host asks one of our AEs for a flow. */
+static void shm_accept(int ae) {
+	int fd = accept4(shm_aes[ae].fd, 0, 0, SOCK_CLOEXEC);
+	int port = -1;
+
+	if(fd < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&shm_lock);
+	port = shm_flow_get();
+	pthread_mutex_unlock(&shm_lock);
+
+	if(port < 0) {
+		close(fd);
+		return;
+	}
+
+	shm_flow(port)->ctrl = fd;
+
+	/* Its request comes on the socket. */
+	if(shm_watch(fd, SHMW_EV_FLOW, port - SHMW_PORT_BASE)) {
+		pthread_mutex_lock(&shm_lock);
+		shm_flow_put(port);
+		pthread_mutex_unlock(&shm_lock);
+	}
+}
+
+/* Take the request of a peer and serve the flow.
+ *
+ * Returns 0 on success, 1 if the request is not there yet, a negative error
+ * number on error.
+ */
+static int shm_serve(rina_flow port, void * (* flow_serve)(void * args)) {
+	struct shm_flow * f = shm_flow(port);
+	struct rina_AP_info * ai = 0;
+	struct shm_req req;
+	struct msghdr msg = {0};
+	struct iovec iov = {&req, sizeof(req)};
+	struct cmsghdr * cm = 0;
+
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	int fds[3] = {-1, -1, -1};
+	ssize_t ret = 0;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ret = recvmsg(f->ctrl, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+
+	if(ret < 0 && errno == EAGAIN) {
+		return 1;
+	}
+
+	if(ret != sizeof(req)) {
+		return -1;
+	}
+
+	cm = CMSG_FIRSTHDR(&msg);
+
+	if(!cm || cm->cmsg_type != SCM_RIGHTS ||
+		cm->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+
+		return -1;
+	}
+
+	memcpy(fds, CMSG_DATA(cm), 3 * sizeof(int));
+
+	/* Directions are the other way around here. */
+	f->rxfd = fds[1];
+	f->txfd = fds[2];
+
+	if(req.magic == SHMW_MAGIC && !shm_flow_map(f, fds[0], 1)) {
+		ai = malloc(sizeof(struct rina_AP_info));
+	}
+
+	close(fds[0]);
+
+	if(!ai) {
+		return -1;
+	}
+
+	req.name[sizeof(req.name) - 1] = 0;
+	req.dif[sizeof(req.dif) - 1] = 0;
+	snprintf(ai->name, sizeof(ai->name), "%s", req.name);
+	snprintf(ai->dif, sizeof(ai->dif), "%s", req.dif);
+	ai->port = port;
+
+	__atomic_store_n(&f->state, SHMW_UP, __ATOMIC_RELEASE);
+
+	flow_serve(ai);
+
+	return 0;
+}
+
+/* Something happened on the socket of a local flow. */
+static void shm_flow_event(
+	rina_flow port,
+	void * (* flow_serve)(void * args),
+	void (* flow_release)(int port)) {
+
+	struct shm_flow * f = shm_flow(port);
+	char c = 0;
+
+	/* Request of the peer, the first time. */
+	if(f->state == SHMW_PENDING) {
+		if(shm_serve(port, flow_serve) < 0) {
+			pthread_mutex_lock(&shm_lock);
+			shm_flow_put(port);
+			pthread_mutex_unlock(&shm_lock);
+		}
+
+		return;
+	}
+
+	pthread_mutex_lock(&shm_lock);
+
+	/* Nothing else is sent: the peer has left. Events of flows which
+	 * have been released meanwhile are not interesting.
+	 */
+	if(f->state != SHMW_UP ||
+		(recv(f->ctrl, &c, 1, MSG_DONTWAIT) < 0 && errno == EAGAIN)) {
+
+		pthread_mutex_unlock(&shm_lock);
+		return;
+	}
+
+	__atomic_store_n(&f->state, SHMW_GONE, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&shm_lock);
+
+	flow_release(port);
+
+	pthread_mutex_lock(&shm_lock);
+
+	/* Unless it has been released by NORI in the meantime. */
+	if(f->state == SHMW_GONE) {
+		shm_flow_put(port);
+	}
+
+	pthread_mutex_unlock(&shm_lock);
+}
+
+/* Report the results of local requests. */
+static void shm_dispatch(void (* flow_ready)(int handle, rina_flow port)) {
+	struct shm_event * e = 0;
+	struct shm_event * next = 0;
+	eventfd_t cnt = 0;
+
+	eventfd_read(shm_evfd, &cnt);
+
+	pthread_mutex_lock(&shm_lock);
+	e = shm_evq;
+	shm_evq = 0;
+	shm_evq_tail = &shm_evq;
+	pthread_mutex_unlock(&shm_lock);
+
+	for(; e; e = next) {
+		next = e->next;
+		flow_ready(e->handle, e->port);
+		free(e);
+	}
+}
+
+static int shm_listen_for_events(
+	void * (* flow_serve)(void * args),
+	void (* flow_release)(int port),
+	void (* flow_ready)(int handle, rina_flow port),
+	int async) {
+
+	struct epoll_event evs[SHMW_EVENTS];
+	unsigned int idx = 0;
+	int n = 0;
+	int i = 0;
+
+	do {
+		/* Consume what is already there if async, otherwise wait. */
+		n = epoll_wait(shm_epfd, evs, SHMW_EVENTS,
+			async ? 0 : SHMW_TICK);
+
+		for(i = 0; i < n; i++) {
+			idx = (unsigned int)evs[i].data.u64;
+
+			switch(evs[i].data.u64 >> 32) {
+			case SHMW_EV_QUEUE:
+				shm_dispatch(flow_ready);
+				break;
+			case SHMW_EV_AE:
+				shm_accept(idx);
+				break;
+			case SHMW_EV_FLOW:
+				shm_flow_event(SHMW_PORT_BASE + idx,
+					flow_serve, flow_release);
+				break;
+			}
+		}
+
+		shm_unmap_stale();
+
+		/* The backend below keeps its own timers; give it a go. */
+		shm_lower->listen_for_events(
+			flow_serve, flow_release, flow_ready, 1);
+
+		/* Async calls drain what is there and leave. */
+		if(async && n <= 0) {
+			break;
+		}
+	} while(!shm_stop_req);
+
+	return 0;
+}
+
+/* Local flows, with everything else to the backend below. */
+static struct rina_backend rina_shm = {
+	shm_name,
+	shm_init,
+	shm_stop,
+	shm_event_fd,
+	shm_read_sdu,
+	shm_write_sdu,
+	shm_read_sdus,
+	shm_write_sdus,
+	shm_flow_fd,
+	shm_async_flow,
+	shm_sync_flow,
+	shm_request_flow,
+	shm_request_flow_async,
+	shm_release_flow,
+	shm_release_flows,
+	shm_export_flow,
+	shm_import_flow,
+	shm_create_AE,
+	shm_release_AE,
+	shm_lookup,
+	shm_flow_admission,
+	shm_listen_for_events
+};
+
+struct rina_backend * rina_shm_over(struct rina_backend * lower) {
+	shm_lower = lower;
+	snprintf(shm_name, sizeof(shm_name), "%s+shm", lower->name);
+
+	return &rina_shm;
+}
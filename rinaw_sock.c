@@ -0,0 +1,1478 @@
+/* Socket backends of rinaw: UDP and in-process loopback.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "epoch.h"
+#include "rinaw.h"
+
+/*
+ * Flows of these backends are datagram sockets: a connected pair of UDP
+ * sockets, or the two ends of a local socket pair. Every datagram starts
+ * with one byte which tells data from the few control messages, which are
+ * needed to set up and tear down flows over UDP. The flow descriptor is the
+ * socket itself, so the dataplane waits on it and moves SDUs with
+ * recvmmsg/sendmmsg, without going through this file. Since the dataplane
+ * takes no lock, the socket of a released flow is closed, and its port
+ * given again, only once no reader of the epoch module can be using it.
+ *
+ * Over UDP, an AE also holds an abstract unix socket for every DIF it is
+ * registered in, named after both. They are the directory of this host:
+ * listed in /proc/net/unix, and gone with the process which holds them.
+ */
+
+/* Flows at most; ports go from 1 to SOCKW_FLOWS - 1. */
+#define SOCKW_FLOWS		4096
+/* AEs which can be registered at the same time. */
+#define SOCKW_AES		16
+/* DIFs a single AE can be registered in. */
+#define SOCKW_AE_DIFS		8
+/* Longest DIF name kept. */
+#define SOCKW_DIF_SIZE		64
+/* UDP port of an AE is this plus the hash of its name within the range. */
+#define SOCKW_PORT_BASE		20000
+#define SOCKW_PORT_RANGE	10000
+/* Time given to a peer to answer a flow request, in milliseconds. */
+#define SOCKW_TIMEOUT		1000
+/* Time waiting for events in a blocking listen, in milliseconds. */
+#define SOCKW_TICK		100
+/* Events processed at once. */
+#define SOCKW_EVENTS		16
+/* Largest control message. */
+#define SOCKW_CTRL_SIZE		(3 * 256 + 1)
+/* SDUs moved with a single call. */
+#define SOCKW_BURST		64
+
+/* Kind of datagram, in its first byte. */
+#define SOCKW_DATA		0
+#define SOCKW_REQ		1
+#define SOCKW_ACK		2
+#define SOCKW_NACK		3
+#define SOCKW_BYE		4
+
+/* State of a flow slot. */
+#define SOCKW_FREE		0
+#define SOCKW_PENDING		1
+#define SOCKW_UP		2
+#define SOCKW_GONE		3
+/* Released, waiting for the dataplane to be done with it. */
+#define SOCKW_CLOSING		4
+
+/* What is waited in the epoll set; in the upper half of its data. */
+#define SOCKW_EV_QUEUE		1
+#define SOCKW_EV_AE		2
+#define SOCKW_EV_PENDING	3
+
+/* Kind of events queued for rina_listen_for_events. */
+#define SOCKW_Q_SERVE		0
+#define SOCKW_Q_READY		1
+#define SOCKW_Q_GONE		2
+
+struct sock_flow {
+	/* Socket of the flow, or negative. */
+	int fd;
+	/* One of SOCKW_FREE... */
+	int state;
+	/* Handle of the async request which created it. */
+	int handle;
+	/* When a pending request is given up; monotonic milliseconds. */
+	unsigned long deadline;
+	/* Retired once released. */
+	struct ep_node ep;
+};
+
+struct sock_ae {
+	/* Name of the AE, as "<name>:<instance>"; empty if not used. */
+	char name[256];
+	/* Where it listens for flow requests over UDP, or negative. */
+	int fd;
+	/* DIFs it is registered in; an empty name stands for any DIF. */
+	char difs[SOCKW_AE_DIFS][SOCKW_DIF_SIZE];
+	/* Entry in the directory for each DIF above, or negative. */
+	int dirs[SOCKW_AE_DIFS];
+	/* Number of DIFs above. */
+	int ndifs;
+};
+
+/* Event waiting to be reported to NORI. */
+struct sock_event {
+	int type;
+	int handle;
+	rina_flow port;
+	/* Info about a served flow, given to NORI. */
+	struct rina_AP_info * ai;
+
+	struct sock_event * next;
+};
+
+/* Flows over UDP, or inside this process? */
+static int sock_udp = 0;
+/* Stop any blocking listen. */
+static int sock_stop_req = 0;
+
+/* Known flows, indexed by port. */
+static struct sock_flow sock_flows[SOCKW_FLOWS];
+/* Where to look for the next free slot. */
+static int sock_next = 1;
+/* Pending requests, to expire them. */
+static int sock_pending = 0;
+/* Registered AEs. */
+static struct sock_ae sock_aes[SOCKW_AES];
+/* Last request handle given. */
+static unsigned int sock_handles = 0;
+
+/* Events reported by the next listen, oldest first. */
+static struct sock_event * sock_evq = 0;
+static struct sock_event ** sock_evq_tail = &sock_evq;
+/* Signals queued events. */
+static int sock_evfd = -1;
+/* Everything which can wake up the listener. */
+static int sock_epfd = -1;
+
+/* Protects flows, AEs and the event queue. */
+static pthread_mutex_t sock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Monotonic clock in milliseconds. */
+static unsigned long sock_now(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* Address of an AE over UDP; always on this host. */
+static void sock_ae_addr(
+	const char * name, const char * instance, struct sockaddr_in * sa) {
+
+	unsigned int h = 5381;
+	const char * c = 0;
+
+	for(c = name; *c; c++) {
+		h = h * 33 + (unsigned char)*c;
+	}
+
+	h = h * 33 + ':';
+
+	for(c = instance; *c; c++) {
+		h = h * 33 + (unsigned char)*c;
+	}
+
+	memset(sa, 0, sizeof(struct sockaddr_in));
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa->sin_port = htons(SOCKW_PORT_BASE + h % SOCKW_PORT_RANGE);
+}
+
+/* Take a free flow slot; sock_lock held.
+ *
+ * Returns the port, a negative error number if there are no free ones.
+ */
+static int sock_flow_get(int fd, int state) {
+	int i = 0;
+	int p = 0;
+
+	for(i = 1; i < SOCKW_FLOWS; i++) {
+		p = (sock_next + i - 2) % (SOCKW_FLOWS - 1) + 1;
+
+		if(sock_flows[p].state == SOCKW_FREE) {
+			sock_flows[p].fd = fd;
+			sock_flows[p].state = state;
+			sock_next = p % (SOCKW_FLOWS - 1) + 1;
+
+			return p;
+		}
+	}
+
+	return -1;
+}
+
+/* Close the socket of a released flow and free its slot; nobody can use
+ * them anymore.
+ */
+static void sock_flow_free(struct ep_node * n) {
+	struct sock_flow * f = (struct sock_flow *)
+		((char *)n - offsetof(struct sock_flow, ep));
+
+	pthread_mutex_lock(&sock_lock);
+
+	close(f->fd);
+
+	f->fd = -1;
+	__atomic_store_n(&f->state, SOCKW_FREE, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&sock_lock);
+}
+
+/* Let a flow slot go and close its socket; sock_lock held. A flow which
+ * the dataplane could be using waits for it to be done, so that the
+ * socket and the port are not given to another flow meanwhile.
+ */
+static void sock_flow_put(rina_flow port) {
+	if(sock_flows[port].state == SOCKW_CLOSING) {
+		return;
+	}
+
+	/* Never seen outside of this file. */
+	if(sock_flows[port].state == SOCKW_PENDING) {
+		sock_pending--;
+
+		epoll_ctl(sock_epfd, EPOLL_CTL_DEL, sock_flows[port].fd, 0);
+		close(sock_flows[port].fd);
+
+		sock_flows[port].fd = -1;
+		__atomic_store_n(
+			&sock_flows[port].state, SOCKW_FREE, __ATOMIC_RELEASE);
+
+		return;
+	}
+
+	__atomic_store_n(
+		&sock_flows[port].state, SOCKW_CLOSING, __ATOMIC_RELEASE);
+	ep_retire(&sock_flows[port].ep, sock_flow_free);
+}
+
+/* Is it a valid port? */
+static int sock_flow_valid(rina_flow port) {
+	return port > 0 && port < SOCKW_FLOWS;
+}
+
+/* Queue an event for the listener.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int sock_post(
+	int type, int handle, rina_flow port, struct rina_AP_info * ai) {
+
+	struct sock_event * e = malloc(sizeof(struct sock_event));
+
+	if(!e) {
+		return -1;
+	}
+
+	e->type = type;
+	e->handle = handle;
+	e->port = port;
+	e->ai = ai;
+	e->next = 0;
+
+	pthread_mutex_lock(&sock_lock);
+	*sock_evq_tail = e;
+	sock_evq_tail = &e->next;
+	pthread_mutex_unlock(&sock_lock);
+
+	eventfd_write(sock_evfd, 1);
+
+	return 0;
+}
+
+/* Information about a flow served to NORI.
+ *
+ * Returns the information, 0 if there is not enough memory.
+ */
+static struct rina_AP_info * sock_ap_info(
+	const char * name, const char * difn, rina_flow port) {
+
+	struct rina_AP_info * ai = malloc(sizeof(struct rina_AP_info));
+
+	if(!ai) {
+		return 0;
+	}
+
+	snprintf(ai->name, sizeof(ai->name), "%s", name);
+	snprintf(ai->dif, sizeof(ai->dif), "%s", difn ? difn : "");
+	ai->port = port;
+
+	return ai;
+}
+
+/* The peer has left, as seen by a reader or a writer. */
+static void sock_flow_gone(rina_flow port) {
+	int up = SOCKW_UP;
+
+	/* Only the first one who sees it reports it. */
+	if(__atomic_compare_exchange_n(&sock_flows[port].state, &up,
+		SOCKW_GONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+
+		sock_post(SOCKW_Q_GONE, 0, port, 0);
+	}
+}
+
+/* Send a control message with the given payload on a socket. */
+static int sock_ctrl(int fd, char type, const char * data, int size,
+	struct sockaddr_in * to) {
+
+	char msg[SOCKW_CTRL_SIZE + 1];
+
+	msg[0] = type;
+	memcpy(msg + 1, data, size);
+
+	return sendto(fd, msg, size + 1, MSG_DONTWAIT, (struct sockaddr *)to,
+		to ? sizeof(struct sockaddr_in) : 0);
+}
+
+/* Add a descriptor to the listener ones. */
+static int sock_watch(int fd, unsigned int what, unsigned int idx) {
+	struct epoll_event ev = {0};
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = ((uint64_t)what << 32) | idx;
+
+	return epoll_ctl(sock_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Rina subsystem operations:
+ */
+
+static int sock_init(void) {
+	int i = 0;
+
+	for(i = 0; i < SOCKW_FLOWS; i++) {
+		sock_flows[i].fd = -1;
+	}
+
+	for(i = 0; i < SOCKW_AES; i++) {
+		sock_aes[i].fd = -1;
+	}
+
+	sock_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	sock_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if(sock_evfd < 0 || sock_epfd < 0) {
+		return -1;
+	}
+
+	return sock_watch(sock_evfd, SOCKW_EV_QUEUE, 0);
+}
+
+static int sock_udp_init(void) {
+	sock_udp = 1;
+	return sock_init();
+}
+
+static int sock_loop_init(void) {
+	sock_udp = 0;
+	return sock_init();
+}
+
+static int sock_stop(void) {
+	sock_stop_req = 1;
+	return 0;
+}
+
+static int sock_event_fd(void) {
+	return sock_epfd;
+}
+
+/*
+ * I/O operations:
+ */
+
+static int sock_read_sdus(
+	rina_flow port, int fd, struct iovec * iov, int n) {
+
+	struct mmsghdr msgs[SOCKW_BURST];
+	struct iovec vec[SOCKW_BURST][2];
+	char hdr[SOCKW_BURST];
+
+	int i = 0;
+	int ret = 0;
+
+	if(!sock_flow_valid(port)) {
+		return -2;
+	}
+
+	if(fd < 0) {
+		fd = sock_flows[port].fd;
+	}
+
+	if(n > SOCKW_BURST) {
+		n = SOCKW_BURST;
+	}
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * n);
+
+	for(i = 0; i < n; i++) {
+		vec[i][0].iov_base = &hdr[i];
+		vec[i][0].iov_len = 1;
+		vec[i][1] = iov[i];
+
+		msgs[i].msg_hdr.msg_iov = vec[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	/* Wait for the first only, if the flow is blocking. */
+	ret = recvmmsg(fd, msgs, n, MSG_WAITFORONE, 0);
+
+	if(ret < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+
+		if(errno == ECONNREFUSED) {
+			sock_flow_gone(port);
+			return -2;
+		}
+
+		return -1;
+	}
+
+	for(i = 0; i < ret; i++) {
+		/* Peer left; nothing after this belongs to the flow. */
+		if(msgs[i].msg_len == 0 || hdr[i] == SOCKW_BYE) {
+			sock_flow_gone(port);
+			break;
+		}
+
+		iov[i].iov_len = msgs[i].msg_len - 1;
+	}
+
+	return i > 0 ? i : -2;
+}
+
+static int sock_write_sdus(
+	rina_flow port, int fd, struct iovec * iov, int n) {
+
+	struct mmsghdr msgs[SOCKW_BURST];
+	struct iovec vec[SOCKW_BURST][2];
+	char hdr = SOCKW_DATA;
+
+	int i = 0;
+	int ret = 0;
+
+	if(!sock_flow_valid(port)) {
+		return -2;
+	}
+
+	if(fd < 0) {
+		fd = sock_flows[port].fd;
+	}
+
+	if(n > SOCKW_BURST) {
+		n = SOCKW_BURST;
+	}
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * n);
+
+	for(i = 0; i < n; i++) {
+		vec[i][0].iov_base = &hdr;
+		vec[i][0].iov_len = 1;
+		vec[i][1] = iov[i];
+
+		msgs[i].msg_hdr.msg_iov = vec[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	ret = sendmmsg(fd, msgs, n, 0);
+
+	if(ret < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+			return 0;
+		}
+
+		if(errno == ECONNREFUSED || errno == EPIPE) {
+			sock_flow_gone(port);
+			return -2;
+		}
+
+		return -1;
+	}
+
+	return ret;
+}
+
+static int sock_read_sdu(rina_flow port, char * buffer, unsigned int size) {
+	struct iovec iov = {buffer, size};
+	int ret = sock_read_sdus(port, -1, &iov, 1);
+
+	return ret > 0 ? (int)iov.iov_len : ret;
+}
+
+static int sock_write_sdu(rina_flow port, char * buffer, unsigned int size) {
+	struct iovec iov = {buffer, size};
+	int ret = sock_write_sdus(port, -1, &iov, 1);
+
+	return ret > 0 ? (int)size : ret;
+}
+
+/*
+ * Operations on the single flow:
+ */
+
+static int sock_flow_fd(rina_flow port) {
+	if(!sock_flow_valid(port)) {
+		return -1;
+	}
+
+	return sock_flows[port].fd;
+}
+
+/* Set or clear the non-blocking flag of the flow socket. */
+static int sock_flow_flags(rina_flow port, int async) {
+	int fd = sock_flow_fd(port);
+	int fl = 0;
+
+	if(fd < 0) {
+		return -1;
+	}
+
+	fl = fcntl(fd, F_GETFL);
+
+	if(fl < 0) {
+		return -1;
+	}
+
+	fl = async ? fl | O_NONBLOCK : fl & ~O_NONBLOCK;
+
+	if(fcntl(fd, F_SETFL, fl) < 0) {
+		printf("Error wile controlling flow on %d\n", port);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sock_async_flow(rina_flow port) {
+	return sock_flow_flags(port, 1);
+}
+
+static int sock_sync_flow(rina_flow port) {
+	return sock_flow_flags(port, 0);
+}
+
+/* Find a registered AE; sock_lock held.
+ *
+ * Returns its index, a negative number if not there.
+ */
+static int sock_ae_find(const char * name) {
+	int i = 0;
+
+	for(i = 0; i < SOCKW_AES; i++) {
+		if(sock_aes[i].name[0] && strcmp(sock_aes[i].name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Find a DIF of a registered AE; sock_lock held.
+ *
+ * Returns its index, a negative number if the AE is not registered there.
+ */
+static int sock_ae_dif(int ae, const char * difn) {
+	int i = 0;
+
+	for(i = 0; i < sock_aes[ae].ndifs; i++) {
+		if(strncmp(sock_aes[ae].difs[i], difn, SOCKW_DIF_SIZE - 1) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Can a registered AE be reached through a DIF? sock_lock held. */
+static int sock_ae_in(int ae, const char * difn) {
+	/* No DIF asked, or the AE takes any of them. */
+	if(!difn || !difn[0] || sock_ae_dif(ae, "") >= 0) {
+		return 1;
+	}
+
+	return sock_ae_dif(ae, difn) >= 0;
+}
+
+/* Enter an AE of this process in the directory of the host, for a DIF.
+ *
+ * Returns the socket which keeps the entry, a negative number on error.
+ */
+static int sock_dir_add(const char * ae, const char * difn) {
+	struct sockaddr_un sa;
+	int fd = -1;
+
+	if(!sock_udp) {
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(struct sockaddr_un));
+	sa.sun_family = AF_UNIX;
+
+	/* Abstract name: first byte left to 0. */
+	snprintf(sa.sun_path + 1, sizeof(sa.sun_path) - 1,
+		"nori-udp/%s@%s", ae, difn);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if(fd < 0) {
+		return -1;
+	}
+
+	/* Same AE and DIF in another process; it is there already. */
+	if(bind(fd, (struct sockaddr *)&sa, offsetof(struct sockaddr_un,
+		sun_path) + 1 + strlen(sa.sun_path + 1))) {
+
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Ask a remote AE for a flow, over UDP.
+ *
+ * Returns the port of the pending flow, a negative error number on error.
+ */
+static int sock_udp_request(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn,
+	int handle) {
+
+	struct sockaddr_in sa;
+	char req[SOCKW_CTRL_SIZE];
+	int len = 0;
+	int fd = -1;
+	int port = -1;
+
+	/* Who is asked, who asks, and in which DIF. */
+	len = snprintf(req, sizeof(req), "%s:%s", dstn, dsti) + 1;
+	len += snprintf(req + len, sizeof(req) - len, "%s:%s", srcn, srci) + 1;
+	len += snprintf(req + len, sizeof(req) - len, "%s", difn ? difn : "") +
+		1;
+
+	if(len > sizeof(req)) {
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if(fd < 0) {
+		return -1;
+	}
+
+	sock_ae_addr(dstn, dsti, &sa);
+
+	if(sock_ctrl(fd, SOCKW_REQ, req, len, &sa) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sock_lock);
+
+	port = sock_flow_get(fd, SOCKW_PENDING);
+
+	if(port < 0) {
+		pthread_mutex_unlock(&sock_lock);
+		close(fd);
+		return -1;
+	}
+
+	sock_flows[port].handle = handle;
+	sock_flows[port].deadline = sock_now() + SOCKW_TIMEOUT;
+	sock_pending++;
+
+	pthread_mutex_unlock(&sock_lock);
+
+	return port;
+}
+
+/* Take the answer to a flow request, over UDP.
+ *
+ * Returns 0 if the flow is there, a negative error number on error.
+ */
+static int sock_udp_answer(rina_flow port) {
+	struct sockaddr_in sa;
+	socklen_t sl = sizeof(struct sockaddr_in);
+	int fd = sock_flows[port].fd;
+	char type = SOCKW_NACK;
+
+	if(recvfrom(fd, &type, 1, MSG_DONTWAIT, (struct sockaddr *)&sa, &sl)
+		< 0 || type != SOCKW_ACK) {
+
+		return -1;
+	}
+
+	/* From now on it only talks with the peer flow. */
+	if(connect(fd, (struct sockaddr *)&sa, sl)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&sock_lock);
+	sock_pending--;
+	sock_flows[port].state = SOCKW_UP;
+	pthread_mutex_unlock(&sock_lock);
+
+	return 0;
+}
+
+/* Connect two AEs of this process.
+ *
+ * Returns the port of the requesting side, a negative error number on
+ * error. The other side is served by the listener.
+ */
+static int sock_loop_request(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn) {
+
+	char src[256];
+	char dst[256];
+	int sv[2] = {-1, -1};
+	int port = -1;
+	int peer = -1;
+	int i = 0;
+	struct rina_AP_info * ai = 0;
+
+	snprintf(src, sizeof(src), "%s:%s", srcn, srci);
+	snprintf(dst, sizeof(dst), "%s:%s", dstn, dsti);
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&sock_lock);
+
+	i = sock_ae_find(dst);
+
+	/* Nobody is there to accept it. */
+	if(i < 0 || !sock_ae_in(i, difn)) {
+		goto err;
+	}
+
+	port = sock_flow_get(sv[0], SOCKW_UP);
+
+	if(port < 0) {
+		goto err;
+	}
+
+	peer = sock_flow_get(sv[1], SOCKW_UP);
+
+	if(peer < 0) {
+		sock_flows[port].fd = -1;
+		sock_flows[port].state = SOCKW_FREE;
+		goto err;
+	}
+
+	pthread_mutex_unlock(&sock_lock);
+
+	ai = sock_ap_info(src, difn, peer);
+
+	if(!ai || sock_post(SOCKW_Q_SERVE, 0, peer, ai)) {
+		free(ai);
+
+		pthread_mutex_lock(&sock_lock);
+		sock_flow_put(peer);
+		sock_flow_put(port);
+		pthread_mutex_unlock(&sock_lock);
+
+		return -1;
+	}
+
+	return port;
+
+err:
+	pthread_mutex_unlock(&sock_lock);
+
+	close(sv[0]);
+	close(sv[1]);
+
+	return -1;
+}
+
+/* Next handle of an async request. */
+static int sock_handle(void) {
+	return (int)(__atomic_add_fetch(&sock_handles, 1, __ATOMIC_RELAXED) &
+		0x7fffffff);
+}
+
+static rina_flow sock_request_flow(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn,
+	struct rina_qos * qos) {
+
+	struct pollfd p = {0};
+	int port = -1;
+
+	if(!sock_udp) {
+		return sock_loop_request(srcn, srci, dstn, dsti, difn);
+	}
+
+	port = sock_udp_request(srcn, srci, dstn, dsti, difn, -1);
+
+	if(port < 0) {
+		return -1;
+	}
+
+	p.fd = sock_flows[port].fd;
+	p.events = POLLIN;
+
+	if(poll(&p, 1, SOCKW_TIMEOUT) <= 0 || sock_udp_answer(port)) {
+		pthread_mutex_lock(&sock_lock);
+		sock_flow_put(port);
+		pthread_mutex_unlock(&sock_lock);
+
+		return -1;
+	}
+
+	return port;
+}
+
+static int sock_request_flow_async(
+	const char * srcn,
+	const char * srci,
+	const char * dstn,
+	const char * dsti,
+	const char * difn,
+	struct rina_qos * qos) {
+
+	int handle = sock_handle();
+	int port = -1;
+
+	/* Result is known at once, but reported as for the others. */
+	if(!sock_udp) {
+		port = sock_loop_request(srcn, srci, dstn, dsti, difn);
+
+		if(sock_post(SOCKW_Q_READY, handle, port, 0)) {
+			return -1;
+		}
+
+		return handle;
+	}
+
+	port = sock_udp_request(srcn, srci, dstn, dsti, difn, handle);
+
+	if(port < 0) {
+		return -1;
+	}
+
+	if(sock_watch(sock_flows[port].fd, SOCKW_EV_PENDING, port)) {
+		pthread_mutex_lock(&sock_lock);
+		sock_flow_put(port);
+		pthread_mutex_unlock(&sock_lock);
+
+		return -1;
+	}
+
+	return handle;
+}
+
+static int sock_release_flow(rina_flow port) {
+	char bye = SOCKW_BYE;
+
+	if(!sock_flow_valid(port)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&sock_lock);
+
+	if(sock_flows[port].state == SOCKW_FREE ||
+		sock_flows[port].state == SOCKW_CLOSING) {
+
+		pthread_mutex_unlock(&sock_lock);
+		return -1;
+	}
+
+	/* Tell the peer, if still there; nothing more can be done. */
+	if(sock_flows[port].state == SOCKW_UP) {
+		send(sock_flows[port].fd, &bye, 1, MSG_DONTWAIT);
+	}
+
+	sock_flow_put(port);
+
+	pthread_mutex_unlock(&sock_lock);
+
+	return 0;
+}
+
+/* Over UDP the socket is the flow, so it can move as it is; the peer does
+ * not notice. Flows inside this process cannot leave it.
+ */
+static int sock_export_flow(rina_flow port) {
+	int fd = -1;
+
+	if(!sock_udp || !sock_flow_valid(port)) {
+		return -1;
+	}
+
+	/* A copy, which stays valid even if the flow goes meanwhile. */
+	pthread_mutex_lock(&sock_lock);
+
+	if(sock_flows[port].state == SOCKW_UP) {
+		fd = dup(sock_flows[port].fd);
+	}
+
+	pthread_mutex_unlock(&sock_lock);
+
+	return fd;
+}
+
+static rina_flow sock_import_flow(int fd) {
+	int port = -1;
+
+	if(!sock_udp) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&sock_lock);
+	port = sock_flow_get(fd, SOCKW_UP);
+	pthread_mutex_unlock(&sock_lock);
+
+	return port;
+}
+
+/*
+ * Operations at AE level:
+ */
+
+static int sock_create_AE(
+	const char * name, const char * instance, const char * difn) {
+
+	struct sockaddr_in sa;
+	char ae[256];
+	int fd = -1;
+	int i = 0;
+
+	snprintf(ae, sizeof(ae), "%s:%s", name, instance);
+
+	if(!difn) {
+		difn = "";
+	}
+
+	pthread_mutex_lock(&sock_lock);
+
+	i = sock_ae_find(ae);
+
+	/* Already listening; it is just reachable through one more DIF. */
+	if(i >= 0) {
+		if(sock_ae_dif(i, difn) < 0) {
+			if(sock_aes[i].ndifs == SOCKW_AE_DIFS) {
+				pthread_mutex_unlock(&sock_lock);
+				return -1;
+			}
+
+			snprintf(sock_aes[i].difs[sock_aes[i].ndifs],
+				SOCKW_DIF_SIZE, "%s", difn);
+			sock_aes[i].dirs[sock_aes[i].ndifs++] =
+				sock_dir_add(ae, difn);
+		}
+
+		pthread_mutex_unlock(&sock_lock);
+		return 0;
+	}
+
+	pthread_mutex_unlock(&sock_lock);
+
+	if(sock_udp) {
+		fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+		if(fd < 0) {
+			return -1;
+		}
+
+		sock_ae_addr(name, instance, &sa);
+
+		if(bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+			printf("Cannot listen on UDP port %d for %s\n",
+				ntohs(sa.sin_port), ae);
+
+			close(fd);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&sock_lock);
+
+	for(i = 0; i < SOCKW_AES; i++) {
+		if(!sock_aes[i].name[0]) {
+			break;
+		}
+	}
+
+	if(i == SOCKW_AES || (fd >= 0 && sock_watch(fd, SOCKW_EV_AE, i))) {
+		pthread_mutex_unlock(&sock_lock);
+
+		if(fd >= 0) {
+			close(fd);
+		}
+
+		return -1;
+	}
+
+	strcpy(sock_aes[i].name, ae);
+	sock_aes[i].fd = fd;
+	snprintf(sock_aes[i].difs[0], SOCKW_DIF_SIZE, "%s", difn);
+	sock_aes[i].dirs[0] = sock_dir_add(ae, difn);
+	sock_aes[i].ndifs = 1;
+
+	pthread_mutex_unlock(&sock_lock);
+
+	return 0;
+}
+
+static int sock_release_AE(
+	const char * name, const char * instance, const char * difn) {
+
+	char ae[256];
+	int i = 0;
+	int d = 0;
+
+	snprintf(ae, sizeof(ae), "%s:%s", name, instance);
+
+	pthread_mutex_lock(&sock_lock);
+
+	i = sock_ae_find(ae);
+	d = i < 0 ? -1 : sock_ae_dif(i, difn ? difn : "");
+
+	if(d < 0) {
+		pthread_mutex_unlock(&sock_lock);
+		return -1;
+	}
+
+	if(sock_aes[i].dirs[d] >= 0) {
+		close(sock_aes[i].dirs[d]);
+	}
+
+	/* Last one in the place of the released DIF. */
+	sock_aes[i].ndifs--;
+	memcpy(sock_aes[i].difs[d], sock_aes[i].difs[sock_aes[i].ndifs],
+		SOCKW_DIF_SIZE);
+	sock_aes[i].dirs[d] = sock_aes[i].dirs[sock_aes[i].ndifs];
+
+	/* Still registered somewhere else. */
+	if(sock_aes[i].ndifs > 0) {
+		pthread_mutex_unlock(&sock_lock);
+		return 0;
+	}
+
+	if(sock_aes[i].fd >= 0) {
+		close(sock_aes[i].fd);
+	}
+
+	sock_aes[i].name[0] = 0;
+	sock_aes[i].fd = -1;
+
+	pthread_mutex_unlock(&sock_lock);
+
+	return 0;
+}
+
+/* Look for the instances of an AE among the ones of this process. */
+static void sock_loop_lookup(
+	const char * name,
+	const char * difn,
+	void (* found)(const char * instance, void * arg),
+	void * arg) {
+
+	int len = strlen(name);
+	int i = 0;
+
+	pthread_mutex_lock(&sock_lock);
+
+	for(i = 0; i < SOCKW_AES; i++) {
+		if(strncmp(sock_aes[i].name, name, len) == 0 &&
+			sock_aes[i].name[len] == ':' &&
+			sock_ae_in(i, difn)) {
+
+			found(sock_aes[i].name + len + 1, arg);
+		}
+	}
+
+	pthread_mutex_unlock(&sock_lock);
+}
+
+/* Look for the instances of an AE in the directory of this host.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int sock_udp_lookup(
+	const char * name,
+	const char * difn,
+	void (* found)(const char * instance, void * arg),
+	void * arg) {
+
+	FILE * f = fopen("/proc/net/unix", "r");
+	char * line = 0;
+	char * path = 0;
+	char * inst = 0;
+	char * dif = 0;
+	size_t size = 0;
+	int len = strlen(name);
+
+	if(!f) {
+		return -1;
+	}
+
+	while(getline(&line, &size, f) != -1) {
+		path = strstr(line, " @nori-udp/");
+
+		if(!path) {
+			continue;
+		}
+
+		path += strlen(" @nori-udp/");
+		path[strcspn(path, "\n")] = 0;
+
+		/* Something like <name>:<instance>@<dif>. */
+		dif = strrchr(path, '@');
+
+		if(!dif || strncmp(path, name, len) || path[len] != ':') {
+			continue;
+		}
+
+		*dif++ = 0;
+		inst = path + len + 1;
+
+		if(difn && difn[0] && dif[0] && strcmp(dif, difn)) {
+			continue;
+		}
+
+		found(inst, arg);
+	}
+
+	free(line);
+	fclose(f);
+
+	return 0;
+}
+
+static int sock_lookup(
+	const char * name,
+	const char * difn,
+	void (* found)(const char * instance, void * arg),
+	void * arg) {
+
+	if(!sock_udp) {
+		sock_loop_lookup(name, difn, found, arg);
+		return 0;
+	}
+
+	return sock_udp_lookup(name, difn, found, arg);
+}
+
+/*
+ * Main procedure which reacts to events.
+ */
+
+/* Answer a flow request which reached one of our AEs over UDP. */
+static void sock_udp_accept(int ae, void * (* flow_serve)(void * args)) {
+	struct sockaddr_in sa;
+	struct sockaddr_in me;
+	socklen_t sl = sizeof(struct sockaddr_in);
+	struct rina_AP_info * ai = 0;
+
+	char req[SOCKW_CTRL_SIZE + 1];
+	char * dst = req + 1;
+	char * src = 0;
+	char * dif = 0;
+	int len = 0;
+	int in = 0;
+	int fd = -1;
+	int port = -1;
+
+	len = recvfrom(sock_aes[ae].fd, req, sizeof(req) - 1, MSG_DONTWAIT,
+		(struct sockaddr *)&sa, &sl);
+
+	if(len <= 1 || req[0] != SOCKW_REQ) {
+		return;
+	}
+
+	req[len] = 0;
+	src = dst + strlen(dst) + 1;
+	dif = src >= req + len ? src : src + strlen(src) + 1;
+
+	/* Older peers do not name the DIF. */
+	if(dif >= req + len) {
+		dif = "";
+	}
+
+	pthread_mutex_lock(&sock_lock);
+	in = sock_ae_in(ae, dif);
+	pthread_mutex_unlock(&sock_lock);
+
+	/* Another AE which happens to have the same port, or one which is not
+	 * registered in that DIF.
+	 */
+	if(src >= req + len || strcmp(dst, sock_aes[ae].name) || !in) {
+		sock_ctrl(sock_aes[ae].fd, SOCKW_NACK, "", 0, &sa);
+		return;
+	}
+
+	/* The flow gets its own socket, talking with the requester only. */
+	memset(&me, 0, sizeof(struct sockaddr_in));
+	me.sin_family = AF_INET;
+	me.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if(fd < 0 ||
+		bind(fd, (struct sockaddr *)&me, sizeof(me)) ||
+		connect(fd, (struct sockaddr *)&sa, sl)) {
+
+		goto refuse;
+	}
+
+	pthread_mutex_lock(&sock_lock);
+	port = sock_flow_get(fd, SOCKW_UP);
+	pthread_mutex_unlock(&sock_lock);
+
+	if(port < 0) {
+		goto refuse;
+	}
+
+	ai = sock_ap_info(src, dif, port);
+
+	if(!ai || sock_ctrl(fd, SOCKW_ACK, "", 0, 0) < 0) {
+		free(ai);
+
+		pthread_mutex_lock(&sock_lock);
+		sock_flow_put(port);
+		pthread_mutex_unlock(&sock_lock);
+
+		sock_ctrl(sock_aes[ae].fd, SOCKW_NACK, "", 0, &sa);
+		return;
+	}
+
+	flow_serve(ai);
+	return;
+
+refuse:
+	if(fd >= 0) {
+		close(fd);
+	}
+
+	sock_ctrl(sock_aes[ae].fd, SOCKW_NACK, "", 0, &sa);
+}
+
+/* Report the result of a pending request over UDP. */
+static void sock_udp_result(
+	rina_flow port, void (* flow_ready)(int handle, rina_flow port)) {
+
+	int handle = sock_flows[port].handle;
+
+	epoll_ctl(sock_epfd, EPOLL_CTL_DEL, sock_flows[port].fd, 0);
+
+	if(sock_udp_answer(port)) {
+		pthread_mutex_lock(&sock_lock);
+		sock_flow_put(port);
+		pthread_mutex_unlock(&sock_lock);
+
+		flow_ready(handle, -1);
+		return;
+	}
+
+	flow_ready(handle, port);
+}
+
+/* Give up the requests nobody answered. */
+static void sock_expire(void (* flow_ready)(int handle, rina_flow port)) {
+	unsigned long now = 0;
+	int handle = 0;
+	int i = 0;
+
+	if(!sock_pending) {
+		return;
+	}
+
+	now = sock_now();
+
+	for(i = 1; i < SOCKW_FLOWS; i++) {
+		if(sock_flows[i].state != SOCKW_PENDING ||
+			sock_flows[i].deadline > now ||
+			sock_flows[i].handle < 0) {
+
+			continue;
+		}
+
+		handle = sock_flows[i].handle;
+		epoll_ctl(sock_epfd, EPOLL_CTL_DEL, sock_flows[i].fd, 0);
+
+		pthread_mutex_lock(&sock_lock);
+		sock_flow_put(i);
+		pthread_mutex_unlock(&sock_lock);
+
+		flow_ready(handle, -1);
+	}
+}
+
+/* Report what has been queued. */
+static void sock_dispatch(
+	void * (* flow_serve)(void * args),
+	void (* flow_release)(int port),
+	void (* flow_ready)(int handle, rina_flow port)) {
+
+	struct sock_event * e = 0;
+	struct sock_event * next = 0;
+	eventfd_t cnt = 0;
+
+	eventfd_read(sock_evfd, &cnt);
+
+	pthread_mutex_lock(&sock_lock);
+	e = sock_evq;
+	sock_evq = 0;
+	sock_evq_tail = &sock_evq;
+	pthread_mutex_unlock(&sock_lock);
+
+	for(; e; e = next) {
+		next = e->next;
+
+		switch(e->type) {
+		case SOCKW_Q_SERVE:
+			flow_serve(e->ai);
+			break;
+		case SOCKW_Q_READY:
+			flow_ready(e->handle, e->port);
+			break;
+		case SOCKW_Q_GONE:
+			/* Could have been released locally meanwhile. */
+			if(sock_flows[e->port].state != SOCKW_GONE) {
+				break;
+			}
+
+			flow_release(e->port);
+
+			pthread_mutex_lock(&sock_lock);
+			sock_flow_put(e->port);
+			pthread_mutex_unlock(&sock_lock);
+			break;
+		}
+
+		free(e);
+	}
+}
+
+static int sock_listen_for_events(
+	void * (* flow_serve)(void * args),
+	void (* flow_release)(int port),
+	void (* flow_ready)(int handle, rina_flow port),
+	int async) {
+
+	struct epoll_event evs[SOCKW_EVENTS];
+	unsigned int idx = 0;
+	int n = 0;
+	int i = 0;
+
+	do {
+		/* Consume what is already there if async, otherwise wait. */
+		n = epoll_wait(sock_epfd, evs, SOCKW_EVENTS,
+			async ? 0 : SOCKW_TICK);
+
+		for(i = 0; i < n; i++) {
+			idx = (unsigned int)evs[i].data.u64;
+
+			switch(evs[i].data.u64 >> 32) {
+			case SOCKW_EV_QUEUE:
+				sock_dispatch(flow_serve, flow_release,
+					flow_ready);
+				break;
+			case SOCKW_EV_AE:
+				sock_udp_accept(idx, flow_serve);
+				break;
+			case SOCKW_EV_PENDING:
+				sock_udp_result(idx, flow_ready);
+				break;
+			}
+		}
+
+		sock_expire(flow_ready);
+
+		/* Async calls drain what is there and leave. */
+		if(async && n <= 0) {
+			break;
+		}
+	} while(!sock_stop_req);
+
+	return 0;
+}
+
+/* Flows over UDP sockets on this host. */
+struct rina_backend rina_udp = {
+	"udp",
+	sock_udp_init,
+	sock_stop,
+	sock_event_fd,
+	sock_read_sdu,
+	sock_write_sdu,
+	sock_read_sdus,
+	sock_write_sdus,
+	sock_flow_fd,
+	sock_async_flow,
+	sock_sync_flow,
+	sock_request_flow,
+	sock_request_flow_async,
+	sock_release_flow,
+	0,
+	sock_export_flow,
+	sock_import_flow,
+	sock_create_AE,
+	sock_release_AE,
+	sock_lookup,
+	0,
+	sock_listen_for_events
+};
+
+/* Flows between the AEs of this process. */
+struct rina_backend rina_loop = {
+	"loop",
+	sock_loop_init,
+	sock_stop,
+	sock_event_fd,
+	sock_read_sdu,
+	sock_write_sdu,
+	sock_read_sdus,
+	sock_write_sdus,
+	sock_flow_fd,
+	sock_async_flow,
+	sock_sync_flow,
+	sock_request_flow,
+	sock_request_flow_async,
+	sock_release_flow,
+	0,
+	sock_export_flow,
+	sock_import_flow,
+	sock_create_AE,
+	sock_release_AE,
+	sock_lookup,
+	0,
+	sock_listen_for_events
+};
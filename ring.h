@@ -0,0 +1,118 @@
+/* Lock-free rings to move packets between NORI threads.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_RING_H
+#define __NORI_RING_H
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of a cache line, used to keep producer and consumer apart. */
+#define RING_CACHELINE		64
+
+/* Single-producer/single-consumer ring of pointers.
+ *
+ * Only one thread can push and only one (other) thread can pop; no lock is
+ * taken on both sides.
+ */
+struct ring {
+	/* Slots available - 1; the number of slots is a power of 2. */
+	unsigned int mask;
+	/* Slots of the ring. */
+	void ** slots;
+
+	/* Next slot to write; moved by the producer only. */
+	unsigned int head __attribute__((aligned(RING_CACHELINE)));
+	/* Next slot to read; moved by the consumer only. */
+	unsigned int tail __attribute__((aligned(RING_CACHELINE)));
+};
+
+/* Prepare a ring with at least 'size' slots.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static inline int ring_init(struct ring * r, unsigned int size) {
+	unsigned int s = 1;
+
+	while(s < size) {
+		s <<= 1;
+	}
+
+	r->slots = malloc(sizeof(void *) * s);
+
+	if(!r->slots) {
+		return -1;
+	}
+
+	memset(r->slots, 0, sizeof(void *) * s);
+
+	r->mask = s - 1;
+	r->head = 0;
+	r->tail = 0;
+
+	return 0;
+}
+
+/* Release the resources of a ring; items are not touched. */
+static inline void ring_free(struct ring * r) {
+	free(r->slots);
+	r->slots = 0;
+}
+
+/* Is the ring empty? Meaningful for the consumer only. */
+static inline int ring_empty(struct ring * r) {
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail;
+}
+
+/* Add an item at the end of the ring; producer side.
+ *
+ * Returns 0 on success, -1 if the ring is full.
+ */
+static inline int ring_push(struct ring * r, void * item) {
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if(r->head - tail > r->mask) {
+		return -1;
+	}
+
+	r->slots[r->head & r->mask] = item;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Remove the first item of the ring; consumer side.
+ *
+ * Returns the item, or 0 if the ring is empty.
+ */
+static inline void * ring_pop(struct ring * r) {
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	void * item = 0;
+
+	if(head == r->tail) {
+		return 0;
+	}
+
+	item = r->slots[r->tail & r->mask];
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+#endif /* __NORI_RING_H */
@@ -0,0 +1,123 @@
+/* Caches of same sized objects.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#include <stdlib.h>
+
+#include "slab.h"
+
+/* Objects keep a pointer aligned position. */
+#define SLAB_ALIGN		sizeof(void *)
+
+/* Add a chunk of objects to the free list; needs the lock.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int slab_grow(struct slab * s, unsigned int n) {
+	struct slab_chunk * c = 0;
+	char * o = 0;
+	unsigned int i = 0;
+
+	c = malloc(sizeof(struct slab_chunk) + (unsigned long)s->size * n);
+
+	if(!c) {
+		return -1;
+	}
+
+	c->next = s->chunks;
+	s->chunks = c;
+
+	o = (char *)(c + 1);
+
+	for(i = 0; i < n; i++, o += s->size) {
+		*(void **)o = s->free;
+		s->free = o;
+	}
+
+	return 0;
+}
+
+int slab_init(
+	struct slab * s,
+	unsigned int size,
+	unsigned int prealloc,
+	unsigned int grow) {
+
+	/* Room for the free list link, and keep the alignment. */
+	if(size < sizeof(void *)) {
+		size = sizeof(void *);
+	}
+
+	s->size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	s->grow = grow ? grow : 1;
+	s->free = 0;
+	s->chunks = 0;
+	s->used = 0;
+
+	pthread_mutex_init(&s->lock, 0);
+
+	if(prealloc && slab_grow(s, prealloc)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void slab_release(struct slab * s) {
+	struct slab_chunk * c = 0;
+
+	while(s->chunks) {
+		c = s->chunks;
+		s->chunks = c->next;
+		free(c);
+	}
+
+	s->free = 0;
+	s->used = 0;
+
+	pthread_mutex_destroy(&s->lock);
+}
+
+void * slab_alloc(struct slab * s) {
+	void * o = 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	if(!s->free && slab_grow(s, s->grow)) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	o = s->free;
+	s->free = *(void **)o;
+	s->used++;
+
+	pthread_mutex_unlock(&s->lock);
+
+	return o;
+}
+
+void slab_free(struct slab * s, void * obj) {
+	pthread_mutex_lock(&s->lock);
+
+	*(void **)obj = s->free;
+	s->free = obj;
+	s->used--;
+
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,78 @@
+/* Caches of same sized objects.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_SLAB_H
+#define __NORI_SLAB_H
+
+#include <pthread.h>
+
+/* Chunk of objects allocated at once. */
+struct slab_chunk {
+	/* Next chunk of the slab. */
+	struct slab_chunk * next;
+};
+
+/* Cache of objects of the same size.
+ *
+ * Objects are carved out of chunks allocated when the cache runs dry, and
+ * given back to a free list; once warm, the cache does not call malloc
+ * anymore. Chunks are released only with the whole cache.
+ */
+struct slab {
+	/* Size of an object. */
+	unsigned int size;
+	/* Objects per chunk. */
+	unsigned int grow;
+
+	/* Free objects; the first word of each one links the next. */
+	void * free;
+	/* Chunks of the slab. */
+	struct slab_chunk * chunks;
+
+	/* Objects currently given out. */
+	unsigned int used;
+
+	/* Lock protecting the cache. */
+	pthread_mutex_t lock;
+};
+
+/* Prepare a cache of objects of 'size' bytes, with 'prealloc' of them
+ * available from the start and 'grow' more allocated every time it runs dry.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int slab_init(
+	struct slab * s,
+	unsigned int size,
+	unsigned int prealloc,
+	unsigned int grow);
+
+/* Release the cache and every object in it. */
+void slab_release(struct slab * s);
+
+/* Get an object, not initialized. Thread safe.
+ *
+ * Returns the object, or 0 if there is no more memory.
+ */
+void * slab_alloc(struct slab * s);
+
+/* Give an object back to the cache. Thread safe. */
+void slab_free(struct slab * s, void * obj);
+
+#endif /* __NORI_SLAB_H */
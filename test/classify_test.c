@@ -0,0 +1,284 @@
+/* Test of the classification of the packets of NORI.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+/* Loads a dictionary with IP, port, range, ICMP and match rules, checks
+ * that nori_classify gives the first rule of the dictionary which matches
+ * crafted packets, with and without the connection cache, and times it.
+ * NORI is built in, renamed, to reach its classifier.
+ */
+
+#define main nori_real_main
+#include "../main.c"
+#undef main
+
+/* Classifications timed for every setting. */
+#define TEST_LOOKUPS		(1 << 22)
+
+/* Order matters: every packet below has more rules matching it. */
+static const char * test_dict =
+	"match proto=icmp icmp=8 ping,1\n"
+	"port dst TCP 80 web,1\n"
+	"match src=10.1.0.0/16 proto=tcp dport=80 shadow,1\n"
+	"port dst UDP 5000-5999 media,1\n"
+	"ip dst 10.2.0.1 host,1\n"
+	"match dport=53 dns,1\n"
+	"match src=10.3.0.0/16 proto=udp sport=1024-2047 mid,1\n"
+	"ip src 10.4.0.0/16 net,1\n"
+	"port src TCP 8000-8999 back,1\n"
+	"default si any,1\n";
+
+/* A packet, and the position of the rule it has to take. */
+struct test_pkt {
+	const char * what;
+	int proto;
+	uint32_t src;
+	uint32_t dst;
+	int sport;
+	int dport;
+	/* Fragment after the first one? */
+	int frag;
+	int rule;
+};
+
+#define IP(a, b, c, d)	(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+static struct test_pkt test_pkts[] = {
+	{"echo request to a host",
+		IPV4_PROTO_ICMP, IP(10, 9, 0, 1), IP(10, 2, 0, 1), 8, 0, 0, 0},
+	{"echo reply to a host",
+		IPV4_PROTO_ICMP, IP(10, 9, 0, 1), IP(10, 2, 0, 1), 0, 0, 0, 4},
+	{"ICMP with code 53",
+		IPV4_PROTO_ICMP, IP(10, 9, 0, 1), IP(10, 9, 0, 2), 3, 53, 0, 9},
+	{"TCP to 80 from 10.1/16",
+		IPV4_PROTO_TCP, IP(10, 1, 2, 3), IP(10, 9, 9, 9), 4000, 80, 0, 1},
+	{"TCP to 80 from 10.4/16",
+		IPV4_PROTO_TCP, IP(10, 4, 0, 1), IP(10, 9, 9, 9), 4000, 80, 0, 1},
+	{"UDP to 80 from 10.1/16",
+		IPV4_PROTO_UDP, IP(10, 1, 2, 3), IP(10, 9, 9, 9), 4000, 80, 0, 9},
+	{"UDP to 5000 of a host",
+		IPV4_PROTO_UDP, IP(10, 9, 0, 1), IP(10, 2, 0, 1), 4000, 5000, 0, 3},
+	{"UDP to 5999 of a host",
+		IPV4_PROTO_UDP, IP(10, 9, 0, 1), IP(10, 2, 0, 1), 4000, 5999, 0, 3},
+	{"UDP to 6000 of a host",
+		IPV4_PROTO_UDP, IP(10, 9, 0, 1), IP(10, 2, 0, 1), 4000, 6000, 0, 4},
+	{"TCP to 5500 of a host",
+		IPV4_PROTO_TCP, IP(10, 9, 0, 1), IP(10, 2, 0, 1), 4000, 5500, 0, 4},
+	{"TCP to 53",
+		IPV4_PROTO_TCP, IP(10, 9, 0, 1), IP(10, 9, 0, 2), 4000, 53, 0, 5},
+	{"UDP to 53",
+		IPV4_PROTO_UDP, IP(10, 9, 0, 1), IP(10, 9, 0, 2), 4000, 53, 0, 5},
+	{"UDP fragment to 53",
+		IPV4_PROTO_UDP, IP(10, 9, 0, 1), IP(10, 9, 0, 2), 4000, 53, 1, 9},
+	{"UDP fragment from 10.4/16",
+		IPV4_PROTO_UDP, IP(10, 4, 0, 1), IP(10, 9, 0, 2), 4000, 53, 1, 7},
+	{"UDP from 1024 of 10.3/16",
+		IPV4_PROTO_UDP, IP(10, 3, 1, 1), IP(10, 9, 0, 2), 1024, 9999, 0, 6},
+	{"UDP from 2047 of 10.3/16",
+		IPV4_PROTO_UDP, IP(10, 3, 1, 1), IP(10, 9, 0, 2), 2047, 9999, 0, 6},
+	{"UDP from 2048 of 10.3/16",
+		IPV4_PROTO_UDP, IP(10, 3, 1, 1), IP(10, 9, 0, 2), 2048, 9999, 0, 9},
+	{"TCP from 1500 of 10.3/16",
+		IPV4_PROTO_TCP, IP(10, 3, 1, 1), IP(10, 9, 0, 2), 1500, 9999, 0, 9},
+	{"UDP from 1500 of 10.3/16 to 53",
+		IPV4_PROTO_UDP, IP(10, 3, 1, 1), IP(10, 9, 0, 2), 1500, 53, 0, 5},
+	{"TCP from 8080 of 10.4/16",
+		IPV4_PROTO_TCP, IP(10, 4, 0, 1), IP(10, 9, 0, 2), 8080, 9999, 0, 7},
+	{"TCP from 8080",
+		IPV4_PROTO_TCP, IP(10, 9, 0, 1), IP(10, 9, 0, 2), 8080, 9999, 0, 8},
+	{"UDP from 8080",
+		IPV4_PROTO_UDP, IP(10, 9, 0, 1), IP(10, 9, 0, 2), 8080, 9999, 0, 9},
+};
+
+#define TEST_PKTS	(sizeof(test_pkts) / sizeof(struct test_pkt))
+
+static char test_buf[TEST_PKTS][64];
+static int test_size[TEST_PKTS];
+
+static void test_put32(unsigned char * p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* Build the packet, TUN header included, and return its size. */
+static int test_build(struct test_pkt * t, char * buf) {
+	unsigned char * ip = (unsigned char *)buf + TUN_INITIAL_OFFSET;
+	unsigned char * l4 = ip + 20;
+	int size = 0;
+
+	memset(buf, 0, 64);
+
+	switch(t->proto) {
+	case IPV4_PROTO_TCP:
+		size = 20;
+		break;
+	case IPV4_PROTO_UDP:
+	case IPV4_PROTO_ICMP:
+		size = 8;
+		break;
+	}
+
+	ip[0] = 0x45;
+	ip[2] = (20 + size) >> 8;
+	ip[3] = (20 + size) & 0xff;
+	ip[8] = 64;
+	ip[IPV4_PROTO_OFFSET] = t->proto;
+
+	/* Not the first; what follows the header is not L4 anymore. */
+	if(t->frag) {
+		ip[IPV4_FRAG_OFFSET + 1] = 0x10;
+	}
+
+	test_put32(ip + IPV4_SOURCE_OFFSET, t->src);
+	test_put32(ip + IPV4_DEST_OFFSET, t->dst);
+
+	if(t->proto == IPV4_PROTO_ICMP) {
+		l4[IPV4_ICMP_TYPE] = t->sport;
+		l4[IPV4_ICMP_CODE] = t->dport;
+	} else {
+		l4[IPV4_TDP_SOURCEP_OFFSET] = t->sport >> 8;
+		l4[IPV4_TDP_SOURCEP_OFFSET + 1] = t->sport & 0xff;
+		l4[IPV4_TDP_DESTP_OFFSET] = t->dport >> 8;
+		l4[IPV4_TDP_DESTP_OFFSET + 1] = t->dport & 0xff;
+	}
+
+	return TUN_INITIAL_OFFSET + 20 + size;
+}
+
+/* Classify every packet 'times' times, checking the rule taken.
+ *
+ * Returns the number of wrong decisions.
+ */
+static int test_check(struct nori_cls * cls, int times) {
+	struct dict_rule * r = 0;
+	struct rule_dest * de = 0;
+
+	unsigned int i = 0;
+	int bad = 0;
+	int got = 0;
+	int j = 0;
+
+	for(j = 0; j < times; j++) {
+		for(i = 0; i < TEST_PKTS; i++) {
+			r = 0;
+			de = nori_classify(cls, test_buf[i], test_size[i], &r);
+			got = de && r ? r->id : -1;
+
+			if(got != test_pkts[i].rule) {
+				printf("FAIL: %s took rule %d, not %d\n",
+					test_pkts[i].what, got,
+					test_pkts[i].rule);
+				bad++;
+			}
+		}
+	}
+
+	return bad;
+}
+
+/* Nanoseconds per classification of the packets, in turn. */
+static double test_time(struct nori_cls * cls) {
+	struct dict_rule * r = 0;
+	struct timespec a;
+	struct timespec b;
+
+	unsigned long sink = 0;
+	unsigned int k = 0;
+	int i = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+
+	for(i = 0; i < TEST_LOOKUPS; i++) {
+		k = i % TEST_PKTS;
+		sink += (unsigned long)nori_classify(
+			cls, test_buf[k], test_size[k], &r);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	/* Keep the lookups. */
+	if(sink == 1) {
+		printf("?\n");
+	}
+
+	return ((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec)) /
+		TEST_LOOKUPS;
+}
+
+/* Check and time the classifier with a cache of 'cache' connections. */
+static int test_run(unsigned int cache) {
+	struct nori_cls cls;
+	int bad = 0;
+
+	nori_fc_size = cache;
+
+	if(nori_cls_init(&cls)) {
+		printf("No more memory!\n");
+		return -1;
+	}
+
+	/* The second time the cache, if any, gives the decisions. */
+	bad = test_check(&cls, 2);
+
+	printf("%-8s %zu packets, %d wrong, %.1f ns per packet\n",
+		cache ? "cached" : "rules", TEST_PKTS, bad, test_time(&cls));
+
+	free(cls.fc);
+	free(cls.next);
+
+	return bad ? -1 : 0;
+}
+
+int main(void) {
+	char path[] = "/tmp/nori-dict-XXXXXX";
+	unsigned int i = 0;
+	int ret = 0;
+	int fd = -1;
+
+	fd = mkstemp(path);
+
+	if(fd < 0 || write(fd, test_dict, strlen(test_dict)) < 0) {
+		printf("Cannot write the dictionary\n");
+		return 1;
+	}
+
+	close(fd);
+
+	ret = dict_parse(path, "test");
+	unlink(path);
+
+	if(ret) {
+		printf("Cannot load the dictionary\n");
+		return 1;
+	}
+
+	for(i = 0; i < TEST_PKTS; i++) {
+		test_size[i] = test_build(&test_pkts[i], test_buf[i]);
+	}
+
+	if(test_run(0) || test_run(8192)) {
+		printf("FAIL\n");
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,304 @@
+/* Test of the compiled rules of NORI.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+/* Compiles a dictionary mixing port ranges, TCP or UDP only ports, ICMP
+ * types, match and IP rules, and checks that nori_rules_match gives the
+ * same rule as the tuple space interpreter for random keys, then times
+ * both. Keys are made mostly of the values the rules look at, their
+ * neighbours and the ends of the ranges. NORI is built in, renamed, to
+ * reach both matchers.
+ */
+
+#define main nori_real_main
+#include "../main.c"
+#undef main
+
+/* Keys compared. */
+#define TEST_KEYS		(1 << 20)
+/* Random rules after the fixed ones. */
+#define TEST_RULES		200
+
+static const char * test_fixed =
+	"match proto=icmp icmp=8 ping,1\n"
+	"match proto=icmp icmp=0 pong,1\n"
+	"port dst TCP 80 web,1\n"
+	"port dst UDP 80 quic,1\n"
+	"port src TCP 1000-2999 range,1\n"
+	"port dst UDP 3-17 low,1\n"
+	"ip dst 10.2.0.1 host,1\n"
+	"match dport=53 dns,1\n"
+	"match sport=40000-65535 high,1\n"
+	"match src=10.1.0.0/16 proto=tcp dport=8000-8080 alt,1\n"
+	"match dst=10.3.0.0/24 proto=udp sport=123 ntp,1\n"
+	"match src=10.1.0.0/16 dst=10.3.0.0/16 prop,1\n"
+	"ip src 10.4.0.0/16 net,1\n"
+	"match proto=47 gre,1\n";
+
+/* Values the keys are made of. */
+static uint32_t test_addrs[] = {
+	0x0a010000, 0x0a010203, 0x0a02ffff, 0x0a020001, 0x0a030000,
+	0x0a0300ff, 0x0a030100, 0x0a040001, 0x0a050607, 0xc0a80001,
+};
+static int test_protos[] = {
+	IPV4_PROTO_ICMP, IPV4_PROTO_TCP, IPV4_PROTO_UDP, 47, 50,
+};
+static int test_ports[] = {
+	0, 1, 2, 3, 8, 17, 18, 53, 79, 80, 81, 123, 999, 1000, 2999, 3000,
+	7999, 8000, 8080, 8081, 39999, 40000, 65535,
+};
+
+#define TEST_NR(a)	(sizeof(a) / sizeof(a[0]))
+
+/* Positions + 1 of the IP rules, which are given to the matchers. */
+static unsigned int test_ips[4];
+static unsigned int test_nips = 0;
+
+static unsigned int test_rand(unsigned int * x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+
+	return *x;
+}
+
+/* A port: mostly one of the values above, else random. */
+static int test_port(unsigned int * x) {
+	if(test_rand(x) & 3) {
+		return test_ports[test_rand(x) % TEST_NR(test_ports)];
+	}
+
+	return test_rand(x) & 0xffff;
+}
+
+/* Write the fixed rules, then random ones, then a default. */
+static int test_write(int fd) {
+	char line[256];
+	unsigned int x = 2463534242U;
+	int lo = 0;
+	int hi = 0;
+	int i = 0;
+
+	if(write(fd, test_fixed, strlen(test_fixed)) < 0) {
+		return -1;
+	}
+
+	for(i = 0; i < TEST_RULES; i++) {
+		lo = test_rand(&x) & 0xffff;
+		hi = lo + test_rand(&x) % 3000;
+
+		if(hi > 0xffff) {
+			hi = 0xffff;
+		}
+
+		switch(test_rand(&x) % 5) {
+		case 0:
+			snprintf(line, sizeof(line),
+				"port %s %s %d-%d r%d,1\n",
+				test_rand(&x) & 1 ? "src" : "dst",
+				test_rand(&x) & 1 ? "TCP" : "UDP", lo, hi, i);
+			break;
+		case 1:
+			snprintf(line, sizeof(line),
+				"match proto=icmp icmp=%d r%d,1\n",
+				lo & 0xff, i);
+			break;
+		case 2:
+			snprintf(line, sizeof(line),
+				"match dst=10.%d.0.0/16 dport=%d-%d r%d,1\n",
+				test_rand(&x) % 6, lo, hi, i);
+			break;
+		case 3:
+			snprintf(line, sizeof(line),
+				"match src=10.%d.%d.0/24 proto=%s sport=%d r%d,1\n",
+				test_rand(&x) % 6, test_rand(&x) % 4,
+				test_rand(&x) & 1 ? "tcp" : "udp", lo, i);
+			break;
+		default:
+			snprintf(line, sizeof(line),
+				"match sport=%d-%d dport=%d r%d,1\n",
+				lo, hi, test_rand(&x) & 0xffff, i);
+			break;
+		}
+
+		if(write(fd, line, strlen(line)) < 0) {
+			return -1;
+		}
+	}
+
+	snprintf(line, sizeof(line), "default si any,1\n");
+
+	if(write(fd, line, strlen(line)) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Make up a key, and the IP rule found for it, if any. */
+static unsigned int test_key(unsigned int * x, uint64_t key[2]) {
+	int proto = test_protos[test_rand(x) % TEST_NR(test_protos)];
+	int sport = 0;
+	int dport = 0;
+	int l4 = 0;
+
+	if(!(test_rand(x) & 7)) {
+		proto = test_rand(x) & 0xff;
+	}
+
+	/* Fragments after the first one carry no ports. */
+	if(test_rand(x) & 7) {
+		if(proto == IPV4_PROTO_TCP || proto == IPV4_PROTO_UDP) {
+			sport = test_port(x);
+			dport = test_port(x);
+			l4 = 1;
+		} else if(proto == IPV4_PROTO_ICMP) {
+			sport = test_rand(x) & 1 ?
+				test_port(x) & 0xff : test_rand(x) & 0xff;
+			dport = test_rand(x) & 0xff;
+			l4 = 1;
+		}
+	}
+
+	tss_key(key,
+		test_addrs[test_rand(x) % TEST_NR(test_addrs)],
+		test_addrs[test_rand(x) % TEST_NR(test_addrs)],
+		proto, sport, dport);
+
+	if(l4) {
+		key[1] |= TSS_L4;
+	}
+
+	if(!test_nips || test_rand(x) & 1) {
+		return 0;
+	}
+
+	return test_ips[test_rand(x) % test_nips];
+}
+
+/* Nanoseconds per key taken by a matcher. */
+static double test_time(
+	dictc_match match, uint64_t (* keys)[2], unsigned int * found) {
+
+	struct timespec a;
+	struct timespec b;
+
+	unsigned long sink = 0;
+	int i = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+
+	for(i = 0; i < TEST_KEYS; i++) {
+		sink += match(keys[i], found[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	/* Keep the lookups. */
+	if(sink == 1) {
+		printf("?\n");
+	}
+
+	return ((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec)) /
+		TEST_KEYS;
+}
+
+int main(void) {
+	char path[] = "/tmp/nori-dict-XXXXXX";
+	struct dict_rule * r = 0;
+	uint64_t (* keys)[2] = 0;
+
+	unsigned int * found = 0;
+	unsigned int x = 88172645;
+	unsigned int c = 0;
+	unsigned int t = 0;
+	int bad = 0;
+	int ret = 0;
+	int fd = -1;
+	int i = 0;
+
+	fd = mkstemp(path);
+
+	if(fd < 0 || test_write(fd)) {
+		printf("Cannot write the dictionary\n");
+		return 1;
+	}
+
+	close(fd);
+
+	ret = dict_parse(path, "test");
+	unlink(path);
+
+	if(ret) {
+		printf("Cannot load the dictionary\n");
+		return 1;
+	}
+
+	if(dictc_load(&nori_compiled)) {
+		printf("FAIL: cannot compile the rules\n");
+		return 1;
+	}
+
+	for(i = 0; i < dict_rules_nr; i++) {
+		r = dict_rules_by_id[i];
+
+		if(r->type == RULE_IP && test_nips < TEST_NR(test_ips)) {
+			test_ips[test_nips++] = r->id + 1;
+		}
+	}
+
+	keys = malloc(sizeof(*keys) * TEST_KEYS);
+	found = malloc(sizeof(unsigned int) * TEST_KEYS);
+
+	if(!keys || !found) {
+		printf("No more memory!\n");
+		return 1;
+	}
+
+	for(i = 0; i < TEST_KEYS; i++) {
+		found[i] = test_key(&x, keys[i]);
+
+		c = nori_compiled(keys[i], found[i]);
+		t = nori_match_rules(keys[i], found[i]);
+
+		if(c != t && bad++ < 10) {
+			printf("FAIL: key %016lx %016lx, found %u: "
+				"compiled %u, tuples %u\n",
+				(unsigned long)keys[i][0],
+				(unsigned long)keys[i][1], found[i], c, t);
+		}
+	}
+
+	printf("%d rules, %d keys, %d different, "
+		"%.1f ns compiled, %.1f ns on the tuples\n",
+		dict_rules_nr, TEST_KEYS, bad,
+		test_time(nori_compiled, keys, found),
+		test_time(nori_match_rules, keys, found));
+
+	free(keys);
+	free(found);
+
+	if(bad) {
+		printf("FAIL\n");
+		return 1;
+	}
+
+	printf("PASS\n");
+
+	return 0;
+}
@@ -0,0 +1,150 @@
+#!/bin/sh
+#
+# Failover test for the standby destinations of NORI.
+#
+# Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Contributors and changes:
+#
+
+#
+# Three NORIs on the UDP backend of the same host: 'a' sends everything to
+# 's,1', with 's,2' as its standby. Traffic goes at a steady rate, and
+# halfway through 's,1' is killed. The traffic has to reach 's,2' within
+# the bound given (milliseconds after the kill), and 'a' and 's,2' have to
+# keep working and exit cleanly. The packets lost meanwhile are counted.
+#
+# Needs root, for the TUN devices, and a NORI built with 'make IRATI=0'.
+#
+# Usage: test/failover.sh [seconds] [bound]
+#
+
+SECS=${1:-4}
+BOUND=${2:-100}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d /tmp/nori-failover-XXXXXX)
+
+fail() {
+	echo "FAIL: $*"
+	kill -INT $A $S1 $S2 2>/dev/null
+	sleep 1
+	echo "--- a"; tail -20 $TMP/a.log
+	echo "--- s1"; tail -20 $TMP/s1.log
+	echo "--- s2"; tail -20 $TMP/s2.log
+	exit 1
+}
+
+if [ ! -x $ROOT/nori ]; then
+	echo "Build NORI first, with 'make IRATI=0'."
+	exit 1
+fi
+
+printf 'default si a,1\n' > $TMP/ds
+printf 'default si s,1 standby=s,2\n' > $TMP/da
+
+cd $TMP
+
+$ROOT/nori s 1 d0 --backend udp --devname nst1 ds > s1.log 2>&1 &
+S1=$!
+$ROOT/nori s 2 d0 --backend udp --devname nst2 ds > s2.log 2>&1 &
+S2=$!
+sleep 0.5
+
+# Flows to the destination and to its standby are allocated at start.
+$ROOT/nori a 1 d0 --backend udp --devname nst0 da > a.log 2>&1 &
+A=$!
+sleep 1
+
+kill -0 $S1 2>/dev/null || fail "primary did not start"
+kill -0 $S2 2>/dev/null || fail "standby did not start"
+kill -0 $A 2>/dev/null || fail "sender did not start"
+
+ip addr add 10.99.0.1/24 dev nst0 && ip link set nst0 up &&
+	ip link set nst1 up && ip link set nst2 up ||
+	fail "cannot set the devices up"
+
+# A packet every 200 us, numbered; what comes out of the receivers is
+# captured, and the primary is killed halfway.
+python3 - $SECS $S1 > traffic.log <<'PY' || fail "cannot run the traffic"
+import os, select, signal, socket, struct, sys, threading, time
+secs = float(sys.argv[1])
+pid = int(sys.argv[2])
+caps = {}
+for i, dev in enumerate(('nst1', 'nst2')):
+    c = socket.socket(socket.AF_PACKET, socket.SOCK_DGRAM, socket.htons(3))
+    c.bind((dev, 0))
+    caps[c] = i
+seen = [set(), set()]
+first = [None]
+kill = [None]
+def capture():
+    end = time.time() + secs + 1
+    while time.time() < end:
+        r, w, x = select.select(list(caps), [], [], 0.1)
+        for c in r:
+            # The device of the primary goes with it.
+            try:
+                p = c.recv(2048)
+            except OSError:
+                del caps[c]
+                continue
+            # IPv4 and UDP headers, then the number.
+            if len(p) < 36 or p[9] != 17 or p[28:32] != b'NORI':
+                continue
+            seen[caps[c]].add(struct.unpack('!I', p[32:36])[0])
+            if caps[c] == 1 and first[0] is None:
+                first[0] = time.time()
+t = threading.Thread(target=capture)
+t.start()
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+n = 0
+start = time.time()
+while time.time() < start + secs:
+    if kill[0] is None and time.time() >= start + secs / 2:
+        os.kill(pid, signal.SIGKILL)
+        kill[0] = time.time()
+    s.sendto(b'NORI' + struct.pack('!I', n), ('10.99.0.10', 9))
+    n += 1
+    time.sleep(0.0002)
+t.join()
+moved = -1
+if first[0] is not None:
+    moved = int((first[0] - kill[0]) * 1000)
+print(n, len(seen[0]), len(seen[1]), n - len(seen[0] | seen[1]), moved)
+PY
+
+set -- $(cat traffic.log)
+SENT=$1; RX1=$2; RX2=$3; LOST=$4; MOVED=$5
+
+wait $S1 2>/dev/null
+
+kill -0 $A 2>/dev/null || fail "sender died"
+kill -0 $S2 2>/dev/null || fail "standby died"
+
+kill -INT $A
+wait $A || fail "sender did not exit cleanly"
+kill -INT $S2
+wait $S2 || fail "standby did not exit cleanly"
+
+echo "Sent $SENT packets: $RX1 to the primary, $RX2 to the standby," \
+	"$LOST lost; moved $MOVED ms after the kill"
+
+[ "$RX1" -gt 0 ] || fail "nothing reached the primary"
+[ "$RX2" -gt 0 ] || fail "nothing reached the standby"
+[ "$MOVED" -ge 0 ] && [ "$MOVED" -le "$BOUND" ] ||
+	fail "traffic did not move within $BOUND ms"
+
+rm -rf $TMP
+echo "PASS"
@@ -0,0 +1,143 @@
+/* Microbenchmark of the flow table of NORI.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+/* Time taken to find a flow by its port, as flow_deallocated and the
+ * handoff do, against the number of flows known: for flows which are there,
+ * for ports which are not, and for flows which are there after the table
+ * has seen as many flows come and go as it holds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../htable.h"
+
+/* Lookups timed for every size. */
+#define BENCH_LOOKUPS		(1 << 23)
+
+static unsigned int bench_rand(unsigned int * x) {
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+
+	return *x;
+}
+
+/* Nanoseconds per lookup of keys taken at random among the first 'n'. */
+static double bench_get(struct htable * t, unsigned long * keys, int n) {
+	struct timespec a;
+	struct timespec b;
+
+	unsigned long found = 0;
+	unsigned long k = 0;
+	unsigned int x = 88172645;
+	int i = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+
+	for(i = 0; i < BENCH_LOOKUPS; i++) {
+		k = keys[bench_rand(&x) % n];
+		found += (unsigned long)ht_get(t, k, ht_hash_int(k));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	/* Keep the lookups. */
+	if(found == 1) {
+		printf("?\n");
+	}
+
+	return ((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec)) /
+		BENCH_LOOKUPS;
+}
+
+static int bench(int n) {
+	struct htable t = {0};
+	unsigned long * keys = 0;
+	unsigned long * miss = 0;
+	unsigned long next = 0;
+	unsigned int x = 2463534242U;
+
+	double hit = 0;
+	double none = 0;
+	double churn = 0;
+	int i = 0;
+	int j = 0;
+
+	keys = malloc(sizeof(unsigned long) * n);
+	miss = malloc(sizeof(unsigned long) * n);
+
+	if(!keys || !miss || ht_init(&t, 64)) {
+		printf("No more memory!\n");
+		return -1;
+	}
+
+	/* Ports are given in order, like the stacks do. */
+	for(i = 0; i < n; i++) {
+		keys[i] = next++;
+		miss[i] = keys[i] + 0x100000000UL;
+
+		if(ht_add(&t, keys[i], ht_hash_int(keys[i]), &keys[i])) {
+			printf("No more memory!\n");
+			return -1;
+		}
+	}
+
+	hit = bench_get(&t, keys, n);
+	none = bench_get(&t, miss, n);
+
+	/* Release a flow at random and allocate a new one, n times. */
+	for(i = 0; i < n; i++) {
+		j = bench_rand(&x) % n;
+
+		ht_del(&t, keys[j], ht_hash_int(keys[j]));
+		keys[j] = next++;
+
+		if(ht_add(&t, keys[j], ht_hash_int(keys[j]), &keys[j])) {
+			printf("No more memory!\n");
+			return -1;
+		}
+	}
+
+	churn = bench_get(&t, keys, n);
+
+	printf("%8d %10.1f %10.1f %10.1f\n", n, hit, none, churn);
+
+	ht_free(&t);
+	free(keys);
+	free(miss);
+
+	return 0;
+}
+
+int main(void) {
+	int n = 0;
+
+	printf("%8s %10s %10s %10s\n", "flows", "found", "missing", "churned");
+	printf("%8s %10s %10s %10s\n", "", "(ns)", "(ns)", "(ns)");
+
+	for(n = 10; n <= 1000000; n *= 10) {
+		if(bench(n)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
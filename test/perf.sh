@@ -0,0 +1,183 @@
+#!/bin/sh
+#
+# Idle CPU use and forwarding latency of NORI.
+#
+# Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Contributors and changes:
+#
+
+#
+# Two NORIs on the UDP backend of the same host, 'a' forwarding everything
+# to 's'. First both are left without traffic, and the CPU they take is
+# read from /proc; then a packet is sent every millisecond through them,
+# and the time from the socket of the sender to the device of 's' gives
+# the percentiles of the latency; last, the packets forwarded per second
+# are counted at full rate. All of it is done once with the flow between
+# the two going through the UDP backend, and once through shared memory.
+#
+# Needs root, for the TUN devices, and a NORI built with 'make IRATI=0'.
+# Another build can be given to compare with.
+#
+# Usage: test/perf.sh [seconds] [nori]
+#
+
+SECS=${1:-5}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+NORI=${2:-$ROOT/nori}
+TMP=$(mktemp -d /tmp/nori-perf-XXXXXX)
+
+fail() {
+	echo "FAIL: $*"
+	kill -INT $A $S 2>/dev/null
+	sleep 1
+	echo "--- a"; tail -20 $TMP/a.log
+	echo "--- s"; tail -20 $TMP/s.log
+	exit 1
+}
+
+# Clock ticks taken by a process so far, user and system.
+ticks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+# Percent of a CPU the clock ticks given are, over the time measured.
+cpu() {
+	awk "BEGIN { printf \"%.1f\", $1 * 100 / $HZ / $SECS }"
+}
+
+if [ ! -x $NORI ]; then
+	echo "Build NORI first, with 'make IRATI=0'."
+	exit 1
+fi
+
+printf 'default si a,1\n' > $TMP/ds
+printf 'default si s,1\n' > $TMP/da
+
+cd $TMP
+
+# Run the two, with the options given, and measure them.
+measure() {
+	WHAT=$1
+	shift
+
+	$NORI s 1 d0 --backend udp --devname nst1 "$@" ds > s.log 2>&1 &
+	S=$!
+	sleep 0.5
+
+	$NORI a 1 d0 --backend udp --devname nst0 "$@" da > a.log 2>&1 &
+	A=$!
+	sleep 1
+
+	kill -0 $S 2>/dev/null || fail "receiver did not start"
+	kill -0 $A 2>/dev/null || fail "sender did not start"
+
+	ip addr add 10.99.0.1/24 dev nst0 && ip link set nst0 up &&
+		ip link set nst1 up || fail "cannot set the devices up"
+
+	TA=$(ticks $A)
+	TS=$(ticks $S)
+	sleep $SECS
+	TA=$(( $(ticks $A) - TA ))
+	TS=$(( $(ticks $S) - TS ))
+
+	echo "$WHAT: idle CPU over $SECS seconds:" \
+		"a $(cpu $TA)%, s $(cpu $TS)%"
+
+	# Numbered packets carrying the time they are sent at.
+	python3 - $SECS > latency.log <<'PY' || fail "cannot run the traffic"
+import select, socket, struct, sys, threading, time
+secs = float(sys.argv[1])
+c = socket.socket(socket.AF_PACKET, socket.SOCK_DGRAM, socket.htons(3))
+c.bind(('nst1', 0))
+lat = []
+def capture():
+    end = time.time() + secs + 1
+    while time.time() < end:
+        r, w, x = select.select([c], [], [], 0.1)
+        if not r:
+            continue
+        p = c.recv(2048)
+        now = time.monotonic_ns()
+        # IPv4 and UDP headers, then the number and the time.
+        if len(p) < 44 or p[9] != 17 or p[28:32] != b'NORI':
+            continue
+        lat.append(now - struct.unpack('!Q', p[36:44])[0])
+t = threading.Thread(target=capture)
+t.start()
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+n = 0
+end = time.time() + secs
+while time.time() < end:
+    s.sendto(b'NORI' + struct.pack('!IQ', n, time.monotonic_ns()),
+        ('10.99.0.10', 9))
+    n += 1
+    time.sleep(0.001)
+t.join()
+lat.sort()
+if not lat:
+    print(n, 0, 0, 0, 0)
+    sys.exit(0)
+def pct(p):
+    return lat[min(len(lat) - 1, int(len(lat) * p / 100))] // 1000
+print(n, len(lat), pct(50), pct(99), lat[-1] // 1000)
+PY
+
+	set -- $(cat latency.log)
+	SENT=$1; RX=$2; P50=$3; P99=$4; MAX=$5
+
+	echo "$WHAT: latency over $RX of $SENT packets:" \
+		"p50 $P50 us, p99 $P99 us, max $MAX us"
+
+	[ "$RX" -gt 0 ] || fail "nothing forwarded"
+
+	# Full rate, from more sockets.
+	FWD=$(cat /sys/class/net/nst1/statistics/rx_packets)
+
+	python3 - $SECS <<'PY'
+import socket, sys, time
+end = time.time() + float(sys.argv[1])
+ss = [socket.socket(socket.AF_INET, socket.SOCK_DGRAM) for i in range(4)]
+n = 0
+while time.time() < end:
+    for i in range(1000):
+        try:
+            ss[n % 4].sendto(b'x' * 64, ('10.99.0.10', 9))
+        except OSError:
+            pass
+        n += 1
+PY
+
+	sleep 0.5
+	FWD=$(( $(cat /sys/class/net/nst1/statistics/rx_packets) - FWD ))
+
+	echo "$WHAT: forwarded $((FWD / SECS)) packets per second at full rate"
+
+	kill -0 $A 2>/dev/null || fail "sender died"
+	kill -0 $S 2>/dev/null || fail "receiver died"
+
+	kill -INT $A
+	wait $A || fail "sender did not exit cleanly"
+	kill -INT $S
+	wait $S || fail "receiver did not exit cleanly"
+}
+
+HZ=$(getconf CLK_TCK)
+
+measure udp
+measure shm --shm
+
+rm -rf $TMP
+echo "PASS"
@@ -0,0 +1,499 @@
+/* Microbenchmark of the SDU path of NORI.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+/* SDUs per second between two processes of the same host, over the UDP
+ * backend and through shared memory, in bursts of 64 bytes SDUs.
+ *
+ * System calls taken to drain the flows, per SDU read, against the number
+ * of flows: as the workers did before, switching every flow to
+ * non-blocking and back around each drain, and as they do now, with flows
+ * made non-blocking once. Runs over the loopback backend; fcntl, recvmmsg
+ * and epoll_wait are counted by wrapping them at link time.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../epoch.h"
+#include "../rinaw.h"
+
+/* SDUs read for every number of flows. */
+#define BENCH_SDUS		(1 << 18)
+/* Flows at most. */
+#define BENCH_FLOWS		1000
+/* Reads at most per flow and wake-up, as the workers do. */
+#define BENCH_BURST		32
+/* Seconds every pair of processes sends for. */
+#define BENCH_PAIR_SECS		2
+
+/* Counted system calls. */
+static unsigned long bench_fcntl = 0;
+static unsigned long bench_recv = 0;
+static unsigned long bench_wait = 0;
+
+int __real_fcntl(int fd, int cmd, ...);
+int __real_recvmmsg(int fd, struct mmsghdr * msgs, unsigned int n,
+	int flags, struct timespec * tmo);
+int __real_epoll_wait(int epfd, struct epoll_event * evs, int max, int tmo);
+
+int __wrap_fcntl(int fd, int cmd, ...) {
+	va_list va;
+	long arg = 0;
+
+	va_start(va, cmd);
+	arg = va_arg(va, long);
+	va_end(va);
+
+	bench_fcntl++;
+
+	return __real_fcntl(fd, cmd, arg);
+}
+
+int __wrap_recvmmsg(int fd, struct mmsghdr * msgs, unsigned int n,
+	int flags, struct timespec * tmo) {
+
+	bench_recv++;
+
+	return __real_recvmmsg(fd, msgs, n, flags, tmo);
+}
+
+int __wrap_epoll_wait(int epfd, struct epoll_event * evs, int max, int tmo) {
+	bench_wait++;
+
+	return __real_epoll_wait(epfd, evs, max, tmo);
+}
+
+/* State shared by the processes of a pair. */
+struct bench_pair {
+	/* Reader has the flow? */
+	int ready;
+	/* Writer is done? */
+	int stop;
+	/* SDUs sent and received. */
+	unsigned long tx;
+	unsigned long rx;
+	/* Nanoseconds the writer has been sending for. */
+	unsigned long ns;
+};
+
+/* Served side of the flows, filled by the listener. */
+static rina_flow bench_peer[BENCH_FLOWS];
+static int bench_peers = 0;
+
+static void * bench_serve(void * args) {
+	struct rina_AP_info * ap = (struct rina_AP_info *)args;
+
+	if(bench_peers < BENCH_FLOWS) {
+		bench_peer[bench_peers++] = ap->port;
+	}
+
+	free(ap);
+	return 0;
+}
+
+static void bench_release(int port) {
+	/* Nothing to do. */
+}
+
+static void bench_ready(int handle, rina_flow port) {
+	/* Nothing to do. */
+}
+
+/* Read a flow until it is empty, like the workers do. */
+static int bench_drain(rina_flow port, int toggle) {
+	char buf[2048];
+	int ret = 0;
+	int i = 0;
+
+	if(toggle) {
+		rina_async_flow(port);
+	}
+
+	for(i = 0; i < BENCH_BURST; i++) {
+		ret = rina_read_sdu(port, buf, sizeof(buf));
+
+		if(ret <= 0) {
+			break;
+		}
+	}
+
+	if(toggle) {
+		rina_sync_flow(port);
+	}
+
+	return i;
+}
+
+/* Every flow gets one SDU per round, and every flow is woken up and
+ * drained; report system calls per SDU read.
+ */
+static int bench(int n, int toggle) {
+	struct epoll_event ev = {0};
+	struct epoll_event evs[64];
+	struct timespec a;
+	struct timespec b;
+
+	rina_flow ports[BENCH_FLOWS];
+	char sdu[64] = {0};
+
+	unsigned long sdus = 0;
+	int flows = 0;
+	int epfd = -1;
+	int ret = -1;
+	int nev = 0;
+	int i = 0;
+	int j = 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if(epfd < 0) {
+		printf("Cannot create the epoll set\n");
+		return -1;
+	}
+
+	bench_peers = 0;
+
+	for(flows = 0; flows < n; flows++) {
+		ports[flows] = rina_request_flow(
+			"bench", "1", "bench", "2", 0, 0);
+
+		if(ports[flows] < 0) {
+			printf("Cannot allocate flow %d\n", flows);
+			goto out;
+		}
+	}
+
+	/* Let the listener hand the other side of them. */
+	while(bench_peers < n) {
+		rina_listen_for_events(
+			bench_serve, bench_release, bench_ready, 1);
+	}
+
+	for(i = 0; i < n; i++) {
+		/* The new way: once, for the whole life of the flow. */
+		if(!toggle) {
+			rina_async_flow(bench_peer[i]);
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD,
+			rina_flow_fd(bench_peer[i]), &ev)) {
+
+			printf("Cannot poll flow %d\n", bench_peer[i]);
+			goto out;
+		}
+	}
+
+	bench_fcntl = 0;
+	bench_recv = 0;
+	bench_wait = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+
+	while(sdus < BENCH_SDUS) {
+		for(i = 0; i < n; i++) {
+			rina_write_sdu(ports[i], sdu, sizeof(sdu));
+		}
+
+		/* Wake up until every flow has been drained. */
+		for(j = 0; j < n; j += nev) {
+			nev = epoll_wait(epfd, evs, 64, -1);
+
+			if(nev < 0) {
+				printf("Cannot wait for the flows\n");
+				goto out;
+			}
+
+			for(i = 0; i < nev; i++) {
+				sdus += bench_drain(
+					bench_peer[evs[i].data.u32], toggle);
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	printf("%8d %8s %8.2f %8.2f %8.2f %8.2f %10.1f\n",
+		n, toggle ? "toggle" : "once",
+		(double)bench_wait / sdus,
+		(double)bench_recv / sdus,
+		(double)bench_fcntl / sdus,
+		(double)(bench_wait + bench_recv + bench_fcntl) / sdus,
+		((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec)) / sdus);
+
+	ret = 0;
+out:
+	for(i = 0; i < flows; i++) {
+		rina_release_flow(ports[i]);
+	}
+
+	for(i = 0; i < bench_peers; i++) {
+		rina_release_flow(bench_peer[i]);
+	}
+
+	/* Let the releases go through, and the ports be used again. */
+	rina_listen_for_events(bench_serve, bench_release, bench_ready, 1);
+	ep_reclaim();
+
+	close(epfd);
+
+	return ret;
+}
+
+/* Start the backend of one process of a pair, with its AE. */
+static int bench_pair_init(int shm, const char * name) {
+	if(rina_backend_use("udp") || (shm && rina_backend_shm()) ||
+		rina_init()) {
+
+		printf("Cannot use the UDP backend\n");
+		return -1;
+	}
+
+	if(rina_create_AE(name, shm ? "shm" : "udp", 0)) {
+		printf("Cannot create the AE\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read all that comes until the writer stops. */
+static int bench_pair_read(struct bench_pair * p, int shm) {
+	struct iovec iov[BENCH_BURST];
+	char buf[BENCH_BURST][2048];
+	int ret = 0;
+	int i = 0;
+
+	if(bench_pair_init(shm, "sink")) {
+		return -1;
+	}
+
+	while(!bench_peers) {
+		rina_listen_for_events(
+			bench_serve, bench_release, bench_ready, 1);
+	}
+
+	rina_async_flow(bench_peer[0]);
+	__atomic_store_n(&p->ready, 1, __ATOMIC_RELEASE);
+
+	for(;;) {
+		for(i = 0; i < BENCH_BURST; i++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len = sizeof(buf[i]);
+		}
+
+		ret = rina_read_sdus(bench_peer[0], -1, iov, BENCH_BURST);
+
+		if(ret > 0) {
+			p->rx += ret;
+			continue;
+		}
+
+		if(ret < 0 || __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		sched_yield();
+	}
+
+	return 0;
+}
+
+/* Send bursts for a while, as fast as the reader takes them. */
+static int bench_pair_write(struct bench_pair * p, int shm) {
+	struct iovec iov[BENCH_BURST];
+	struct timespec a;
+	struct timespec b;
+
+	char sdu[64] = {0};
+	rina_flow port = -1;
+	int ret = 0;
+	int i = 0;
+
+	if(bench_pair_init(shm, "bench")) {
+		return -1;
+	}
+
+	port = rina_request_flow("bench", shm ? "shm" : "udp",
+		"sink", shm ? "shm" : "udp", 0, 0);
+
+	if(port < 0) {
+		printf("Cannot allocate the flow\n");
+		return -1;
+	}
+
+	rina_async_flow(port);
+
+	while(!__atomic_load_n(&p->ready, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+
+	do {
+		for(i = 0; i < BENCH_BURST; i++) {
+			iov[i].iov_base = sdu;
+			iov[i].iov_len = sizeof(sdu);
+		}
+
+		ret = rina_write_sdus(port, -1, iov, BENCH_BURST);
+
+		if(ret > 0) {
+			p->tx += ret;
+		} else if(ret == 0) {
+			sched_yield();
+		} else {
+			printf("Cannot write on the flow\n");
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &b);
+	} while(b.tv_sec - a.tv_sec < BENCH_PAIR_SECS ||
+		(b.tv_sec - a.tv_sec == BENCH_PAIR_SECS &&
+			b.tv_nsec < a.tv_nsec));
+
+	p->ns = (b.tv_sec - a.tv_sec) * 1000000000UL + b.tv_nsec - a.tv_nsec;
+
+	/* Let the reader take what is left. */
+	usleep(100000);
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Run a writer and a reader, each in its own process. */
+static int bench_pair(int shm) {
+	struct bench_pair * p = 0;
+	pid_t pid[2];
+	int status = 0;
+	int ret = 0;
+	int i = 0;
+
+	p = mmap(0, sizeof(struct bench_pair), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if(p == MAP_FAILED) {
+		printf("No more memory!\n");
+		return -1;
+	}
+
+	memset(p, 0, sizeof(struct bench_pair));
+
+	for(i = 0; i < 2; i++) {
+		pid[i] = fork();
+
+		if(pid[i] < 0) {
+			printf("Cannot fork\n");
+			return -1;
+		}
+
+		if(!pid[i]) {
+			ret = i ? bench_pair_write(p, shm) :
+				bench_pair_read(p, shm);
+
+			/* Do not leave the other one waiting. */
+			__atomic_store_n(&p->ready, 1, __ATOMIC_RELEASE);
+			__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+
+			_exit(ret ? 1 : 0);
+		}
+	}
+
+	for(i = 0; i < 2; i++) {
+		if(waitpid(pid[i], &status, 0) < 0 || !WIFEXITED(status) ||
+			WEXITSTATUS(status)) {
+
+			ret = -1;
+		}
+	}
+
+	if(!ret) {
+		printf("%8s %12lu %12lu %10.2f\n", shm ? "shm" : "udp",
+			p->tx, p->rx, p->ns ? p->rx * 1e3 / p->ns : 0);
+	}
+
+	munmap(p, sizeof(struct bench_pair));
+
+	return ret;
+}
+
+/* Numbers of flows tried. */
+static int bench_sizes[] = {1, 100, BENCH_FLOWS};
+
+int main(void) {
+	struct rlimit rl;
+	unsigned int i = 0;
+
+	/* Before this process starts a backend of its own. */
+	printf("%8s %12s %12s %10s\n", "pair", "sent", "received", "rate");
+	printf("%8s %12s %12s %10s\n", "", "(SDUs)", "(SDUs)", "(Mpps)");
+
+	if(bench_pair(0) || bench_pair(1)) {
+		return 1;
+	}
+
+	printf("\n");
+
+	/* Two sockets for every flow. */
+	if(!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if(rina_backend_use("loop") || rina_init()) {
+		printf("Cannot use the loopback backend\n");
+		return 1;
+	}
+
+	if(rina_create_AE("bench", "2", 0)) {
+		printf("Cannot create the AE\n");
+		return 1;
+	}
+
+	printf("%8s %8s %8s %8s %8s %8s %10s\n",
+		"flows", "mode", "wait", "read", "fcntl", "total", "time");
+	printf("%8s %8s %8s %8s %8s %8s %10s\n",
+		"", "", "(/SDU)", "(/SDU)", "(/SDU)", "(/SDU)", "(ns/SDU)");
+
+	for(i = 0; i < sizeof(bench_sizes) / sizeof(int); i++) {
+		if(bench(bench_sizes[i], 1) || bench(bench_sizes[i], 0)) {
+			return 1;
+		}
+	}
+
+	rina_stop();
+
+	return 0;
+}
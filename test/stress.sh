@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# Stress test for the flow table of NORI.
+#
+# Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Contributors and changes:
+#
+
+#
+# Two NORIs on the UDP backend of the same host: 'a' sends to eight
+# destinations, the same AE through eight DIFs, but keeps four flows at
+# most, so flows are allocated, evicted and released by both of them all
+# the time while traffic to all the destinations goes through at full
+# rate, on two queues. NORI 'a' has to forward traffic, evict flows and
+# exit cleanly, and so has the receiver.
+#
+# Needs root, for the TUN devices, and a NORI built with 'make IRATI=0'.
+# Build it with 'make IRATI=0 CFLAGS="-g -fsanitize=address"' to catch bad
+# reads of released flows too.
+#
+# Usage: test/stress.sh [seconds]
+#
+
+SECS=${1:-10}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TMP=$(mktemp -d /tmp/nori-stress-XXXXXX)
+
+DIFS="d0,d1,d2,d3,d4,d5,d6,d7"
+
+fail() {
+	echo "FAIL: $*"
+	kill -INT $A $S 2>/dev/null
+	sleep 1
+	echo "--- a"; tail -20 $TMP/a.log
+	echo "--- s"; tail -20 $TMP/s.log
+	exit 1
+}
+
+if [ ! -x $ROOT/nori ]; then
+	echo "Build NORI first, with 'make IRATI=0'."
+	exit 1
+fi
+
+printf 'default si a,1\n' > $TMP/ds
+
+for i in 0 1 2 3 4 5 6 7; do
+	printf 'ip dst 10.99.0.%d s,1 dif=d%d\n' $((10 + i)) $i >> $TMP/da
+done
+
+cd $TMP
+
+$ROOT/nori s 1 $DIFS --backend udp --devname nst1 ds > s.log 2>&1 &
+S=$!
+sleep 0.5
+
+$ROOT/nori a 1 d0 --backend udp --devname nst0 --queues 2 \
+	--max-flows 4 da > a.log 2>&1 &
+A=$!
+sleep 0.5
+
+kill -0 $S 2>/dev/null || fail "receiver did not start"
+kill -0 $A 2>/dev/null || fail "sender did not start"
+
+ip addr add 10.99.0.1/24 dev nst0 && ip link set nst0 up &&
+	ip link set nst1 up || fail "cannot set the devices up"
+
+RX=$(cat /sys/class/net/nst1/statistics/rx_packets)
+
+# Full rate, from more sockets so that both queues are used.
+python3 - $SECS <<'PY' &
+import socket, sys, time
+end = time.time() + float(sys.argv[1])
+ss = [socket.socket(socket.AF_INET, socket.SOCK_DGRAM) for i in range(8)]
+n = 0
+while time.time() < end:
+    for i in range(1000):
+        try:
+            ss[n % 8].sendto(b'x' * 64, ('10.99.0.%d' % (10 + n % 8), 9))
+        except OSError:
+            pass
+        n += 1
+PY
+P=$!
+
+# Stats are read while the flows change, too.
+while kill -0 $P 2>/dev/null; do
+	kill -USR1 $A $S 2>/dev/null
+	sleep 1
+done
+
+RX=$(( $(cat /sys/class/net/nst1/statistics/rx_packets) - RX ))
+
+kill -0 $A 2>/dev/null || fail "sender died"
+kill -0 $S 2>/dev/null || fail "receiver died"
+
+kill -USR1 $A
+sleep 0.5
+
+EV=$(grep '^Flows:' a.log | tail -1 | sed "s/.*, \([0-9]*\) evicted.*/\1/")
+
+kill -INT $A
+wait $A || fail "sender did not exit cleanly"
+kill -INT $S
+wait $S || fail "receiver did not exit cleanly"
+
+grep -q 'ERROR: AddressSanitizer' a.log s.log && fail "bad memory access"
+
+echo "Forwarded $RX packets, $EV flows evicted, in $SECS seconds"
+
+[ "$RX" -gt 0 ] || fail "nothing forwarded"
+[ "${EV:-0}" -gt 0 ] || fail "no flow evicted"
+
+rm -rf $TMP
+echo "PASS"
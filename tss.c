@@ -0,0 +1,229 @@
+/* Tuple space search of 5-tuples.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tss.h"
+
+/* Tuples allocated at first. */
+#define TSS_TUPLES		8
+/* Entries of a new tuple. */
+#define TSS_ENTRIES		16
+
+/* Look for the entry of a key in a tuple, or for the empty one where it
+ * goes.
+ */
+static inline struct tss_entry * tss_slot(
+	struct tss_tuple * t, uint64_t key[2]) {
+
+	struct tss_entry * e = 0;
+	unsigned int i = tss_hash(key) & t->size;
+
+	for(;;) {
+		e = &t->e[i];
+
+		if(!e->val || (e->key[0] == key[0] && e->key[1] == key[1])) {
+			return e;
+		}
+
+		i = (i + 1) & t->size;
+	}
+}
+
+/* Double the entries of a tuple.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+static int tss_grow(struct tss_tuple * t) {
+	struct tss_entry * old = t->e;
+	unsigned int n = t->size + 1;
+	unsigned int i = 0;
+
+	t->e = calloc(n * 2, sizeof(struct tss_entry));
+
+	if(!t->e) {
+		t->e = old;
+		return -1;
+	}
+
+	t->size = n * 2 - 1;
+
+	for(i = 0; i < n; i++) {
+		if(old[i].val) {
+			*tss_slot(t, old[i].key) = old[i];
+		}
+	}
+
+	free(old);
+
+	return 0;
+}
+
+/* Look for the tuple with the given mask, or add it.
+ *
+ * Returns the tuple, or 0 on error.
+ */
+static struct tss_tuple * tss_tuple(
+	struct tss * s, uint64_t mask[2], uint32_t val) {
+
+	struct tss_tuple * t = 0;
+	unsigned long h = ht_hash_int(mask[0]) ^
+		((unsigned long)ht_hash_int(mask[1]) << 32);
+	unsigned int max = 0;
+	unsigned int n = 0;
+	unsigned int i = 0;
+
+	if(!s->masks.b && ht_init(&s->masks, TSS_TUPLES)) {
+		return 0;
+	}
+
+	n = (unsigned long)ht_get(&s->masks, h, ht_hash_int(h));
+
+	if(n && s->t[n - 1].mask[0] == mask[0] &&
+		s->t[n - 1].mask[1] == mask[1]) {
+
+		return &s->t[n - 1];
+	}
+
+	/* Another mask with the same hash; very unlikely. */
+	if(n) {
+		for(i = 0; i < s->nr; i++) {
+			if(s->t[i].mask[0] == mask[0] &&
+				s->t[i].mask[1] == mask[1]) {
+
+				return &s->t[i];
+			}
+		}
+	}
+
+	if(s->nr == s->max) {
+		max = s->max ? s->max * 2 : TSS_TUPLES;
+		t = realloc(s->t, sizeof(struct tss_tuple) * max);
+
+		if(!t) {
+			return 0;
+		}
+
+		s->t = t;
+		s->max = max;
+	}
+
+	t = &s->t[s->nr];
+	memset(t, 0, sizeof(struct tss_tuple));
+
+	t->e = calloc(TSS_ENTRIES, sizeof(struct tss_entry));
+
+	if(!t->e) {
+		return 0;
+	}
+
+	if(!n && ht_add(&s->masks, h, ht_hash_int(h),
+		(void *)(unsigned long)(s->nr + 1))) {
+
+		free(t->e);
+		return 0;
+	}
+
+	t->mask[0] = mask[0];
+	t->mask[1] = mask[1];
+	t->size = TSS_ENTRIES - 1;
+	/* Values come in increasing order, so tuples stay sorted. */
+	t->pri = val;
+
+	s->nr++;
+
+	return t;
+}
+
+void tss_free(struct tss * s) {
+	unsigned int i = 0;
+
+	for(i = 0; i < s->nr; i++) {
+		free(s->t[i].e);
+	}
+
+	free(s->t);
+
+	if(s->masks.b) {
+		ht_free(&s->masks);
+	}
+
+	memset(s, 0, sizeof(struct tss));
+}
+
+int tss_add(struct tss * s, uint64_t key[2], uint64_t mask[2], uint32_t val) {
+	struct tss_tuple * t = tss_tuple(s, mask, val);
+	struct tss_entry * e = 0;
+	uint64_t k[2];
+
+	if(!t) {
+		return -1;
+	}
+
+	k[0] = key[0] & mask[0];
+	k[1] = key[1] & mask[1];
+
+	/* Keep at most half of the entries used. */
+	if((t->count + 1) * 2 > t->size + 1 && tss_grow(t)) {
+		return -1;
+	}
+
+	e = tss_slot(t, k);
+
+	/* An earlier value wins. */
+	if(e->val) {
+		return 0;
+	}
+
+	e->key[0] = k[0];
+	e->key[1] = k[1];
+	e->val = val;
+
+	t->count++;
+
+	return 0;
+}
+
+uint32_t tss_get(struct tss * s, uint64_t key[2], uint32_t best) {
+	struct tss_tuple * t = 0;
+	struct tss_entry * e = 0;
+	uint64_t k[2];
+	unsigned int i = 0;
+
+	for(i = 0; i < s->nr; i++) {
+		t = &s->t[i];
+
+		/* Nothing better in this tuple and in the ones after it. */
+		if(best && t->pri >= best) {
+			break;
+		}
+
+		k[0] = key[0] & t->mask[0];
+		k[1] = key[1] & t->mask[1];
+
+		e = tss_slot(t, k);
+
+		if(e->val && (!best || e->val < best)) {
+			best = e->val;
+		}
+	}
+
+	return best;
+}
@@ -0,0 +1,104 @@
+/* Tuple space search of 5-tuples.
+ *
+ * Copyright (c) 2016 Kewin Rausch <kewin.rausch@create-net.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Contributors and changes:
+ */
+
+#ifndef __NORI_TSS_H
+#define __NORI_TSS_H
+
+#include <stdint.h>
+
+#include "htable.h"
+
+/* Set in the key of a packet which carries ports (type and code for ICMP);
+ * rules on ports never match the others, like fragments after the first.
+ */
+#define TSS_L4			(1ULL << 40)
+
+/* Entry of a tuple; empty if it has no value. */
+struct tss_entry {
+	/* Key, already masked. */
+	uint64_t key[2];
+	/* Value of the key. */
+	uint32_t val;
+};
+
+/* Keys which check the same bits of the fields, in a hash table. */
+struct tss_tuple {
+	/* Bits checked. */
+	uint64_t mask[2];
+	/* Smallest value in the tuple. */
+	uint32_t pri;
+	/* Entries - 1; the number of entries is a power of 2. */
+	unsigned int size;
+	/* Entries used. */
+	unsigned int count;
+	/* The entries. */
+	struct tss_entry * e;
+};
+
+/* Tuple space of 5-tuples.
+ *
+ * A key has the addresses in its first word, and the protocol and the
+ * ports in the second one (see tss_key). Rules are split by the bits they
+ * check, and a lookup has one hash lookup for each of these tuples; these
+ * are kept by their smallest value, so the lookup stops as soon as no
+ * tuple left can give a smaller one than what was found. The space is not
+ * thread safe while it is changed.
+ */
+struct tss {
+	/* The tuples, by their smallest value. */
+	struct tss_tuple * t;
+	/* Tuples used, and allocated. */
+	unsigned int nr;
+	unsigned int max;
+	/* Position + 1 of the tuples, by the hash of their mask. */
+	struct htable masks;
+};
+
+/* Key of the given fields, in host byte order. */
+static inline void tss_key(uint64_t key[2],
+	uint32_t src, uint32_t dst, int proto, int sport, int dport) {
+
+	key[0] = ((uint64_t)src << 32) | dst;
+	key[1] = ((uint64_t)proto << 32) |
+		((uint64_t)sport << 16) | (uint64_t)dport;
+}
+
+/* Hash of a key. */
+static inline unsigned int tss_hash(uint64_t key[2]) {
+	return ht_hash_int(key[0] ^ (key[1] * 0x9e3779b97f4a7c15UL));
+}
+
+/* Release the space. */
+void tss_free(struct tss * s);
+
+/* Give 'val' to the keys which are equal to 'key' in the bits of 'mask',
+ * unless they already have one. Values cannot be 0, and have to be given
+ * in increasing order.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int tss_add(struct tss * s, uint64_t key[2], uint64_t mask[2], uint32_t val);
+
+/* Smallest value of a key, if smaller than 'best'; 0 for no bound.
+ *
+ * Returns the value, 'best' if there is no smaller one.
+ */
+uint32_t tss_get(struct tss * s, uint64_t key[2], uint32_t best);
+
+#endif /* __NORI_TSS_H */
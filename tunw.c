@@ -58,11 +58,6 @@ int tun_create(char * name, int type, int persistent) {
 		return -1;
 	}
 
-	if(persistent) {
-		printf("Creation of persistent device not supported yet.\n");
-		return -1;
-	}
-
 	fd = open(TUN_PATH, O_RDWR);
 
 	if(fd < 0) {
@@ -78,6 +73,11 @@ int tun_create(char * name, int type, int persistent) {
 
 	err = ioctl(fd, TUNSETIFF, (void *)&i);
 
+	/* Survives the close; attached again when asked by name. */
+	if(err >= 0 && persistent) {
+		err = ioctl(fd, TUNSETPERSIST, 1);
+	}
+
 	if(err < 0) {
 		close(fd);
 		return -1;
@@ -89,6 +89,59 @@ int tun_create(char * name, int type, int persistent) {
 	return fd;
 }
 
+int tun_create_mq(char * name, int type, int persistent, int * fds, int queues) {
+	int i = 0;
+	int j = 0;
+
+	struct ifreq r = {0};
+
+	if(type == TUNW_MODE_TAP) {
+		printf("TAP not supported yet.\n");
+		return -1;
+	}
+
+	if(queues < 1 || queues > TUNW_MAX_QUEUES) {
+		return -1;
+	}
+
+	/* Every queue is attached by asking for the same device again. */
+	r.ifr_flags = IFF_TUN | IFF_MULTI_QUEUE;
+
+	if(strlen(name) != 0) {
+		strncpy(r.ifr_name, name, IFNAMSIZ);
+	}
+
+	for(i = 0; i < queues; i++) {
+		fds[i] = open(TUN_PATH, O_RDWR);
+
+		if(fds[i] < 0) {
+			goto err;
+		}
+
+		if(ioctl(fds[i], TUNSETIFF, (void *)&r) < 0) {
+			close(fds[i]);
+			goto err;
+		}
+	}
+
+	/* Queues are attached to the device, which is persistent as a whole. */
+	if(persistent && ioctl(fds[0], TUNSETPERSIST, 1) < 0) {
+		goto err;
+	}
+
+	/* Get the name assigned by the kernel. */
+	strncpy(name, r.ifr_name, IFNAMSIZ);
+
+	return 0;
+
+err:
+	for(j = 0; j < i; j++) {
+		close(fds[j]);
+	}
+
+	return -1;
+}
+
 int tun_read(int fd, char * buf, int size) {
 	return read(fd, buf, size);
 }
@@ -25,6 +25,9 @@
 /* We are speaking of a TAP device. */
 #define TUNW_MODE_TAP		1
 
+/* Maximum number of queues of a device (same as the kernel one). */
+#define TUNW_MAX_QUEUES		256
+
 /* Switches the I/O method for the tun FD to non-blocking operations.
  *
  * Returns 0 on success, a negative error number on error.
@@ -41,12 +44,22 @@ int tun_close(int fd);
  * the kernel the decision of the name to apply to such interface.
  *
  * You also have to specify the type of device you want to spawn (TUN or TAP?).
- * You can choose persistent=1 if you want the device to remain active.
+ * You can choose persistent=1 if you want the device to remain active once
+ * its descriptors are closed; a device left there with the same name is
+ * attached again, with its addresses and routes.
  *
  * Returns the number of bytes read, a negative number on error.
  */
 int tun_create(char * name, int type, int persistent);
 
+/* Creates a brand-new tun/tap device with more queues, each one with its own
+ * fd stored in 'fds'. Traffic of the same connection is always delivered on
+ * the same queue by the kernel. Other arguments are as for tun_create.
+ *
+ * Returns 0 on success, a negative error number on error.
+ */
+int tun_create_mq(char * name, int type, int persistent, int * fds, int queues);
+
 /* Read from a tun/tap device.
  *
  * Returns the number of bytes read, a negative number on error.